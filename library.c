@@ -0,0 +1,6853 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "library.h"
+
+// Append-only journal of catalog changes. Each record is written with a
+// single write() as soon as the change is accepted; fsync is batched over
+// a group of records or a short time window (group commit).
+#define JOURNAL_GROUP_RECORDS 64          // fsync at least every N records...
+#define JOURNAL_GROUP_MS      50          // ...or once the oldest unsynced record is this old
+#define JOURNAL_COMPACT_BYTES (4 << 20)   // Fold into a snapshot past this size
+
+typedef struct {
+    uint32_t length;       // Payload bytes following the header
+    uint32_t checksum;     // FNV-1a of the payload, detects torn tail writes
+    uint64_t seq;          // Monotonic record number
+    uint32_t type;         // One of the JOURNAL_* record types
+} JournalRecordHeader;
+
+struct Journal {
+    int fd;
+    uint64_t next_seq;     // Sequence number of the next record
+    int pending;           // Records written since the last fsync
+    long long first_pending_ms; // Monotonic time of the oldest unsynced record
+    long long size;        // Current file size, drives compaction
+    int broken;            // A partial record could not be cut off; appends are refused
+    pthread_mutex_t lock;  // Serialises appends from concurrent server workers
+};
+
+// On-disk snapshot layout (host byte order). The file is a header followed
+// by fixed-width book and student records, then an image of the library's
+// string pool and one of the student system's. Records refer to strings by
+// their offset in the image, exactly as a loaded Book or Student does, so
+// loading maps each image into its pool without touching the records.
+// Every image starts with its NUL-terminated strings (the first one empty)
+// and, for books, continues with the StringRef arrays of multi-author books.
+#define SNAPSHOT_MAGIC   "LIBSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ALIGN   65536     // Images start here so any page size can map them
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t book_count;
+    uint32_t student_count;
+    uint32_t reserved;
+    uint64_t books_offset;     // File offsets of each section
+    uint64_t students_offset;
+    uint64_t book_strings_offset;
+    uint64_t book_strings_size;
+    uint64_t book_strings_text; // Bytes of strings at the start of the image
+    uint64_t student_strings_offset;
+    uint64_t student_strings_size;
+    uint64_t journal_seq;      // Last journal record folded into this snapshot
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t title;            // Offset into the book string image
+    uint32_t authors;          // Same meaning as Book.authors
+    int32_t borrower;          // Student record index, -1 if available
+    int16_t year;
+    uint16_t pages;
+    uint8_t author_count;
+    uint8_t reserved[3];
+} SnapshotBook;
+
+typedef struct {
+    int32_t student_id;
+    uint32_t name;             // Offset into the student string image
+    int32_t max_books;
+    int32_t reserved;
+} SnapshotStudent;
+
+/* ================== INSTRUMENTATION ==================== */
+
+// Latency and counters for the core operations, compiled out entirely with
+// -DLIBRARY_NO_METRICS. Every operation keeps a log-linear histogram of its
+// latency in nanoseconds: 16 buckets per power of two, so a percentile read
+// from it is within 1/16 (about 6%) of the exact value. The histograms take
+// relaxed atomic adds; allocations and substring comparisons happen far
+// more often, so they are counted in a block per thread and summed up by
+// the report. Allocations are counted only where the engine calls the
+// lib_malloc() family, so the allocator figures cover the engine and
+// nothing else; the benchmark shares the histogram functions.
+enum {
+    METRIC_ADD_BOOK,
+    METRIC_SEARCH_BOOKS,
+    METRIC_RANK_BOOKS,
+    METRIC_RANGE_BOOKS,
+    METRIC_FIND_TITLE,
+    METRIC_FIND_STUDENT,
+    METRIC_BORROW,
+    METRIC_RETURN,
+    METRIC_REMOVE_BOOK,
+    METRIC_OPERATIONS
+};
+
+// Values below 16 get a bucket each; above that, each power of two is cut
+// into 16 equal buckets. The benchmark keeps its latencies the same way.
+int histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+           (int)((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls into the bucket
+uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return low + (((uint64_t)1 << shift) - 1);
+}
+
+// Smallest bucket limit that covers a fraction q of the total samples,
+// capped at the largest value recorded
+uint64_t histogram_quantile(const uint64_t *buckets, uint64_t total, double q, uint64_t max) {
+    double exact = q * (double)total;
+    uint64_t rank = (uint64_t)exact;
+    if ((double)rank < exact || rank == 0) {
+        rank++;
+    }
+    
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+#ifndef LIBRARY_NO_METRICS
+
+static const char *const metric_names[METRIC_OPERATIONS] = {
+    "add_book", "search_books", "rank_books", "range_books", "find_book_by_title",
+    "find_student_by_name", "borrow_book", "return_book", "remove_book"
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t allocations;      // Made on the calling thread while it ran
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} OperationMetrics;
+
+static OperationMetrics operation_metrics[METRIC_OPERATIONS];
+
+// Only the owning thread writes its block, so a relaxed load and store
+// does; the report reads it with relaxed loads while it changes
+typedef struct ThreadMetrics {
+    uint64_t allocations;      // Everything lib_free() may later release
+    uint64_t reallocations;
+    uint64_t frees;
+    uint64_t allocated_bytes;  // Requested by all three
+    uint64_t searches;         // case_insensitive_search() calls
+    uint64_t comparisons;      // Candidate positions compared in full
+    struct ThreadMetrics *next;
+} ThreadMetrics;
+
+static ThreadMetrics *metrics_threads = NULL;  // Every block handed out so far
+static pthread_mutex_t metrics_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadMetrics metrics_fallback;         // Shared (and lossy) if a block can't be allocated
+static __thread ThreadMetrics *metrics_self = NULL;
+static __thread uint64_t metrics_comparisons = 0; // Not yet added to the thread's block
+static sigset_t metrics_signals;
+
+// Blocks outlive their threads, so the totals keep what finished threads counted
+static ThreadMetrics* thread_metrics(void) {
+    if (metrics_self == NULL) {
+        ThreadMetrics *block = calloc(1, sizeof(ThreadMetrics));
+        if (block == NULL) {
+            metrics_self = &metrics_fallback;
+            return metrics_self;
+        }
+        pthread_mutex_lock(&metrics_threads_lock);
+        block->next = metrics_threads;
+        metrics_threads = block;
+        pthread_mutex_unlock(&metrics_threads_lock);
+        metrics_self = block;
+    }
+    return metrics_self;
+}
+
+static inline void metrics_bump(uint64_t *counter, uint64_t amount) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static void* lib_malloc(size_t size) {
+    ThreadMetrics *self = thread_metrics();
+    metrics_bump(&self->allocations, 1);
+    metrics_bump(&self->allocated_bytes, size);
+    return malloc(size);
+}
+
+static void* lib_calloc(size_t count, size_t size) {
+    ThreadMetrics *self = thread_metrics();
+    metrics_bump(&self->allocations, 1);
+    metrics_bump(&self->allocated_bytes, count * size);
+    return calloc(count, size);
+}
+
+// Growing from NULL is an allocation, so that frees never outnumber them
+static void* lib_realloc(void *ptr, size_t size) {
+    ThreadMetrics *self = thread_metrics();
+    metrics_bump(ptr == NULL ? &self->allocations : &self->reallocations, 1);
+    metrics_bump(&self->allocated_bytes, size);
+    return realloc(ptr, size);
+}
+
+static void lib_free(void *ptr) {
+    if (ptr != NULL) {
+        metrics_bump(&thread_metrics()->frees, 1);
+    }
+    free(ptr);
+}
+
+static char* lib_strdup(const char *text) {
+    size_t size = strlen(text) + 1;
+    char *copy = lib_malloc(size);
+    if (copy != NULL) {
+        memcpy(copy, text, size);
+    }
+    return copy;
+}
+
+static uint64_t metrics_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+typedef struct {
+    uint64_t started;
+    uint64_t allocations;      // The thread's count when the timer started
+} MetricTimer;
+
+static MetricTimer metrics_start(void) {
+    MetricTimer timer = { metrics_now_ns(), thread_metrics()->allocations };
+    return timer;
+}
+
+static void metrics_stop(int operation, MetricTimer timer) {
+    uint64_t elapsed = metrics_now_ns() - timer.started;
+    OperationMetrics *metrics = &operation_metrics[operation];
+    
+    __atomic_fetch_add(&metrics->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics->allocations, thread_metrics()->allocations - timer.allocations, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics->buckets[histogram_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+    
+    uint64_t max_ns = __atomic_load_n(&metrics->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max_ns &&
+           !__atomic_compare_exchange_n(&metrics->max_ns, &max_ns, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void metrics_add_thread(ThreadMetrics *sum, ThreadMetrics *block) {
+    sum->allocations += __atomic_load_n(&block->allocations, __ATOMIC_RELAXED);
+    sum->reallocations += __atomic_load_n(&block->reallocations, __ATOMIC_RELAXED);
+    sum->frees += __atomic_load_n(&block->frees, __ATOMIC_RELAXED);
+    sum->allocated_bytes += __atomic_load_n(&block->allocated_bytes, __ATOMIC_RELAXED);
+    sum->searches += __atomic_load_n(&block->searches, __ATOMIC_RELAXED);
+    sum->comparisons += __atomic_load_n(&block->comparisons, __ATOMIC_RELAXED);
+}
+
+// Writes every operation's latency summary and the counters. Safe to call
+// while operations run: each figure is read atomically, though figures of
+// one operation may be a few samples apart.
+void metrics_report(OutputBuffer *out, int format) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *const quantile_names[] = { "p50_ns", "p90_ns", "p99_ns", "p999_ns" };
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    char line[256];
+    int len;
+    
+    if (format == METRICS_JSON) {
+        output_string(out, "{\"operations\":{");
+    } else {
+        len = snprintf(line, sizeof(line), "%-22s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+                       "operation (µs)", "count", "mean", "p50", "p90", "p99", "p99.9", "max", "allocs/op");
+        output_bytes(out, line, len);
+    }
+    
+    for (int op = 0; op < METRIC_OPERATIONS; op++) {
+        OperationMetrics *metrics = &operation_metrics[op];
+        uint64_t count = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            buckets[i] = __atomic_load_n(&metrics->buckets[i], __ATOMIC_RELAXED);
+            count += buckets[i];
+        }
+        uint64_t total_ns = __atomic_load_n(&metrics->total_ns, __ATOMIC_RELAXED);
+        uint64_t max_ns = __atomic_load_n(&metrics->max_ns, __ATOMIC_RELAXED);
+        uint64_t allocations = __atomic_load_n(&metrics->allocations, __ATOMIC_RELAXED);
+        uint64_t values[4] = { 0, 0, 0, 0 };
+        for (int q = 0; count > 0 && q < 4; q++) {
+            values[q] = histogram_quantile(buckets, count, quantiles[q], max_ns);
+        }
+        uint64_t mean_ns = count > 0 ? total_ns / count : 0;
+        
+        if (format == METRICS_JSON) {
+            len = snprintf(line, sizeof(line), "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"mean_ns\":%llu",
+                           op > 0 ? "," : "", metric_names[op], (unsigned long long)count,
+                           (unsigned long long)total_ns, (unsigned long long)mean_ns);
+            output_bytes(out, line, len);
+            for (int q = 0; q < 4; q++) {
+                len = snprintf(line, sizeof(line), ",\"%s\":%llu", quantile_names[q], (unsigned long long)values[q]);
+                output_bytes(out, line, len);
+            }
+            len = snprintf(line, sizeof(line), ",\"max_ns\":%llu,\"allocations\":%llu}",
+                           (unsigned long long)max_ns, (unsigned long long)allocations);
+        } else {
+            len = snprintf(line, sizeof(line), "%-22s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.2f\n",
+                           metric_names[op], (unsigned long long)count, mean_ns / 1000.0,
+                           values[0] / 1000.0, values[1] / 1000.0, values[2] / 1000.0, values[3] / 1000.0,
+                           max_ns / 1000.0, count > 0 ? (double)allocations / count : 0.0);
+        }
+        output_bytes(out, line, len);
+    }
+    
+    ThreadMetrics sum;
+    memset(&sum, 0, sizeof(sum));
+    metrics_add_thread(&sum, &metrics_fallback);
+    pthread_mutex_lock(&metrics_threads_lock);
+    for (ThreadMetrics *block = metrics_threads; block != NULL; block = block->next) {
+        metrics_add_thread(&sum, block);
+    }
+    pthread_mutex_unlock(&metrics_threads_lock);
+    
+    if (format == METRICS_JSON) {
+        len = snprintf(line, sizeof(line),
+                       "},\"case_insensitive_search\":{\"calls\":%llu,\"comparisons\":%llu},"
+                       "\"allocator\":{\"allocations\":%llu,\"reallocations\":%llu,\"frees\":%llu,\"bytes\":%llu}}\n",
+                       (unsigned long long)sum.searches, (unsigned long long)sum.comparisons,
+                       (unsigned long long)sum.allocations, (unsigned long long)sum.reallocations,
+                       (unsigned long long)sum.frees, (unsigned long long)sum.allocated_bytes);
+    } else {
+        len = snprintf(line, sizeof(line),
+                       "case_insensitive_search: %llu calls, %llu full comparisons\n"
+                       "allocator: %llu allocations, %llu reallocations, %llu frees, %llu bytes requested\n",
+                       (unsigned long long)sum.searches, (unsigned long long)sum.comparisons,
+                       (unsigned long long)sum.allocations, (unsigned long long)sum.reallocations,
+                       (unsigned long long)sum.frees, (unsigned long long)sum.allocated_bytes);
+    }
+    output_bytes(out, line, len);
+}
+
+static void* metrics_signal_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        int signum;
+        if (sigwait(&metrics_signals, &signum) != 0) {
+            continue;
+        }
+        OutputBuffer out = { 2, malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+        if (out.data != NULL) {
+            metrics_report(&out, signum == SIGUSR2 ? METRICS_JSON : METRICS_TEXT);
+            output_flush(&out);
+            free(out.data);
+        }
+    }
+    return NULL;
+}
+
+// SIGUSR1 writes the report to stderr as text, SIGUSR2 as JSON. Call this
+// before any other thread starts: threads inherit the blocked signals, so
+// only the watcher ever receives them.
+int metrics_watch_signals(void) {
+    sigemptyset(&metrics_signals);
+    sigaddset(&metrics_signals, SIGUSR1);
+    sigaddset(&metrics_signals, SIGUSR2);
+    if (pthread_sigmask(SIG_BLOCK, &metrics_signals, NULL) != 0) {
+        return 0;
+    }
+    
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, metrics_signal_thread, NULL) != 0) {
+        return 0;
+    }
+    pthread_detach(watcher);
+    return 1;
+}
+
+#define METRIC_START(timer)           MetricTimer timer = metrics_start()
+#define METRIC_STOP(operation, timer) metrics_stop(operation, timer)
+#define METRIC_SEARCH()               metrics_bump(&thread_metrics()->searches, 1)
+#define METRIC_COMPARISON()           (metrics_comparisons++)
+#define METRIC_SEARCH_DONE()          (metrics_bump(&thread_metrics()->comparisons, metrics_comparisons), \
+                                       metrics_comparisons = 0)
+#else
+#define lib_malloc(size)        malloc(size)
+#define lib_calloc(count, size) calloc(count, size)
+#define lib_realloc(ptr, size)  realloc(ptr, size)
+#define lib_free(ptr)           free(ptr)
+#define lib_strdup(text)        strdup(text)
+#define METRIC_START(timer)
+#define METRIC_STOP(operation, timer)
+#define METRIC_SEARCH()
+#define METRIC_COMPARISON()
+#define METRIC_SEARCH_DONE()
+#endif
+
+/* =============== FUNCTION IMPLEMENTATIONS ================== */
+
+Library* create_library(int initial_capacity) {
+    Library *lib = lib_malloc(sizeof(Library));
+    if (lib == NULL) {
+        return NULL;
+    }
+    
+    lib->books = lib_malloc(sizeof(Book) * initial_capacity);
+    if (lib->books == NULL) {
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!book_columns_init(&lib->columns, initial_capacity)) {
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    lib->slots = lib_malloc(sizeof(BookSlot) * initial_capacity);
+    if (lib->slots == NULL) {
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!name_index_init(&lib->title_index, initial_capacity)) {
+        lib_free(lib->slots);
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!trigram_index_init(&lib->text_index)) {
+        name_index_free(&lib->title_index);
+        lib_free(lib->slots);
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!word_index_init(&lib->word_index)) {
+        trigram_index_free(&lib->text_index);
+        name_index_free(&lib->title_index);
+        lib_free(lib->slots);
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!int_index_init(&lib->year_index)) {
+        word_index_free(&lib->word_index);
+        trigram_index_free(&lib->text_index);
+        name_index_free(&lib->title_index);
+        lib_free(lib->slots);
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!int_index_init(&lib->page_index)) {
+        int_index_free(&lib->year_index);
+        word_index_free(&lib->word_index);
+        trigram_index_free(&lib->text_index);
+        name_index_free(&lib->title_index);
+        lib_free(lib->slots);
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    if (!string_pool_init(&lib->strings)) {
+        int_index_free(&lib->page_index);
+        int_index_free(&lib->year_index);
+        word_index_free(&lib->word_index);
+        trigram_index_free(&lib->text_index);
+        name_index_free(&lib->title_index);
+        lib_free(lib->slots);
+        book_columns_free(&lib->columns);
+        lib_free(lib->books);
+        lib_free(lib);
+        return NULL;
+    }
+    
+    lib->book_count = 0;
+    lib->author_total = 0;
+    lib->page_total = 0;
+    lib->borrowed_total = 0;
+    lib->capacity = initial_capacity;
+    lib->slot_count = 0;
+    lib->slot_capacity = initial_capacity;
+    lib->free_slot = -1;
+    lib->bulk_start = -1;
+    lib->missed_indexes = 0;
+    lib->journal = NULL;
+    
+    return lib;
+}
+
+// Returns 1 if the title or one of the authors contains the search term
+static int book_matches(const Library *lib, const Book *book, const char *search_term) {
+    if (case_insensitive_search(book_title(lib, book), search_term)) {
+        return 1;
+    }
+    for (int j = 0; j < book->author_count; j++) {
+        if (case_insensitive_search(book_author(lib, book, j), search_term)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Same teardown as cleanup_library without the console report
+void destroy_library(Library *lib) {
+    if(lib == NULL) return;
+
+    string_pool_free(&lib->strings);
+    lib_free(lib->books);
+    book_columns_free(&lib->columns);
+    lib_free(lib->slots);
+    name_index_free(&lib->title_index);
+    trigram_index_free(&lib->text_index);
+    word_index_free(&lib->word_index);
+    int_index_free(&lib->year_index);
+    int_index_free(&lib->page_index);
+    lib_free(lib);
+}
+
+void cleanup_book(Book *book) {
+    // Title and authors live in the string pool and are released in bulk
+    // with their owner
+    book->title = 0;
+    book->authors = 0;
+    book->borrower = -1;
+    book->author_count = 0;
+    book->is_available = 1;
+}
+
+StudentSystem* create_student_system(int initial_capacity) {
+    StudentSystem *student_sys = lib_malloc(sizeof(StudentSystem));
+    if(student_sys == NULL) {
+        return NULL;
+    }
+
+    student_sys->students = lib_malloc(sizeof(Student) * initial_capacity);
+    if(student_sys->students == NULL) {
+        lib_free(student_sys);
+        return NULL;
+    }
+
+    if(!name_index_init(&student_sys->name_index, initial_capacity)) {
+        lib_free(student_sys->students);
+        lib_free(student_sys);
+        return NULL;
+    }
+
+    if(!activity_heap_init(&student_sys->activity, initial_capacity)) {
+        name_index_free(&student_sys->name_index);
+        lib_free(student_sys->students);
+        lib_free(student_sys);
+        return NULL;
+    }
+
+    if(!string_pool_init(&student_sys->strings)) {
+        activity_heap_free(&student_sys->activity);
+        name_index_free(&student_sys->name_index);
+        lib_free(student_sys->students);
+        lib_free(student_sys);
+        return NULL;
+    }
+
+    pthread_mutex_init(&student_sys->loan_lock, NULL);
+    student_sys->views = NULL;
+    student_sys->missed_indexes = 0;
+    student_sys->student_count = 0;
+    student_sys->student_capacity = initial_capacity;
+    student_sys->journal = NULL;
+    return student_sys;
+}
+
+// Same teardown as cleanup_student_system without the console report
+void destroy_student_system(StudentSystem *sys) {
+    if(sys == NULL) return;
+
+    string_pool_free(&sys->strings);
+    lib_free(sys->students);
+    name_index_free(&sys->name_index);
+    activity_heap_free(&sys->activity);
+    pthread_mutex_destroy(&sys->loan_lock);
+    lib_free(sys);
+}
+
+void cleanup_student(Student *student) {
+    if(student == NULL) return;
+    
+    // The name belongs to the student pool and is released in bulk
+    student->name = 0;
+    student->student_id = 0;
+    student->borrowed_count = 0;
+    student->max_books = 0;
+}
+
+static Student* find_student_by_name_untimed(StudentSystem *sys, const char *name) {
+    if (sys == NULL || name == NULL) {
+        return NULL;
+    }
+    
+    // Exact, case-insensitive match through the name index
+    NameIndex *index = &sys->name_index;
+    unsigned int hash = case_folded_hash(name);
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    
+    for (unsigned int slot = hash & mask; index->positions[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int pos = index->positions[slot];
+        if (pos >= 0 && index->hashes[slot] == hash &&
+            case_insensitive_equals(student_name(sys, &sys->students[pos]), name)) {
+            return &sys->students[pos];
+        }
+    }
+    
+    return NULL; 
+}
+
+Student* find_student_by_name(StudentSystem *sys, const char *name) {
+    METRIC_START(timer);
+    Student *found = find_student_by_name_untimed(sys, name);
+    METRIC_STOP(METRIC_FIND_STUDENT, timer);
+    return found;
+}
+
+static Book* find_book_by_title_untimed(Library *lib, const char *title) {
+    if (lib == NULL || title == NULL) {
+        return NULL;
+    }
+    
+    // Exact, case-insensitive match through the title index
+    NameIndex *index = &lib->title_index;
+    unsigned int hash = case_folded_hash(title);
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    
+    for (unsigned int slot = hash & mask; index->positions[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        int book_slot = index->positions[slot];
+        if (book_slot >= 0 && index->hashes[slot] == hash) {
+            Book *book = library_book_in_slot(lib, book_slot);
+            if (case_insensitive_equals(book_title(lib, book), title)) {
+                return book;
+            }
+        }
+    }
+    
+    return NULL; 
+}
+
+Book* find_book_by_title(Library *lib, const char *title) {
+    METRIC_START(timer);
+    Book *found = find_book_by_title_untimed(lib, title);
+    METRIC_STOP(METRIC_FIND_TITLE, timer);
+    return found;
+}
+
+Student* find_student_by_name_fuzzy(StudentSystem *sys, const char *name) {
+    if (sys == NULL || name == NULL) {
+        return NULL;
+    }
+    
+    // First student in order whose name contains the text
+    int found = parallel_find_first(&sys->strings, &sys->students[0].name, sizeof(Student),
+                                    sys->student_count, name);
+    return found >= 0 ? &sys->students[found] : NULL;
+}
+
+Book* find_book_by_title_fuzzy(Library *lib, const char *title) {
+    if (lib == NULL || title == NULL) {
+        return NULL;
+    }
+    
+    int found = parallel_find_first(&lib->strings, &lib->books[0].title, sizeof(Book),
+                                    lib->book_count, title);
+    return found >= 0 ? &lib->books[found] : NULL;
+}
+
+/* ================== LOAN VIEWS ==================== */
+
+#define LOAN_VIEW_MIN_CAPACITY 64
+
+// Opens a view of the loans as they stand now. Returns NULL if memory ran out.
+LoanView* loan_view_open(StudentSystem *sys) {
+    LoanView *view = lib_malloc(sizeof(LoanView));
+    if (view == NULL) {
+        return NULL;
+    }
+    view->slots = NULL;
+    view->borrowers = NULL;
+    view->capacity = 0;
+    view->count = 0;
+    pthread_mutex_init(&view->lock, NULL);
+    
+    // Loans change books under the loan lock, so none is half done here
+    pthread_mutex_lock(&sys->loan_lock);
+    view->next = sys->views;
+    sys->views = view;
+    pthread_mutex_unlock(&sys->loan_lock);
+    return view;
+}
+
+void loan_view_close(StudentSystem *sys, LoanView *view) {
+    if (view == NULL) return;
+    
+    // Once unlinked no loan can reach the view any more
+    pthread_mutex_lock(&sys->loan_lock);
+    LoanView **link = &sys->views;
+    while (*link != view) {
+        link = &(*link)->next;
+    }
+    *link = view->next;
+    pthread_mutex_unlock(&sys->loan_lock);
+    
+    pthread_mutex_destroy(&view->lock);
+    lib_free(view->slots);
+    lib_free(view->borrowers);
+    lib_free(view);
+}
+
+// Table index holding the book slot, or the empty one where it would go
+static int loan_view_probe(const LoanView *view, int slot) {
+    unsigned int mask = (unsigned int)view->capacity - 1;
+    unsigned int i = ((unsigned int)slot * 2654435761u) & mask;
+    while (view->slots[i] >= 0 && view->slots[i] != slot) {
+        i = (i + 1) & mask;
+    }
+    return (int)i;
+}
+
+static int loan_view_grow(LoanView *view) {
+    int capacity = view->capacity > 0 ? view->capacity * 2 : LOAN_VIEW_MIN_CAPACITY;
+    int *slots = lib_malloc(sizeof(int) * capacity);
+    int *borrowers = lib_malloc(sizeof(int) * capacity);
+    if (slots == NULL || borrowers == NULL) {
+        lib_free(slots);
+        lib_free(borrowers);
+        return 0;
+    }
+    for (int i = 0; i < capacity; i++) {
+        slots[i] = -1;
+    }
+    
+    LoanView bigger = *view;
+    bigger.slots = slots;
+    bigger.borrowers = borrowers;
+    bigger.capacity = capacity;
+    for (int i = 0; i < view->capacity; i++) {
+        if (view->slots[i] >= 0) {
+            int at = loan_view_probe(&bigger, view->slots[i]);
+            slots[at] = view->slots[i];
+            borrowers[at] = view->borrowers[i];
+        }
+    }
+    
+    lib_free(view->slots);
+    lib_free(view->borrowers);
+    view->slots = slots;
+    view->borrowers = borrowers;
+    view->capacity = capacity;
+    return 1;
+}
+
+// Saves the book's borrower into every open view that does not have it yet.
+// Called under the loan lock just before a loan changes the book. A view
+// that runs out of memory answers with the book's current loan instead.
+static void loan_views_save(StudentSystem *sys, const Book *book) {
+    for (LoanView *view = sys->views; view != NULL; view = view->next) {
+        pthread_mutex_lock(&view->lock);
+        if ((view->count + 1) * 2 <= view->capacity || loan_view_grow(view)) {
+            int at = loan_view_probe(view, book->slot);
+            if (view->slots[at] < 0) {
+                view->slots[at] = book->slot;
+                view->borrowers[at] = book->borrower;
+                view->count++;
+            }
+        }
+        pthread_mutex_unlock(&view->lock);
+    }
+}
+
+// Borrower of the book when the view was opened, -1 if it was available
+int loan_view_borrower(LoanView *view, const Book *book) {
+    int borrower = book->borrower;
+    pthread_mutex_lock(&view->lock);
+    if (view->count > 0) {
+        int at = loan_view_probe(view, book->slot);
+        if (view->slots[at] == book->slot) {
+            borrower = view->borrowers[at];
+        }
+    }
+    pthread_mutex_unlock(&view->lock);
+    return borrower;
+}
+
+/* ================== CORE OPERATIONS ==================== */
+
+int library_reserve(Library *lib, int min_capacity) {
+    if (min_capacity <= lib->capacity) {
+        return 1;
+    }
+    
+    // Geometric growth keeps repeated appends amortised O(1)
+    int new_capacity = lib->capacity > 0 ? lib->capacity : 2;
+    while (new_capacity < min_capacity) {
+        new_capacity *= 2;
+    }
+    
+    Book *new_books = lib_realloc(lib->books, sizeof(Book) * new_capacity);
+    if (new_books == NULL) {
+        return 0;
+    }
+    lib->books = new_books;
+    if (!book_columns_resize(&lib->columns, lib->capacity, new_capacity)) {
+        return 0;
+    }
+    lib->capacity = new_capacity;
+    return 1;
+}
+
+// Releases unused capacity down to the live count (never below the minimum)
+void library_shrink_to_fit(Library *lib) {
+    int new_capacity = lib->book_count > LIBRARY_MIN_CAPACITY ? lib->book_count : LIBRARY_MIN_CAPACITY;
+    if (new_capacity >= lib->capacity) {
+        return;
+    }
+    
+    Book *new_books = lib_realloc(lib->books, sizeof(Book) * new_capacity);
+    if (new_books != NULL) {
+        lib->books = new_books;
+        book_columns_resize(&lib->columns, lib->capacity, new_capacity);
+        lib->capacity = new_capacity;
+    }
+}
+
+int student_system_reserve(StudentSystem *sys, int min_capacity) {
+    if (min_capacity <= sys->student_capacity) {
+        return 1;
+    }
+    
+    int new_capacity = sys->student_capacity > 0 ? sys->student_capacity : 2;
+    while (new_capacity < min_capacity) {
+        new_capacity *= 2;
+    }
+    
+    Student *new_students = lib_realloc(sys->students, sizeof(Student) * new_capacity);
+    if (new_students == NULL) {
+        return 0;
+    }
+    sys->students = new_students;
+    sys->student_capacity = new_capacity;
+    return activity_heap_reserve(&sys->activity, new_capacity);
+}
+
+// Takes a slot for a book at the given position: released slots are reused
+// first, fresh slots are appended to the slot map
+static int library_acquire_slot(Library *lib, int position) {
+    int slot = lib->free_slot;
+    if (slot >= 0) {
+        lib->free_slot = lib->slots[slot].position;
+    } else {
+        if (lib->slot_count >= lib->slot_capacity) {
+            int new_capacity = lib->slot_capacity > 0 ? lib->slot_capacity * 2 : LIBRARY_MIN_CAPACITY;
+            BookSlot *new_slots = lib_realloc(lib->slots, sizeof(BookSlot) * new_capacity);
+            if (new_slots == NULL) {
+                return -1;
+            }
+            lib->slots = new_slots;
+            lib->slot_capacity = new_capacity;
+        }
+        slot = lib->slot_count++;
+        lib->slots[slot].generation = 0;
+    }
+    
+    lib->slots[slot].position = position;
+    return slot;
+}
+
+static void library_release_slot(Library *lib, int slot) {
+    // The new generation invalidates every handle taken while the slot was live
+    lib->slots[slot].generation++;
+    lib->slots[slot].position = lib->free_slot;
+    lib->free_slot = slot;
+}
+
+BookHandle library_book_handle(const Library *lib, const Book *book) {
+    BookHandle handle;
+    handle.slot = book->slot;
+    handle.generation = lib->slots[book->slot].generation;
+    return handle;
+}
+
+Book* library_resolve_book(Library *lib, BookHandle handle) {
+    if (handle.slot < 0 || handle.slot >= lib->slot_count ||
+        lib->slots[handle.slot].generation != handle.generation) {
+        return NULL;
+    }
+    return &lib->books[lib->slots[handle.slot].position];
+}
+
+// Collects the books whose title or an author contains the term, in
+// catalog order. Returns the number found, or -1 if memory ran out.
+static int library_find_books_untimed(Library *lib, const char *term, Book ***matches) {
+    // Terms of three or more bytes are narrowed down by the trigram index,
+    // shorter ones (or an index failure) fall back to a full scan
+    int *candidates = NULL;
+    int candidate_count = 0;
+    if (trigram_index_candidates(&lib->text_index, term, &candidates, &candidate_count)) {
+        int found = collect_matching_books(lib, candidates, candidate_count, term, matches);
+        lib_free(candidates);
+        return found;
+    }
+    return collect_matching_books(lib, NULL, lib->book_count, term, matches);
+}
+
+int library_find_books(Library *lib, const char *term, Book ***matches) {
+    METRIC_START(timer);
+    int found = library_find_books_untimed(lib, term, matches);
+    METRIC_STOP(METRIC_SEARCH_BOOKS, timer);
+    return found;
+}
+
+// Everything here is a running total or the end of an index, so the cost
+// does not depend on the catalog size. sys may be NULL for book figures only.
+void library_stats(Library *lib, StudentSystem *sys, LibraryStats *stats) {
+    stats->book_count = lib->book_count;
+    stats->author_total = lib->author_total;
+    stats->average_pages = lib->book_count > 0 ? lib->page_total / lib->book_count : 0;
+    
+    // Newest and oldest books are the ends of the year index, shortest and
+    // longest the ends of the page index
+    const IntEntry *newest = int_index_last(&lib->year_index);
+    const IntEntry *oldest = int_index_first(&lib->year_index);
+    stats->newest = newest != NULL ? library_book_in_slot(lib, newest->slot) : NULL;
+    stats->oldest = oldest != NULL ? library_book_in_slot(lib, oldest->slot) : NULL;
+    
+    const IntEntry *shortest = int_index_first(&lib->page_index);
+    const IntEntry *longest = int_index_last(&lib->page_index);
+    stats->shortest = shortest != NULL ? library_book_in_slot(lib, shortest->slot) : NULL;
+    stats->longest = longest != NULL ? library_book_in_slot(lib, longest->slot) : NULL;
+    
+    stats->student_count = 0;
+    stats->most_active = NULL;
+    stats->most_active_loans = 0;
+    if (sys == NULL) {
+        stats->borrowed_total = lib->borrowed_total;
+        return;
+    }
+    
+    // Loans may be running on other threads; take their totals together
+    stats->student_count = sys->student_count;
+    pthread_mutex_lock(&sys->loan_lock);
+    stats->borrowed_total = lib->borrowed_total;
+    if (sys->activity.count > 0) {
+        stats->most_active = &sys->students[sys->activity.heap[0]];
+        stats->most_active_loans = stats->most_active->borrowed_count;
+    }
+    pthread_mutex_unlock(&sys->loan_lock);
+}
+
+// A range that lets every book through
+void book_range_init(BookRange *range) {
+    range->year_min = INT_MIN;
+    range->year_max = INT_MAX;
+    range->pages_min = INT_MIN;
+    range->pages_max = INT_MAX;
+    range->availability = RANGE_ANY;
+}
+
+// Index reads cost a few cache misses per candidate, a column scan about a
+// nanosecond per book; past this share of the catalog the scan wins
+#define RANGE_SCAN_FRACTION 16
+
+static int range_wants_book(const BookColumns *columns, const BookRange *range, int position) {
+    if (columns->years[position] < range->year_min || columns->years[position] > range->year_max ||
+        columns->pages[position] < range->pages_min || columns->pages[position] > range->pages_max) {
+        return 0;
+    }
+    if (range->availability == RANGE_ANY) {
+        return 1;
+    }
+    uint64_t word = __atomic_load_n(&columns->available[position / 64], __ATOMIC_RELAXED);
+    return ((word >> (position % 64)) & 1) == (range->availability == RANGE_AVAILABLE);
+}
+
+// Whole-catalog pass over the columns, 64 books at a time: the bounds give
+// a match mask that is combined with the availability word, and only the
+// set bits are visited. found needs room for every book.
+static int range_scan_columns(Library *lib, const BookRange *range, Book **found) {
+    const BookColumns *columns = &lib->columns;
+    int found_count = 0;
+    
+    // Bounds narrowed to the column types keep the compares in 16-bit lanes
+    if (range->year_min > BOOK_YEAR_MAX || range->year_max < BOOK_YEAR_MIN ||
+        range->pages_min > BOOK_PAGES_MAX || range->pages_max < 0 ||
+        range->year_min > range->year_max || range->pages_min > range->pages_max) {
+        return 0;
+    }
+    int16_t year_min = range->year_min < BOOK_YEAR_MIN ? BOOK_YEAR_MIN : range->year_min;
+    int16_t year_max = range->year_max > BOOK_YEAR_MAX ? BOOK_YEAR_MAX : range->year_max;
+    uint16_t pages_min = range->pages_min < 0 ? 0 : range->pages_min;
+    uint16_t pages_max = range->pages_max > BOOK_PAGES_MAX ? BOOK_PAGES_MAX : range->pages_max;
+    
+    for (int base = 0; base < lib->book_count; base += 64) {
+        int end = base + 64 < lib->book_count ? base + 64 : lib->book_count;
+        uint64_t mask = 0;
+        for (int i = base; i < end; i++) {
+            int inside = (columns->years[i] >= year_min) & (columns->years[i] <= year_max) &
+                         (columns->pages[i] >= pages_min) & (columns->pages[i] <= pages_max);
+            mask |= (uint64_t)inside << (i - base);
+        }
+        
+        uint64_t available = __atomic_load_n(&columns->available[base / 64], __ATOMIC_RELAXED);
+        if (range->availability == RANGE_AVAILABLE) {
+            mask &= available;
+        } else if (range->availability == RANGE_BORROWED) {
+            mask &= ~available;
+        }
+        while (mask != 0) {
+            found[found_count++] = &lib->books[base + __builtin_ctzll(mask)];
+            mask &= mask - 1;
+        }
+    }
+    return found_count;
+}
+
+// Books inside the range, in a new array (free it, not the books). When
+// the narrower of the year and page ranges is a small part of the catalog
+// it is read from its index, in key order, and the other bounds are checked
+// on those books only. Otherwise the book columns are scanned and the books
+// come back in catalog order. Either way the Book records themselves are
+// only touched for matches. Returns the number of matches, or -1 if memory
+// ran out.
+static int library_range_books_untimed(Library *lib, const BookRange *range, Book ***matches) {
+    *matches = NULL;
+    if (range->year_min > range->year_max || range->pages_min > range->pages_max) {
+        return 0;
+    }
+    
+    int year_count = int_index_count_range(&lib->year_index, range->year_min, range->year_max);
+    int page_count = int_index_count_range(&lib->page_index, range->pages_min, range->pages_max);
+    int narrowest = year_count < page_count ? year_count : page_count;
+    if (narrowest > lib->book_count / RANGE_SCAN_FRACTION) {
+        // The scan sees every book, including any an index was too full to
+        // take, so the index counts are no bound on what it finds
+        Book **found = lib_malloc(sizeof(Book*) * (lib->book_count > 0 ? lib->book_count : 1));
+        if (found == NULL) {
+            return -1;
+        }
+        int found_count = range_scan_columns(lib, range, found);
+        if (found_count < lib->book_count / 2) {
+            Book **smaller = lib_realloc(found, sizeof(Book*) * (found_count > 0 ? found_count : 1));
+            if (smaller != NULL) {
+                found = smaller;
+            }
+        }
+        *matches = found;
+        return found_count;
+    }
+    
+    int *slots = NULL;
+    int count = year_count <= page_count
+                    ? int_index_range(&lib->year_index, range->year_min, range->year_max, &slots)
+                    : int_index_range(&lib->page_index, range->pages_min, range->pages_max, &slots);
+    if (count < 0) {
+        return -1;
+    }
+    
+    Book **found = lib_malloc(sizeof(Book*) * (count > 0 ? count : 1));
+    if (found == NULL) {
+        lib_free(slots);
+        return -1;
+    }
+    int found_count = 0;
+    for (int i = 0; i < count; i++) {
+        int position = lib->slots[slots[i]].position;
+        if (range_wants_book(&lib->columns, range, position)) {
+            found[found_count++] = &lib->books[position];
+        }
+    }
+    lib_free(slots);
+    
+    *matches = found;
+    return found_count;
+}
+
+int library_range_books(Library *lib, const BookRange *range, Book ***matches) {
+    METRIC_START(timer);
+    int found = library_range_books_untimed(lib, range, matches);
+    METRIC_STOP(METRIC_RANGE_BOOKS, timer);
+    return found;
+}
+
+// NULL if a book with these fields fits the packed record, else why not
+const char* library_check_book(int year, int pages, int author_count) {
+    if (year < BOOK_YEAR_MIN || year > BOOK_YEAR_MAX) return "year must be between -32768 and 32767";
+    if (pages < 0 || pages > BOOK_PAGES_MAX) return "pages must be between 0 and 65535";
+    if (author_count < 0 || author_count > BOOK_AUTHORS_MAX) return "a book can have at most 255 authors";
+    return NULL;
+}
+
+static int library_insert_book_untimed(Library *lib, const char *title, const char **authors, int author_count, int year, int pages) {
+    lib->missed_indexes = 0;
+    if (library_check_book(year, pages, author_count) != NULL) {
+        return 0;
+    }
+    if (!library_reserve(lib, lib->book_count + 1)) {
+        return 0;
+    }
+    
+    Book *book = &lib->books[lib->book_count];
+    const char *interned_title = string_pool_intern(&lib->strings, title);
+    book->author_count = 0;
+    book->year = (int16_t)year;
+    book->pages = (uint16_t)pages;
+    book->is_available = 1;   // Book is available by default
+    book->borrower = -1;      // No one has borrowed it yet
+    if (interned_title == NULL) {
+        cleanup_book(book);
+        return 0;
+    }
+    book->title = string_pool_ref(&lib->strings, interned_title);
+    
+    // Shared author names are stored once however many books list them. A
+    // lone author sits in the book itself, several get an array in the pool.
+    StringRef *names = NULL;
+    if (author_count > 1) {
+        names = string_pool_alloc(&lib->strings, sizeof(StringRef) * author_count);
+        if (names == NULL) {
+            cleanup_book(book);
+            return 0;
+        }
+        book->authors = string_pool_ref(&lib->strings, names);
+    }
+    for (int i = 0; i < author_count; i++) {
+        const char *name = string_pool_intern(&lib->strings, authors[i]);
+        if (name == NULL) {
+            cleanup_book(book);
+            return 0;
+        }
+        if (names != NULL) {
+            names[i] = string_pool_ref(&lib->strings, name);
+        } else {
+            book->authors = string_pool_ref(&lib->strings, name);
+        }
+    }
+    book->author_count = (uint8_t)author_count;
+    
+    book->slot = library_acquire_slot(lib, lib->book_count);
+    if (book->slot < 0) {
+        cleanup_book(book);
+        return 0;
+    }
+    
+    if (lib->journal != NULL && !journal_log_add_book(lib->journal, lib, book)) {
+        library_release_slot(lib, book->slot);
+        cleanup_book(book);
+        return 0;
+    }
+    
+    // A bulk load indexes its books when it finishes
+    if (lib->bulk_start < 0) {
+        if (!name_index_insert(&lib->title_index, book_title(lib, book), book->slot)) {
+            lib->missed_indexes |= MISSED_TITLE_INDEX;
+        }
+        if (!trigram_index_add_book(&lib->text_index, lib, book, book->slot)) {
+            lib->missed_indexes |= MISSED_SEARCH_INDEX;
+        }
+        if (!word_index_add_book(&lib->word_index, lib, book, book->slot)) {
+            lib->missed_indexes |= MISSED_WORD_INDEX;
+        }
+        if (!int_index_insert(&lib->year_index, year, book->slot)) {
+            lib->missed_indexes |= MISSED_YEAR_INDEX;
+        }
+        if (!int_index_insert(&lib->page_index, pages, book->slot)) {
+            lib->missed_indexes |= MISSED_PAGE_INDEX;
+        }
+    }
+    book_columns_store(&lib->columns, lib->book_count, book);
+    lib->author_total += book->author_count;
+    lib->page_total += pages;
+    
+    lib->book_count++;
+    return 1;
+}
+
+int library_insert_book(Library *lib, const char *title, const char **authors, int author_count, int year, int pages) {
+    METRIC_START(timer);
+    int inserted = library_insert_book_untimed(lib, title, authors, author_count, year, pages);
+    METRIC_STOP(METRIC_ADD_BOOK, timer);
+    return inserted;
+}
+
+// Unlinks a book slot from the student's loans, keeping the rest in order
+static void student_drop_loan(Student *student, int slot) {
+    for (int i = 0; i < student->borrowed_count; i++) {
+        if (student->borrowed_books[i] == slot) {
+            memmove(&student->borrowed_books[i], &student->borrowed_books[i + 1],
+                    sizeof(int) * (student->borrowed_count - i - 1));
+            student->borrowed_count--;
+            return;
+        }
+    }
+}
+
+static int library_delete_book_untimed(Library *lib, StudentSystem *sys, int position) {
+    if (position < 0 || position >= lib->book_count) {
+        return 0;
+    }
+    
+    if (lib->journal != NULL && !journal_log_position(lib->journal, JOURNAL_REMOVE_BOOK, position, -1)) {
+        return 0;
+    }
+    
+    // A removed book can no longer be on loan: close it on the student side
+    Book *found = &lib->books[position];
+    if (!found->is_available) {
+        student_drop_loan(&sys->students[found->borrower], found->slot);
+        activity_heap_update(sys, found->borrower);
+        lib->borrowed_total--;
+    }
+    name_index_remove(&lib->title_index, book_title(lib, found), found->slot);
+    trigram_index_remove_book(&lib->text_index, lib, found, found->slot);
+    word_index_remove_book(&lib->word_index, lib, found, found->slot);
+    int_index_remove(&lib->year_index, found->year, found->slot);
+    int_index_remove(&lib->page_index, found->pages, found->slot);
+    lib->author_total -= found->author_count;
+    lib->page_total -= found->pages;
+    library_release_slot(lib, found->slot);
+    cleanup_book(found);
+    
+    // Move the last book into the hole; only its slot has to learn the new
+    // position, the indexes refer to it by slot and stay untouched
+    lib->book_count--;
+    if (position != lib->book_count) {
+        lib->books[position] = lib->books[lib->book_count];
+        lib->slots[lib->books[position].slot].position = position;
+        book_columns_move(&lib->columns, position, lib->book_count);
+    } else {
+        book_columns_set_available(&lib->columns, position, 0);
+    }
+    
+    // Halve once only a quarter is used; the gap to the growth threshold
+    // keeps alternating adds and removes from reallocating every time
+    if (lib->capacity > LIBRARY_MIN_CAPACITY && lib->book_count < lib->capacity / 4) {
+        int new_capacity = lib->capacity / 2;
+        Book *new_books = lib_realloc(lib->books, sizeof(Book) * new_capacity);
+        if (new_books != NULL) {
+            lib->books = new_books;
+            book_columns_resize(&lib->columns, lib->capacity, new_capacity);
+            lib->capacity = new_capacity;
+        }
+    }
+    return 1;
+}
+
+int library_delete_book(Library *lib, StudentSystem *sys, int position) {
+    METRIC_START(timer);
+    int deleted = library_delete_book_untimed(lib, sys, position);
+    METRIC_STOP(METRIC_REMOVE_BOOK, timer);
+    return deleted;
+}
+
+int student_system_insert(StudentSystem *sys, int student_id, const char *name) {
+    sys->missed_indexes = 0;
+    if (!student_system_reserve(sys, sys->student_count + 1)) {
+        return 0;
+    }
+    
+    Student *student = &sys->students[sys->student_count];
+    student->student_id = student_id;
+    const char *interned_name = string_pool_intern(&sys->strings, name);
+    student->name = 0;
+    student->max_books = MAX_BOOKS;
+    student->borrowed_count = 0;
+    if (interned_name == NULL) {
+        cleanup_student(student);
+        return 0;
+    }
+    student->name = string_pool_ref(&sys->strings, interned_name);
+    
+    if (sys->journal != NULL && !journal_log_add_student(sys->journal, student_id, name)) {
+        cleanup_student(student);
+        return 0;
+    }
+    
+    if (!name_index_insert(&sys->name_index, interned_name, sys->student_count)) {
+        sys->missed_indexes |= MISSED_NAME_INDEX;
+    }
+    
+    sys->student_count++;
+    activity_heap_push(sys, sys->student_count - 1);
+    return 1;
+}
+
+static int lend_book_untimed(Library *lib, StudentSystem *sys, Book *book, Student *student) {
+    // Check if book is available
+    if (book->is_available == 0) {
+        return LOAN_NOT_AVAILABLE;
+    }
+
+    // Check if student can borrow more books
+    if (student->borrowed_count >= student->max_books) {
+        return LOAN_LIMIT_REACHED;
+    }
+
+    if (lib->journal != NULL && !journal_log_position(lib->journal, JOURNAL_BORROW,
+                                                      (int)(book - lib->books),
+                                                      (int)(student - sys->students))) {
+        return LOAN_FAILED;
+    }
+
+    // Borrow the book; each side records the other's number. The book and
+    // the student are the caller's; the heap, the total and the open views
+    // are shared with other loans.
+    pthread_mutex_lock(&sys->loan_lock);
+    loan_views_save(sys, book);
+    book->is_available = 0;
+    book->borrower = (int)(student - sys->students);
+    book_columns_set_available(&lib->columns, (int)(book - lib->books), 0);
+    student->borrowed_books[student->borrowed_count] = book->slot;
+    student->borrowed_count++;
+    activity_heap_update(sys, book->borrower);
+    lib->borrowed_total++;
+    pthread_mutex_unlock(&sys->loan_lock);
+
+    return LOAN_OK;
+}
+
+int lend_book(Library *lib, StudentSystem *sys, Book *book, Student *student) {
+    METRIC_START(timer);
+    int result = lend_book_untimed(lib, sys, book, student);
+    METRIC_STOP(METRIC_BORROW, timer);
+    return result;
+}
+
+static int receive_book_untimed(Library *lib, StudentSystem *sys, Book *book, Student *student) {
+    // Check if book is currently borrowed
+    if (book->is_available == 1) {
+        return LOAN_NOT_BORROWED;
+    }
+
+    // Check if book is borrowed by this student
+    if (book->borrower != (int)(student - sys->students)) {
+        return LOAN_WRONG_STUDENT;
+    }
+
+    if (lib->journal != NULL && !journal_log_position(lib->journal, JOURNAL_RETURN,
+                                                      (int)(book - lib->books),
+                                                      (int)(student - sys->students))) {
+        return LOAN_FAILED;
+    }
+
+    // Make the book available and drop it from the student's loans
+    pthread_mutex_lock(&sys->loan_lock);
+    loan_views_save(sys, book);
+    book->is_available = 1;
+    book->borrower = -1;
+    book_columns_set_available(&lib->columns, (int)(book - lib->books), 1);
+    student_drop_loan(student, book->slot);
+    activity_heap_update(sys, (int)(student - sys->students));
+    lib->borrowed_total--;
+    pthread_mutex_unlock(&sys->loan_lock);
+
+    return LOAN_OK;
+}
+
+int receive_book(Library *lib, StudentSystem *sys, Book *book, Student *student) {
+    METRIC_START(timer);
+    int result = receive_book_untimed(lib, sys, book, student);
+    METRIC_STOP(METRIC_RETURN, timer);
+    return result;
+}
+
+/* ================== HASH INDEX ==================== */
+
+unsigned int case_folded_hash(const char *str) {
+    // FNV-1a over the lowercased bytes
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++) {
+        hash ^= (unsigned int)tolower(*p);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int case_insensitive_equals(const char *a, const char *b) {
+    while (*a != '\0' && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+    return tolower((unsigned char)*a) == tolower((unsigned char)*b);
+}
+
+static int name_index_alloc(NameIndex *index, int capacity) {
+    index->positions = lib_malloc(sizeof(int) * capacity);
+    index->hashes = lib_malloc(sizeof(unsigned int) * capacity);
+    if (index->positions == NULL || index->hashes == NULL) {
+        lib_free(index->positions);
+        lib_free(index->hashes);
+        index->positions = NULL;
+        index->hashes = NULL;
+        return 0;
+    }
+    
+    for (int i = 0; i < capacity; i++) {
+        index->positions[i] = INDEX_EMPTY;
+    }
+    index->capacity = capacity;
+    index->used = 0;
+    index->live = 0;
+    return 1;
+}
+
+int name_index_init(NameIndex *index, int expected_entries) {
+    // Keep the load factor under 3/4 for the expected size
+    int capacity = 8;
+    while (capacity < expected_entries + expected_entries / 3 + 1) {
+        capacity *= 2;
+    }
+    return name_index_alloc(index, capacity);
+}
+
+void name_index_free(NameIndex *index) {
+    lib_free(index->positions);
+    lib_free(index->hashes);
+    index->positions = NULL;
+    index->hashes = NULL;
+    index->capacity = 0;
+    index->used = 0;
+    index->live = 0;
+}
+
+static void name_index_place(NameIndex *index, unsigned int hash, int position) {
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    unsigned int slot = hash & mask;
+    
+    while (index->positions[slot] >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    if (index->positions[slot] == INDEX_EMPTY) {
+        index->used++;
+    }
+    index->positions[slot] = position;
+    index->hashes[slot] = hash;
+    index->live++;
+}
+
+static int name_index_rehash(NameIndex *index, int capacity) {
+    NameIndex bigger;
+    if (!name_index_alloc(&bigger, capacity)) {
+        return 0;
+    }
+    
+    // Re-place live entries from their cached hashes, dropping tombstones
+    for (int i = 0; i < index->capacity; i++) {
+        if (index->positions[i] >= 0) {
+            name_index_place(&bigger, index->hashes[i], index->positions[i]);
+        }
+    }
+    
+    name_index_free(index);
+    *index = bigger;
+    return 1;
+}
+
+// Makes room for expected_entries live entries, counting the tombstones
+// already in the table. When tombstones fill it, they are purged at the
+// same capacity if live entries hold under half the used slots or under
+// half the load limit; either way the purge frees enough slots to pay for
+// itself. Add/remove churn therefore keeps the table sized by the live
+// entries rather than by every insert ever made.
+int name_index_reserve(NameIndex *index, int expected_entries) {
+    int capacity = index->capacity;
+    while ((expected_entries + 1) * 4 > capacity * 3) {
+        capacity *= 2;
+    }
+    if (capacity == index->capacity) {
+        int used = index->used - index->live + expected_entries;
+        if ((used + 1) * 4 <= capacity * 3) {
+            return 1;
+        }
+        if (index->live * 2 >= index->used && expected_entries * 8 > capacity * 3) {
+            capacity *= 2;
+        }
+    }
+    return name_index_rehash(index, capacity);
+}
+
+int name_index_insert(NameIndex *index, const char *key, int position) {
+    if (!name_index_reserve(index, index->live + 1)) {
+        return 0;
+    }
+    
+    name_index_place(index, case_folded_hash(key), position);
+    return 1;
+}
+
+void name_index_remove(NameIndex *index, const char *key, int position) {
+    unsigned int hash = case_folded_hash(key);
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    
+    for (unsigned int slot = hash & mask; index->positions[slot] != INDEX_EMPTY; slot = (slot + 1) & mask) {
+        if (index->positions[slot] == position) {
+            index->positions[slot] = INDEX_DELETED;
+            index->live--;
+            return;
+        }
+    }
+}
+
+/* ================== SUBSTRING SEARCH ==================== */
+
+// Case-insensitive substring search (ASCII folding, like tolower in the C
+// locale). The vector kernels test 16 or 32 candidate positions at once:
+// a position survives only if the folded haystack byte there matches the
+// needle's first byte and the byte n-1 further on matches its last byte.
+// Only survivors are compared in full, so most of the haystack is rejected
+// without a byte-by-byte loop.
+
+static inline unsigned char fold_ascii(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c | 0x20) : c;
+}
+
+// Compares n bytes ignoring ASCII case
+static int folded_equals(const char *a, const char *b, size_t n) {
+    METRIC_COMPARISON();
+    for (size_t i = 0; i < n; i++) {
+        if (fold_ascii((unsigned char)a[i]) != fold_ascii((unsigned char)b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Tries every start position in [from, last_start]
+static int substring_scalar(const char *haystack, size_t from, size_t last_start,
+                            const char *needle, size_t needle_len) {
+    unsigned char first = fold_ascii((unsigned char)needle[0]);
+    for (size_t i = from; i <= last_start; i++) {
+        if (fold_ascii((unsigned char)haystack[i]) == first &&
+            folded_equals(haystack + i + 1, needle + 1, needle_len - 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef int (*SubstringKernel)(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len);
+
+static int substring_search_scalar(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    return substring_scalar(haystack, 0, haystack_len - needle_len, needle, needle_len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Lowercases 'A'..'Z' in a vector; signed compares leave bytes >= 0x80 alone
+static inline __m128i fold_sse2(__m128i v) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static int substring_search_sse2(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    const __m128i first = _mm_set1_epi8((char)fold_ascii((unsigned char)needle[0]));
+    const __m128i last = _mm_set1_epi8((char)fold_ascii((unsigned char)needle[needle_len - 1]));
+    size_t middle = needle_len > 2 ? needle_len - 2 : 0; // Bytes between first and last
+    size_t i = 0;
+    
+    // Both 16-byte loads stay inside the haystack
+    for (; i + needle_len - 1 + 16 <= haystack_len; i += 16) {
+        __m128i block_first = fold_sse2(_mm_loadu_si128((const __m128i *)(haystack + i)));
+        __m128i block_last = fold_sse2(_mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (folded_equals(haystack + i + bit + 1, needle + 1, middle)) {
+                return 1;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    return i <= haystack_len - needle_len &&
+           substring_scalar(haystack, i, haystack_len - needle_len, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static int substring_search_avx2(const char *haystack, size_t haystack_len, const char *needle, size_t needle_len) {
+    const __m256i first = _mm256_set1_epi8((char)fold_ascii((unsigned char)needle[0]));
+    const __m256i last = _mm256_set1_epi8((char)fold_ascii((unsigned char)needle[needle_len - 1]));
+    size_t middle = needle_len > 2 ? needle_len - 2 : 0;
+    size_t i = 0;
+    
+    for (; i + needle_len - 1 + 32 <= haystack_len; i += 32) {
+        __m256i block_first = fold_avx2(_mm256_loadu_si256((const __m256i *)(haystack + i)));
+        __m256i block_last = fold_avx2(_mm256_loadu_si256((const __m256i *)(haystack + i + needle_len - 1)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (folded_equals(haystack + i + bit + 1, needle + 1, middle)) {
+                return 1;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    // Short haystacks and the tail go through the 16-byte kernel. That one
+    // is legacy SSE code: clear the upper halves first, or every SSE
+    // instruction after the switch pays the AVX-SSE transition penalty
+    // (the compiler leaves it out on the tail call).
+    if (i > haystack_len - needle_len) {
+        return 0;
+    }
+    _mm256_zeroupper();
+    return substring_search_sse2(haystack + i, haystack_len - i, needle, needle_len);
+}
+#endif
+
+static SubstringKernel substring_kernel = substring_search_scalar;
+static pthread_once_t substring_kernel_once = PTHREAD_ONCE_INIT;
+
+// Picks the widest kernel the running CPU supports
+static void select_substring_kernel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        substring_kernel = substring_search_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        substring_kernel = substring_search_sse2;
+    }
+#endif
+}
+
+int case_insensitive_search(const char *haystack, const char *needle) {
+    METRIC_SEARCH();
+    size_t haystack_len = strlen(haystack);
+    size_t needle_len = strlen(needle);
+    
+    if (needle_len == 0) {
+        return 1;
+    }
+    if (needle_len > haystack_len) {
+        return 0;
+    }
+    
+    // Full comparisons are tallied in a plain thread-local and added to the
+    // thread's counters once per call, keeping the kernels' inner loops lean
+    pthread_once(&substring_kernel_once, select_substring_kernel);
+    int found = substring_kernel(haystack, haystack_len, needle, needle_len);
+    METRIC_SEARCH_DONE();
+    return found;
+}
+
+/* ================== STRING POOL ==================== */
+
+static unsigned int string_hash(const char *str) {
+    // FNV-1a over the exact bytes
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Reserves the largest range it can get, up to all a StringRef addresses
+int string_pool_init(StringPool *pool) {
+    pool->base = NULL;
+    for (size_t size = STRING_POOL_RESERVE; size >= STRING_POOL_MIN_RESERVE; size /= 4) {
+        void *range = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (range != MAP_FAILED) {
+            pool->base = range;
+            pool->reserved = size;
+            break;
+        }
+    }
+    if (pool->base == NULL) {
+        return 0;
+    }
+    pool->base[0] = '\0'; // StringRef 0, the empty string
+    pool->used = 1;
+    
+    pool->capacity = 256;
+    pool->count = 0;
+    pool->strings = lib_calloc(pool->capacity, sizeof(StringRef));
+    pool->hashes = lib_malloc(sizeof(unsigned int) * pool->capacity);
+    if (pool->strings == NULL || pool->hashes == NULL) {
+        lib_free(pool->strings);
+        lib_free(pool->hashes);
+        munmap(pool->base, pool->reserved);
+        pool->base = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+void string_pool_free(StringPool *pool) {
+    if (pool->base != NULL) {
+        munmap(pool->base, pool->reserved);
+    }
+    lib_free(pool->strings);
+    lib_free(pool->hashes);
+    pool->base = NULL;
+    pool->used = 0;
+    pool->reserved = 0;
+    pool->strings = NULL;
+    pool->hashes = NULL;
+    pool->capacity = 0;
+    pool->count = 0;
+}
+
+static void* pool_take(StringPool *pool, size_t size, size_t align) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    size_t start = (pool->used + align - 1) & ~(align - 1);
+    if (start > pool->reserved || pool->reserved - start < size) {
+        return NULL;
+    }
+    pool->used = start + size;
+    return pool->base + start;
+}
+
+// Aligned for StringRef arrays, the widest thing the pools hold
+void* string_pool_alloc(StringPool *pool, size_t size) {
+    return pool_take(pool, size, sizeof(StringRef));
+}
+
+static int string_pool_grow(StringPool *pool) {
+    int capacity = pool->capacity * 2;
+    StringRef *strings = lib_calloc(capacity, sizeof(StringRef));
+    unsigned int *hashes = lib_malloc(sizeof(unsigned int) * capacity);
+    if (strings == NULL || hashes == NULL) {
+        lib_free(strings);
+        lib_free(hashes);
+        return 0;
+    }
+    
+    unsigned int mask = (unsigned int)capacity - 1;
+    for (int i = 0; i < pool->capacity; i++) {
+        if (pool->strings[i] == 0) continue;
+        
+        unsigned int slot = pool->hashes[i] & mask;
+        while (strings[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        strings[slot] = pool->strings[i];
+        hashes[slot] = pool->hashes[i];
+    }
+    
+    lib_free(pool->strings);
+    lib_free(pool->hashes);
+    pool->strings = strings;
+    pool->hashes = hashes;
+    pool->capacity = capacity;
+    return 1;
+}
+
+// Enters a string already in the pool into the table. The probe slot is
+// recomputed after growing; a failed grow leaves the string usable, just
+// not shared.
+static void string_pool_enter(StringPool *pool, StringRef ref, unsigned int hash, unsigned int slot) {
+    if ((pool->count + 1) * 4 > pool->capacity * 3) {
+        if (!string_pool_grow(pool)) {
+            return;
+        }
+        unsigned int mask = (unsigned int)pool->capacity - 1;
+        for (slot = hash & mask; pool->strings[slot] != 0; slot = (slot + 1) & mask);
+    }
+    pool->strings[slot] = ref;
+    pool->hashes[slot] = hash;
+    pool->count++;
+}
+
+char* string_pool_intern(StringPool *pool, const char *str) {
+    if (str[0] == '\0') {
+        return pool->base;
+    }
+    
+    unsigned int hash = string_hash(str);
+    unsigned int mask = (unsigned int)pool->capacity - 1;
+    unsigned int slot = hash & mask;
+    
+    for (; pool->strings[slot] != 0; slot = (slot + 1) & mask) {
+        char *candidate = string_pool_at(pool, pool->strings[slot]);
+        if (pool->hashes[slot] == hash && strcmp(candidate, str) == 0) {
+            return candidate;
+        }
+    }
+    
+    size_t len = strlen(str) + 1;
+    char *copy = pool_take(pool, len, 1); // Strings need no alignment
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    string_pool_enter(pool, string_pool_ref(pool, copy), hash, slot);
+    return copy;
+}
+
+// Puts a saved pool image at the start of an empty pool: mapped in place
+// from the snapshot file when the offset is page-aligned, copied from the
+// image otherwise. The image starts with text_size bytes of NUL-terminated
+// strings (offset 0 being the empty one); those are interned again so
+// later additions share them.
+int string_pool_load(StringPool *pool, int fd, uint64_t offset, const char *image, size_t size, size_t text_size) {
+    if (size > pool->reserved || text_size > size || pool->used != 1) {
+        return 0;
+    }
+    
+    long page = sysconf(_SC_PAGESIZE);
+    int mapped = 0;
+    if (fd >= 0 && page > 0 && offset % (uint64_t)page == 0) {
+        mapped = mmap(pool->base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                      fd, (off_t)offset) != MAP_FAILED;
+        if (!mapped &&
+            mmap(pool->base, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            return 0;
+        }
+    }
+    if (!mapped) {
+        memcpy(pool->base, image, size);
+    }
+    pool->used = size;
+    
+    for (size_t at = 1; at < text_size; ) {
+        const char *str = pool->base + at;
+        size_t len = strlen(str);
+        unsigned int hash = string_hash(str);
+        unsigned int mask = (unsigned int)pool->capacity - 1;
+        unsigned int slot = hash & mask;
+        while (pool->strings[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        string_pool_enter(pool, (StringRef)at, hash, slot);
+        at += len + 1;
+    }
+    return 1;
+}
+
+/* ================== TRIGRAM INDEX ==================== */
+
+static unsigned int pack_trigram(const char *p) {
+    return ((unsigned int)tolower((unsigned char)p[0]) << 16) |
+           ((unsigned int)tolower((unsigned char)p[1]) << 8) |
+           (unsigned int)tolower((unsigned char)p[2]);
+}
+
+static unsigned int trigram_slot(unsigned int trigram, int capacity) {
+    // Multiplicative hashing spreads the packed bytes over the table
+    return (trigram * 2654435761u) & ((unsigned int)capacity - 1);
+}
+
+static int trigram_index_alloc(TrigramIndex *index, int capacity) {
+    index->postings = lib_malloc(sizeof(Posting) * capacity);
+    if (index->postings == NULL) {
+        return 0;
+    }
+    
+    for (int i = 0; i < capacity; i++) {
+        index->postings[i].trigram = TRIGRAM_EMPTY;
+        index->postings[i].books = NULL;
+        index->postings[i].count = 0;
+        index->postings[i].capacity = 0;
+        index->postings[i].dead = 0;
+    }
+    index->capacity = capacity;
+    index->used = 0;
+    return 1;
+}
+
+int trigram_index_init(TrigramIndex *index) {
+    return trigram_index_alloc(index, 1024);
+}
+
+void trigram_index_free(TrigramIndex *index) {
+    for (int i = 0; i < index->capacity; i++) {
+        lib_free(index->postings[i].books);
+    }
+    lib_free(index->postings);
+    index->postings = NULL;
+    index->capacity = 0;
+    index->used = 0;
+}
+
+static Posting* trigram_index_get(TrigramIndex *index, unsigned int trigram) {
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    
+    for (unsigned int slot = trigram_slot(trigram, index->capacity);
+         index->postings[slot].trigram != TRIGRAM_EMPTY; slot = (slot + 1) & mask) {
+        if (index->postings[slot].trigram == trigram) {
+            return &index->postings[slot];
+        }
+    }
+    return NULL;
+}
+
+static int trigram_index_grow(TrigramIndex *index) {
+    TrigramIndex bigger;
+    if (!trigram_index_alloc(&bigger, index->capacity * 2)) {
+        return 0;
+    }
+    
+    // Posting lists move over as-is, only their slots change
+    unsigned int mask = (unsigned int)bigger.capacity - 1;
+    for (int i = 0; i < index->capacity; i++) {
+        if (index->postings[i].trigram == TRIGRAM_EMPTY) continue;
+        
+        unsigned int slot = trigram_slot(index->postings[i].trigram, bigger.capacity);
+        while (bigger.postings[slot].trigram != TRIGRAM_EMPTY) {
+            slot = (slot + 1) & mask;
+        }
+        bigger.postings[slot] = index->postings[i];
+        bigger.used++;
+    }
+    
+    lib_free(index->postings);
+    *index = bigger;
+    return 1;
+}
+
+static Posting* trigram_index_get_or_create(TrigramIndex *index, unsigned int trigram) {
+    Posting *posting = trigram_index_get(index, trigram);
+    if (posting != NULL) {
+        return posting;
+    }
+    
+    if ((index->used + 1) * 4 > index->capacity * 3) {
+        if (!trigram_index_grow(index)) {
+            return NULL;
+        }
+    }
+    
+    unsigned int mask = (unsigned int)index->capacity - 1;
+    unsigned int slot = trigram_slot(trigram, index->capacity);
+    while (index->postings[slot].trigram != TRIGRAM_EMPTY) {
+        slot = (slot + 1) & mask;
+    }
+    index->postings[slot].trigram = trigram;
+    index->used++;
+    return &index->postings[slot];
+}
+
+// A removed entry stays in its sorted list with the sign bit set, so
+// removal costs a binary search instead of moving the rest of the list.
+// A list is compacted once dead entries pass a share of it, which keeps
+// removal O(1) amortised on top of the search.
+#define POSTING_DEAD       INT_MIN
+#define POSTING_DEAD_SHARE 4        // Compact once over 1/4 of a list is dead
+
+// Binary search for the first entry >= position, dead or alive
+static int posting_lower_bound(const int *books, int count, int position) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if ((books[mid] & INT_MAX) < position) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Adds an entry to a sorted list. Fresh slots are the highest yet and
+// simply append; a reused slot is inserted in order, or brings back its
+// own dead entry. A repeat finds itself already there.
+static int posting_insert(int **list, int *count, int *capacity, int *dead, int first_capacity, int entry) {
+    int at = *count;
+    if (at > 0 && ((*list)[at - 1] & INT_MAX) >= entry) {
+        at = posting_lower_bound(*list, *count, entry);
+        if (((*list)[at] & INT_MAX) == entry) {
+            if ((*list)[at] < 0) {
+                (*list)[at] = entry;
+                (*dead)--;
+            }
+            return 1;
+        }
+    }
+    if (*count >= *capacity) {
+        int new_capacity = *capacity == 0 ? first_capacity : *capacity * 2;
+        int *bigger = lib_realloc(*list, sizeof(int) * new_capacity);
+        if (bigger == NULL) {
+            return 0;
+        }
+        *list = bigger;
+        *capacity = new_capacity;
+    }
+    memmove(&(*list)[at + 1], &(*list)[at], sizeof(int) * (*count - at));
+    (*list)[at] = entry;
+    (*count)++;
+    return 1;
+}
+
+// Marks an entry dead, or drops it outright when it is the last one
+static void posting_remove(int *list, int *count, int *dead, int entry) {
+    int at = posting_lower_bound(list, *count, entry);
+    if (at == *count || list[at] != entry) {
+        return;
+    }
+    if (at == *count - 1) {
+        (*count)--;
+    } else {
+        list[at] |= POSTING_DEAD;
+        (*dead)++;
+    }
+    
+    if (*dead * POSTING_DEAD_SHARE > *count) {
+        int kept = 0;
+        for (int i = 0; i < *count; i++) {
+            if (list[i] >= 0) {
+                list[kept++] = list[i];
+            }
+        }
+        *count = kept;
+        *dead = 0;
+    }
+}
+
+static int trigram_index_add_text(TrigramIndex *index, const char *text, int position) {
+    int len = strlen(text);
+    
+    for (int i = 0; i + 3 <= len; i++) {
+        Posting *posting = trigram_index_get_or_create(index, pack_trigram(text + i));
+        if (posting == NULL ||
+            !posting_insert(&posting->books, &posting->count, &posting->capacity, &posting->dead, 4, position)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int trigram_index_add_book(TrigramIndex *index, const Library *lib, const Book *book, int position) {
+    if (!trigram_index_add_text(index, book_title(lib, book), position)) {
+        return 0;
+    }
+    for (int i = 0; i < book->author_count; i++) {
+        if (!trigram_index_add_text(index, book_author(lib, book, i), position)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void trigram_index_remove_text(TrigramIndex *index, const char *text, int position) {
+    int len = strlen(text);
+    
+    for (int i = 0; i + 3 <= len; i++) {
+        Posting *posting = trigram_index_get(index, pack_trigram(text + i));
+        if (posting != NULL) {
+            posting_remove(posting->books, &posting->count, &posting->dead, position);
+        }
+    }
+}
+
+void trigram_index_remove_book(TrigramIndex *index, const Library *lib, const Book *book, int position) {
+    trigram_index_remove_text(index, book_title(lib, book), position);
+    for (int i = 0; i < book->author_count; i++) {
+        trigram_index_remove_text(index, book_author(lib, book, i), position);
+    }
+}
+
+static int compare_posting_length(const void *a, const void *b) {
+    const Posting *pa = *(const Posting * const *)a;
+    const Posting *pb = *(const Posting * const *)b;
+    int a_live = pa->count - pa->dead, b_live = pb->count - pb->dead;
+    return (a_live > b_live) - (a_live < b_live);
+}
+
+int trigram_index_candidates(TrigramIndex *index, const char *term, int **candidates, int *candidate_count) {
+    int len = strlen(term);
+    *candidates = NULL;
+    *candidate_count = 0;
+    
+    if (len < 3) {
+        return 0; // Too short to be answered by the index
+    }
+    
+    Posting **lists = lib_malloc(sizeof(Posting*) * (len - 2));
+    if (lists == NULL) {
+        return 0;
+    }
+    
+    int list_count = 0;
+    for (int i = 0; i + 3 <= len; i++) {
+        Posting *posting = trigram_index_get(index, pack_trigram(term + i));
+        if (posting == NULL || posting->count == posting->dead) {
+            lib_free(lists);
+            return 1; // A trigram no book contains: nothing can match
+        }
+        lists[list_count++] = posting;
+    }
+    
+    // Intersect starting from the rarest trigram so the working set only shrinks
+    qsort(lists, list_count, sizeof(Posting*), compare_posting_length);
+    
+    int *result = lib_malloc(sizeof(int) * lists[0]->count);
+    if (result == NULL) {
+        lib_free(lists);
+        return 0;
+    }
+    int count = 0;
+    for (int i = 0; i < lists[0]->count; i++) {
+        if (lists[0]->books[i] >= 0) {
+            result[count++] = lists[0]->books[i];
+        }
+    }
+    
+    for (int l = 1; l < list_count && count > 0; l++) {
+        if (lists[l] == lists[l - 1]) continue; // Repeated trigram in the term
+        
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            int at = posting_lower_bound(lists[l]->books, lists[l]->count, result[i]);
+            if (at < lists[l]->count && lists[l]->books[at] == result[i]) {
+                result[kept++] = result[i];
+            }
+        }
+        count = kept;
+    }
+    
+    lib_free(lists);
+    *candidates = result;
+    *candidate_count = count;
+    return 1;
+}
+
+/* ================== WORD INDEX ==================== */
+
+// Word bytes are ASCII letters and digits plus every byte of a multi-byte
+// UTF-8 sequence, so accented names stay in one word
+static int is_word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Copies the next word of *cursor, case-folded, into word (INDEXED_WORD_MAX bytes)
+// and returns its length; 0 once the text is exhausted
+static int next_word(const char **cursor, char *word) {
+    const unsigned char *p = (const unsigned char *)*cursor;
+    while (*p != '\0' && !is_word_byte(*p)) {
+        p++;
+    }
+
+    int len = 0;
+    while (is_word_byte(*p)) {
+        if (len < INDEXED_WORD_MAX - 1) {
+            word[len++] = (char)fold_ascii(*p);
+        }
+        p++;
+    }
+    word[len] = '\0';
+    *cursor = (const char *)p;
+    return len;
+}
+
+// Levenshtein distance between two words of at most INDEXED_WORD_MAX - 1
+// bytes. Bit-parallel (Myers/Hyyro): one bit per byte of a, so each byte of
+// b costs a handful of word operations instead of a row of the DP table.
+static int edit_distance(const char *a, const char *b) {
+    int len_a = strlen(a);
+    if (len_a == 0) {
+        return strlen(b);
+    }
+
+    // Only the entries for bytes of a and b are read, so only they are cleared
+    uint64_t matches[256];
+    for (const unsigned char *p = (const unsigned char *)b; *p != '\0'; p++) {
+        matches[*p] = 0;
+    }
+    for (int i = 0; i < len_a; i++) {
+        matches[(unsigned char)a[i]] = 0;
+    }
+    for (int i = 0; i < len_a; i++) {
+        matches[(unsigned char)a[i]] |= 1ULL << i;
+    }
+
+    uint64_t plus = ~0ULL, minus = 0, last = 1ULL << (len_a - 1);
+    int distance = len_a;
+    for (const unsigned char *p = (const unsigned char *)b; *p != '\0'; p++) {
+        uint64_t eq = matches[*p];
+        uint64_t vertical = eq | minus;
+        uint64_t horizontal = (((eq & plus) + plus) ^ plus) | eq;
+        uint64_t h_plus = minus | ~(horizontal | plus);
+        uint64_t h_minus = plus & horizontal;
+        if (h_plus & last) distance++;
+        if (h_minus & last) distance--;
+        h_plus = (h_plus << 1) | 1;
+        h_minus <<= 1;
+        plus = h_minus | ~(vertical | h_plus);
+        minus = h_plus & vertical;
+    }
+    return distance;
+}
+
+static int word_table_alloc(WordIndex *index, int capacity) {
+    index->table = lib_malloc(sizeof(int) * capacity);
+    if (index->table == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < capacity; i++) {
+        index->table[i] = -1;
+    }
+    index->table_capacity = capacity;
+    return 1;
+}
+
+int word_index_init(WordIndex *index) {
+    index->words = NULL;
+    index->word_count = 0;
+    index->word_capacity = 0;
+    index->sorted = NULL;
+    index->sorted_count = 0;
+    if (!word_table_alloc(index, 1024)) {
+        return 0;
+    }
+    if (!string_pool_init(&index->strings)) {
+        lib_free(index->table);
+        return 0;
+    }
+    pthread_mutex_init(&index->sort_lock, NULL);
+    return 1;
+}
+
+void word_index_free(WordIndex *index) {
+    for (int i = 0; i < index->word_count; i++) {
+        lib_free(index->words[i].entries);
+    }
+    lib_free(index->words);
+    lib_free(index->table);
+    lib_free(index->sorted);
+    string_pool_free(&index->strings);
+    pthread_mutex_destroy(&index->sort_lock);
+    index->words = NULL;
+    index->table = NULL;
+    index->sorted = NULL;
+    index->word_count = 0;
+}
+
+static int word_index_find(const WordIndex *index, const char *text, unsigned int hash) {
+    unsigned int mask = (unsigned int)index->table_capacity - 1;
+    for (unsigned int slot = hash & mask; index->table[slot] >= 0; slot = (slot + 1) & mask) {
+        const Word *word = &index->words[index->table[slot]];
+        if (word->hash == hash && strcmp(word->text, text) == 0) {
+            return index->table[slot];
+        }
+    }
+    return -1;
+}
+
+static int word_table_grow(WordIndex *index) {
+    int *old_table = index->table;
+    if (!word_table_alloc(index, index->table_capacity * 2)) {
+        index->table = old_table;
+        return 0;
+    }
+    lib_free(old_table);
+
+    // Rehash from the cached hashes, the texts are not touched
+    unsigned int mask = (unsigned int)index->table_capacity - 1;
+    for (int id = 0; id < index->word_count; id++) {
+        unsigned int slot = index->words[id].hash & mask;
+        while (index->table[slot] >= 0) {
+            slot = (slot + 1) & mask;
+        }
+        index->table[slot] = id;
+    }
+    return 1;
+}
+
+// Hangs a new word under the BK-tree rooted at word 0: walk down the child
+// at the same distance until there is none, then attach there
+static void bk_tree_insert(WordIndex *index, int id) {
+    int node = 0;
+    while (node != id) {
+        int distance = edit_distance(index->words[id].text, index->words[node].text);
+        int child = index->words[node].bk_child;
+        while (child >= 0 && index->words[child].bk_distance != distance) {
+            child = index->words[child].bk_sibling;
+        }
+        if (child < 0) {
+            index->words[id].bk_distance = distance;
+            index->words[id].bk_sibling = index->words[node].bk_child;
+            index->words[node].bk_child = id;
+            return;
+        }
+        node = child;
+    }
+}
+
+static int word_index_get_or_create(WordIndex *index, const char *text, int len) {
+    unsigned int hash = string_hash(text);
+    int id = word_index_find(index, text, hash);
+    if (id >= 0) {
+        return id;
+    }
+
+    if ((index->word_count + 1) * 4 > index->table_capacity * 3 && !word_table_grow(index)) {
+        return -1;
+    }
+    if (index->word_count == index->word_capacity) {
+        int new_capacity = index->word_capacity == 0 ? 256 : index->word_capacity * 2;
+        Word *new_words = lib_realloc(index->words, sizeof(Word) * new_capacity);
+        if (new_words == NULL) {
+            return -1;
+        }
+        index->words = new_words;
+        index->word_capacity = new_capacity;
+    }
+
+    char *copy = string_pool_alloc(&index->strings, len + 1);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, text, len + 1);
+
+    id = index->word_count++;
+    Word *word = &index->words[id];
+    word->text = copy;
+    word->hash = hash;
+    word->entries = NULL;
+    word->count = 0;
+    word->capacity = 0;
+    word->dead = 0;
+    word->bk_child = -1;
+    word->bk_sibling = -1;
+    word->bk_distance = 0;
+
+    unsigned int mask = (unsigned int)index->table_capacity - 1;
+    unsigned int slot = hash & mask;
+    while (index->table[slot] >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    index->table[slot] = id;
+    return id;
+}
+
+static int word_index_add_text(WordIndex *index, const char *text, int entry) {
+    char folded[INDEXED_WORD_MAX];
+    int len;
+
+    while ((len = next_word(&text, folded)) > 0) {
+        int id = word_index_get_or_create(index, folded, len);
+        if (id < 0) {
+            return 0;
+        }
+
+        // Same ordering rules as the trigram postings
+        Word *word = &index->words[id];
+        if (!posting_insert(&word->entries, &word->count, &word->capacity, &word->dead, 2, entry)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int word_index_add_book(WordIndex *index, const Library *lib, const Book *book, int slot) {
+    if (!word_index_add_text(index, book_title(lib, book), slot << 1)) {
+        return 0;
+    }
+    for (int i = 0; i < book->author_count; i++) {
+        if (!word_index_add_text(index, book_author(lib, book, i), slot << 1 | 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void word_index_remove_text(WordIndex *index, const char *text, int entry) {
+    char folded[INDEXED_WORD_MAX];
+
+    while (next_word(&text, folded) > 0) {
+        int id = word_index_find(index, folded, string_hash(folded));
+        if (id < 0) continue;
+
+        // Emptied words stay in the dictionary and the tree; searches skip them
+        Word *word = &index->words[id];
+        posting_remove(word->entries, &word->count, &word->dead, entry);
+    }
+}
+
+void word_index_remove_book(WordIndex *index, const Library *lib, const Book *book, int slot) {
+    word_index_remove_text(index, book_title(lib, book), slot << 1);
+    for (int i = 0; i < book->author_count; i++) {
+        word_index_remove_text(index, book_author(lib, book, i), slot << 1 | 1);
+    }
+}
+
+static int compare_word_text(const void *a, const void *b) {
+    return strcmp((*(const Word * const *)a)->text, (*(const Word * const *)b)->text);
+}
+
+// Brings the sorted word array and the BK-tree up to date with the words
+// added since the last call. Sorting them and merging them in costs one
+// merge however many arrived; building the tree here rather than on insert
+// keeps it off the snapshot load path of catalogs nobody searches.
+static int word_index_catch_up(WordIndex *index) {
+    pthread_mutex_lock(&index->sort_lock);
+    int fresh = index->word_count - index->sorted_count;
+    if (fresh == 0) {
+        pthread_mutex_unlock(&index->sort_lock);
+        return 1;
+    }
+
+    const Word **added = lib_malloc(sizeof(Word*) * fresh);
+    int *merged = lib_malloc(sizeof(int) * index->word_count);
+    if (added == NULL || merged == NULL) {
+        lib_free(added);
+        lib_free(merged);
+        pthread_mutex_unlock(&index->sort_lock);
+        return 0;
+    }
+    for (int i = 0; i < fresh; i++) {
+        added[i] = &index->words[index->sorted_count + i];
+    }
+    for (int id = index->sorted_count; id < index->word_count; id++) {
+        bk_tree_insert(index, id);
+    }
+    qsort(added, fresh, sizeof(Word*), compare_word_text);
+
+    int a = 0, b = 0, out = 0;
+    while (a < index->sorted_count || b < fresh) {
+        if (b == fresh || (a < index->sorted_count &&
+                           strcmp(index->words[index->sorted[a]].text, added[b]->text) < 0)) {
+            merged[out++] = index->sorted[a++];
+        } else {
+            merged[out++] = (int)(added[b++] - index->words);
+        }
+    }
+
+    lib_free(added);
+    lib_free(index->sorted);
+    index->sorted = merged;
+    index->sorted_count = index->word_count;
+    pthread_mutex_unlock(&index->sort_lock);
+    return 1;
+}
+
+// Range [*first, *last) of the sorted array holding the words that start
+// with prefix
+static void word_prefix_range(const WordIndex *index, const char *prefix, int *first, int *last) {
+    size_t len = strlen(prefix);
+    int lo = 0, hi = index->sorted_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(index->words[index->sorted[mid]].text, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *first = lo;
+
+    hi = index->sorted_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strncmp(index->words[index->sorted[mid]].text, prefix, len) == 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *last = lo;
+}
+
+// Books still listed under the word
+static int word_books(const Word *word) {
+    return word->count - word->dead;
+}
+
+// Keeps the `limit` word ids with the most books, best first, in picked[];
+// returns how many were kept
+static int pick_frequent_words(const WordIndex *index, const int *ids, int count, int limit, int *picked) {
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        int id = ids[i];
+        int books = word_books(&index->words[id]);
+        if (books == 0 || (kept == limit && books <= word_books(&index->words[picked[kept - 1]]))) {
+            continue;
+        }
+
+        // Insertion into a short sorted list; limit is small
+        int at = kept < limit ? kept++ : limit - 1;
+        while (at > 0 && word_books(&index->words[picked[at - 1]]) < books) {
+            picked[at] = picked[at - 1];
+            at--;
+        }
+        picked[at] = id;
+    }
+    return kept;
+}
+
+// Collects up to `limit` words within max_distance edits of text (at least
+// one edit) by walking only the BK-tree branches the triangle inequality
+// allows
+static int bk_tree_search(const WordIndex *index, const char *text, int max_distance, int limit, int *found) {
+    if (index->word_count == 0) {
+        return 0;
+    }
+
+    int *stack = lib_malloc(sizeof(int) * index->word_count);
+    if (stack == NULL) {
+        return 0;
+    }
+    int depth = 0, count = 0;
+    stack[depth++] = 0;
+    while (depth > 0 && count < limit) {
+        const Word *node = &index->words[stack[--depth]];
+        int distance = edit_distance(text, node->text);
+        if (distance > 0 && distance <= max_distance && word_books(node) > 0) {
+            found[count++] = (int)(node - index->words);
+        }
+        for (int child = node->bk_child; child >= 0; child = index->words[child].bk_sibling) {
+            int edge = index->words[child].bk_distance;
+            if (edge >= distance - max_distance && edge <= distance + max_distance) {
+                stack[depth++] = child;
+            }
+        }
+    }
+    lib_free(stack);
+    return count;
+}
+
+/* ================== RANKED SEARCH ==================== */
+
+// Points for one query word found in a book; title hits count double
+#define RANK_EXACT         8
+#define RANK_PREFIX        5
+#define RANK_TYPO          3   // One edit away; two edits score one less
+#define RANK_WHOLE_TITLE  20   // The query is the book's whole title
+#define RANK_EXPANSIONS   64   // Prefix or typo words tried per query word
+#define RANK_QUERY_WORDS  16
+
+// Scores of the books a query touches, indexed by slot. A book keeps only
+// its best score for each query word, so a word that matches a title twice,
+// or both exactly and as a prefix, is not counted twice. Postings are sorted
+// by slot, so the arrays are walked mostly in order.
+typedef struct {
+    int *total;            // Score over the finished query words
+    int *word_best;        // Best score for the current query word
+    int *touched;          // Slots with a nonzero total
+    int touched_count;
+    int *word_touched;     // Slots with a nonzero word_best
+    int word_touched_count;
+} RankScores;
+
+static int rank_scores_init(RankScores *scores, int slot_count) {
+    // calloc hands back zeroed pages lazily, so only the touched part of a
+    // large catalog costs anything
+    scores->total = lib_calloc(slot_count + 1, sizeof(int));
+    scores->word_best = lib_calloc(slot_count + 1, sizeof(int));
+    scores->touched = lib_malloc(sizeof(int) * (slot_count + 1));
+    scores->word_touched = lib_malloc(sizeof(int) * (slot_count + 1));
+    scores->touched_count = 0;
+    scores->word_touched_count = 0;
+    if (scores->total == NULL || scores->word_best == NULL ||
+        scores->touched == NULL || scores->word_touched == NULL) {
+        lib_free(scores->total);
+        lib_free(scores->word_best);
+        lib_free(scores->touched);
+        lib_free(scores->word_touched);
+        return 0;
+    }
+    return 1;
+}
+
+static void rank_scores_free(RankScores *scores) {
+    lib_free(scores->total);
+    lib_free(scores->word_best);
+    lib_free(scores->touched);
+    lib_free(scores->word_touched);
+}
+
+// Credits every book containing the word; authors earn half a title's points
+static void rank_word(RankScores *scores, const Word *word, int points) {
+    for (int i = 0; i < word->count; i++) {
+        if (word->entries[i] < 0) continue;
+        int slot = word->entries[i] >> 1;
+        int score = (word->entries[i] & 1) ? points : points * 2;
+        if (scores->word_best[slot] == 0) {
+            scores->word_touched[scores->word_touched_count++] = slot;
+        }
+        if (score > scores->word_best[slot]) {
+            scores->word_best[slot] = score;
+        }
+    }
+}
+
+// Adds the current query word's scores to the totals and clears them
+static void rank_finish_word(RankScores *scores) {
+    for (int i = 0; i < scores->word_touched_count; i++) {
+        int slot = scores->word_touched[i];
+        if (scores->total[slot] == 0) {
+            scores->touched[scores->touched_count++] = slot;
+        }
+        scores->total[slot] += scores->word_best[slot];
+        scores->word_best[slot] = 0;
+    }
+    scores->word_touched_count = 0;
+}
+
+static void rank_query_word(Library *lib, RankScores *scores, const char *text) {
+    WordIndex *index = &lib->word_index;
+    int expansions[RANK_EXPANSIONS];
+    int len = strlen(text);
+
+    int exact = word_index_find(index, text, string_hash(text));
+    if (exact >= 0) {
+        rank_word(scores, &index->words[exact], RANK_EXACT);
+    }
+
+    // Longer words that start with it, the most widely used first
+    if (len >= 2) {
+        int first, last;
+        word_prefix_range(index, text, &first, &last);
+        int picked = pick_frequent_words(index, index->sorted + first, last - first,
+                                         RANK_EXPANSIONS, expansions);
+        for (int i = 0; i < picked; i++) {
+            if (expansions[i] != exact) {
+                rank_word(scores, &index->words[expansions[i]], RANK_PREFIX);
+            }
+        }
+    }
+
+    // Typos: one edit from four letters, two from eight
+    if (len >= 4) {
+        int max_distance = len >= 8 ? 2 : 1;
+        int found = bk_tree_search(index, text, max_distance, RANK_EXPANSIONS, expansions);
+        for (int i = 0; i < found; i++) {
+            const Word *word = &index->words[expansions[i]];
+            rank_word(scores, word, edit_distance(text, word->text) == 1 ? RANK_TYPO : RANK_TYPO - 1);
+        }
+    }
+    rank_finish_word(scores);
+}
+
+// Higher score first, then catalog order (all books live in one array)
+static int hit_better(const SearchHit *a, const SearchHit *b) {
+    if (a->score != b->score) {
+        return a->score > b->score;
+    }
+    return a->book < b->book;
+}
+
+static void hit_sift_down(SearchHit *heap, int count, int i) {
+    while (1) {
+        int worst = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < count && hit_better(&heap[worst], &heap[left])) worst = left;
+        if (right < count && hit_better(&heap[worst], &heap[right])) worst = right;
+        if (worst == i) return;
+        SearchHit tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+// Best `limit` books for the query, best first, in hits[]. Every word of the
+// query is matched exactly, as a prefix and with typos against the word
+// index; a book's score is the sum of its best match for each query word.
+// Returns the number of hits, or -1 if memory ran out.
+static int library_rank_books_untimed(Library *lib, const char *query, int limit, SearchHit *hits) {
+    if (limit <= 0) {
+        return 0;
+    }
+    if (!word_index_catch_up(&lib->word_index)) {
+        return -1;
+    }
+
+    RankScores scores;
+    if (!rank_scores_init(&scores, lib->slot_count)) {
+        return -1;
+    }
+
+    char folded[INDEXED_WORD_MAX];
+    const char *cursor = query;
+    for (int query_word = 0; query_word < RANK_QUERY_WORDS && next_word(&cursor, folded) > 0; query_word++) {
+        rank_query_word(lib, &scores, folded);
+    }
+
+    Book *whole = find_book_by_title(lib, query);
+    if (whole != NULL) {
+        scores.word_best[whole->slot] = RANK_WHOLE_TITLE;
+        scores.word_touched[scores.word_touched_count++] = whole->slot;
+        rank_finish_word(&scores);
+    }
+
+    // Bounded min-heap: the root is the worst of the best `limit` so far
+    int count = 0;
+    for (int i = 0; i < scores.touched_count; i++) {
+        int slot = scores.touched[i];
+        SearchHit hit = { library_book_in_slot(lib, slot), scores.total[slot] };
+        if (count < limit) {
+            hits[count] = hit;
+            for (int at = count++; at > 0 && hit_better(&hits[(at - 1) / 2], &hits[at]); at = (at - 1) / 2) {
+                SearchHit tmp = hits[at];
+                hits[at] = hits[(at - 1) / 2];
+                hits[(at - 1) / 2] = tmp;
+            }
+        } else if (hit_better(&hit, &hits[0])) {
+            hits[0] = hit;
+            hit_sift_down(hits, count, 0);
+        }
+    }
+    rank_scores_free(&scores);
+
+    // Pop the worst to the back until the array reads best first
+    for (int end = count - 1; end > 0; end--) {
+        SearchHit tmp = hits[0];
+        hits[0] = hits[end];
+        hits[end] = tmp;
+        hit_sift_down(hits, end, 0);
+    }
+    return count;
+}
+
+int library_rank_books(Library *lib, const char *query, int limit, SearchHit *hits) {
+    METRIC_START(timer);
+    int found = library_rank_books_untimed(lib, query, limit, hits);
+    METRIC_STOP(METRIC_RANK_BOOKS, timer);
+    return found;
+}
+
+// Autocompletion: up to `limit` indexed words starting with prefix, the
+// most widely used first. The words are case-folded and stay valid until
+// the library is destroyed. Returns the number found, or -1 if memory ran out.
+int library_complete_word(Library *lib, const char *prefix, int limit, const char **words) {
+    WordIndex *index = &lib->word_index;
+    char folded[INDEXED_WORD_MAX];
+    const char *cursor = prefix;
+    if (next_word(&cursor, folded) == 0 || limit <= 0) {
+        return 0;
+    }
+    if (!word_index_catch_up(index)) {
+        return -1;
+    }
+
+    int *picked = lib_malloc(sizeof(int) * limit);
+    if (picked == NULL) {
+        return -1;
+    }
+    int first, last;
+    word_prefix_range(index, folded, &first, &last);
+    int count = pick_frequent_words(index, index->sorted + first, last - first, limit, picked);
+    for (int i = 0; i < count; i++) {
+        words[i] = index->words[picked[i]].text;
+    }
+    lib_free(picked);
+    return count;
+}
+
+/* ================== ORDERED INDEX ==================== */
+
+static int int_entry_less(int key_a, int slot_a, int key_b, int slot_b) {
+    return key_a < key_b || (key_a == key_b && slot_a < slot_b);
+}
+
+int int_index_init(IntIndex *index) {
+    index->bucket_capacity = 8;
+    index->bucket_count = 0;
+    index->count = 0;
+    index->buckets = lib_malloc(sizeof(IntBucket) * index->bucket_capacity);
+    return index->buckets != NULL;
+}
+
+void int_index_free(IntIndex *index) {
+    for (int i = 0; i < index->bucket_count; i++) {
+        lib_free(index->buckets[i].entries);
+    }
+    lib_free(index->buckets);
+    index->buckets = NULL;
+    index->bucket_count = 0;
+    index->bucket_capacity = 0;
+    index->count = 0;
+}
+
+// Last bucket whose first entry is not after (key, slot), or 0
+static int int_index_find_bucket(const IntIndex *index, int key, int slot) {
+    int lo = 0, hi = index->bucket_count;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        const IntEntry *first = &index->buckets[mid].entries[0];
+        if (int_entry_less(key, slot, first->key, first->slot)) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    return lo;
+}
+
+// First entry in the bucket that is not before (key, slot)
+static int int_bucket_lower_bound(const IntBucket *bucket, int key, int slot) {
+    int lo = 0, hi = bucket->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (int_entry_less(bucket->entries[mid].key, bucket->entries[mid].slot, key, slot)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Opens an empty bucket at position `at` of the bucket array
+static IntBucket* int_index_open_bucket(IntIndex *index, int at) {
+    if (index->bucket_count >= index->bucket_capacity) {
+        int new_capacity = index->bucket_capacity * 2;
+        IntBucket *new_buckets = lib_realloc(index->buckets, sizeof(IntBucket) * new_capacity);
+        if (new_buckets == NULL) {
+            return NULL;
+        }
+        index->buckets = new_buckets;
+        index->bucket_capacity = new_capacity;
+    }
+    
+    IntEntry *entries = lib_malloc(sizeof(IntEntry) * INT_INDEX_BUCKET);
+    if (entries == NULL) {
+        return NULL;
+    }
+    memmove(&index->buckets[at + 1], &index->buckets[at], sizeof(IntBucket) * (index->bucket_count - at));
+    index->bucket_count++;
+    index->buckets[at].entries = entries;
+    index->buckets[at].count = 0;
+    return &index->buckets[at];
+}
+
+int int_index_insert(IntIndex *index, int key, int slot) {
+    if (index->bucket_count == 0 && int_index_open_bucket(index, 0) == NULL) {
+        return 0;
+    }
+    
+    int b = int_index_find_bucket(index, key, slot);
+    IntBucket *bucket = &index->buckets[b];
+    if (bucket->count == INT_INDEX_BUCKET) {
+        // Split the full bucket in half and continue in the half that
+        // the new entry belongs to
+        IntBucket *upper = int_index_open_bucket(index, b + 1);
+        if (upper == NULL) {
+            return 0;
+        }
+        bucket = &index->buckets[b];
+        int half = INT_INDEX_BUCKET / 2;
+        memcpy(upper->entries, &bucket->entries[half], sizeof(IntEntry) * (INT_INDEX_BUCKET - half));
+        upper->count = INT_INDEX_BUCKET - half;
+        bucket->count = half;
+        if (!int_entry_less(key, slot, upper->entries[0].key, upper->entries[0].slot)) {
+            bucket = upper;
+        }
+    }
+    
+    int at = int_bucket_lower_bound(bucket, key, slot);
+    memmove(&bucket->entries[at + 1], &bucket->entries[at], sizeof(IntEntry) * (bucket->count - at));
+    bucket->entries[at].key = key;
+    bucket->entries[at].slot = slot;
+    bucket->count++;
+    index->count++;
+    return 1;
+}
+
+void int_index_remove(IntIndex *index, int key, int slot) {
+    if (index->bucket_count == 0) {
+        return;
+    }
+    
+    int b = int_index_find_bucket(index, key, slot);
+    IntBucket *bucket = &index->buckets[b];
+    int at = int_bucket_lower_bound(bucket, key, slot);
+    if (at >= bucket->count || bucket->entries[at].key != key || bucket->entries[at].slot != slot) {
+        return;
+    }
+    
+    memmove(&bucket->entries[at], &bucket->entries[at + 1], sizeof(IntEntry) * (bucket->count - at - 1));
+    bucket->count--;
+    index->count--;
+    
+    // Empty buckets are dropped so every bucket has a first entry to search by
+    if (bucket->count == 0) {
+        lib_free(bucket->entries);
+        memmove(&index->buckets[b], &index->buckets[b + 1], sizeof(IntBucket) * (index->bucket_count - b - 1));
+        index->bucket_count--;
+    }
+}
+
+// Adds entries sorted by key, then slot, by merging them with the existing
+// entries into a new set of full buckets
+static int int_index_merge(IntIndex *index, const IntEntry *sorted, int count) {
+    int total = index->count + count;
+    int bucket_count = (total + INT_INDEX_BUCKET - 1) / INT_INDEX_BUCKET;
+    int bucket_capacity = bucket_count > 8 ? bucket_count : 8;
+    IntBucket *buckets = lib_malloc(sizeof(IntBucket) * bucket_capacity);
+    if (buckets == NULL) {
+        return 0;
+    }
+    for (int b = 0; b < bucket_count; b++) {
+        buckets[b].entries = lib_malloc(sizeof(IntEntry) * INT_INDEX_BUCKET);
+        buckets[b].count = 0;
+        if (buckets[b].entries == NULL) {
+            for (int i = 0; i < b; i++) {
+                lib_free(buckets[i].entries);
+            }
+            lib_free(buckets);
+            return 0;
+        }
+    }
+    
+    int old_bucket = 0, old_at = 0, added = 0;
+    for (int out = 0; out < total; out++) {
+        const IntEntry *next = &sorted[added];
+        if (added == count || (old_bucket < index->bucket_count &&
+                               int_entry_less(index->buckets[old_bucket].entries[old_at].key,
+                                              index->buckets[old_bucket].entries[old_at].slot,
+                                              next->key, next->slot))) {
+            next = &index->buckets[old_bucket].entries[old_at];
+            if (++old_at == index->buckets[old_bucket].count) {
+                old_bucket++;
+                old_at = 0;
+            }
+        } else {
+            added++;
+        }
+        IntBucket *bucket = &buckets[out / INT_INDEX_BUCKET];
+        bucket->entries[bucket->count++] = *next;
+    }
+    
+    int_index_free(index);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+    index->bucket_capacity = bucket_capacity;
+    index->count = total;
+    return 1;
+}
+
+// First entry with a key of at least `key`, as a bucket and a position in
+// it; *bucket is bucket_count when every key is smaller
+static void int_index_seek(const IntIndex *index, int key, int *bucket, int *at) {
+    if (index->bucket_count == 0) {
+        *bucket = 0;
+        *at = 0;
+        return;
+    }
+    
+    int b = int_index_find_bucket(index, key, INT_MIN);
+    int position = int_bucket_lower_bound(&index->buckets[b], key, INT_MIN);
+    if (position == index->buckets[b].count) {
+        b++;
+        position = 0;
+    }
+    *bucket = b;
+    *at = position;
+}
+
+// Number of entries with keys in [low, high]; whole buckets are counted
+// without looking inside them
+int int_index_count_range(const IntIndex *index, int low, int high) {
+    if (low > high) {
+        return 0;
+    }
+    
+    int first_bucket, first_at, end_bucket, end_at;
+    int_index_seek(index, low, &first_bucket, &first_at);
+    if (high == INT_MAX) {
+        end_bucket = index->bucket_count;
+        end_at = 0;
+    } else {
+        int_index_seek(index, high + 1, &end_bucket, &end_at);
+    }
+    
+    int count = end_at - first_at;
+    for (int b = first_bucket; b < end_bucket; b++) {
+        count += index->buckets[b].count;
+    }
+    return count;
+}
+
+// Slots of the entries with keys in [low, high], in key order, in a new
+// array. Returns how many, or -1 if memory ran out.
+int int_index_range(const IntIndex *index, int low, int high, int **slots) {
+    int count = int_index_count_range(index, low, high);
+    *slots = lib_malloc(sizeof(int) * (count > 0 ? count : 1));
+    if (*slots == NULL) {
+        return -1;
+    }
+    
+    int b, at;
+    int_index_seek(index, low, &b, &at);
+    for (int i = 0; i < count; i++, at++) {
+        if (at == index->buckets[b].count) {
+            b++;
+            at = 0;
+        }
+        (*slots)[i] = index->buckets[b].entries[at].slot;
+    }
+    return count;
+}
+
+const IntEntry* int_index_first(const IntIndex *index) {
+    if (index->count == 0) {
+        return NULL;
+    }
+    return &index->buckets[0].entries[0];
+}
+
+const IntEntry* int_index_last(const IntIndex *index) {
+    if (index->count == 0) {
+        return NULL;
+    }
+    const IntBucket *bucket = &index->buckets[index->bucket_count - 1];
+    return &bucket->entries[bucket->count - 1];
+}
+
+/* ================== BOOK COLUMNS ==================== */
+
+#define BITMAP_WORDS(count) (((count) + 63) / 64)
+
+int book_columns_init(BookColumns *columns, int capacity) {
+    columns->years = lib_malloc(sizeof(int16_t) * capacity);
+    columns->pages = lib_malloc(sizeof(uint16_t) * capacity);
+    columns->author_counts = lib_malloc(sizeof(uint8_t) * capacity);
+    columns->available = lib_calloc(BITMAP_WORDS(capacity), sizeof(uint64_t));
+    if (columns->years == NULL || columns->pages == NULL ||
+        columns->author_counts == NULL || columns->available == NULL) {
+        book_columns_free(columns);
+        return 0;
+    }
+    return 1;
+}
+
+void book_columns_free(BookColumns *columns) {
+    lib_free(columns->years);
+    lib_free(columns->pages);
+    lib_free(columns->author_counts);
+    lib_free(columns->available);
+    columns->years = NULL;
+    columns->pages = NULL;
+    columns->author_counts = NULL;
+    columns->available = NULL;
+}
+
+// Resizes every column to new_capacity books. On failure some columns may
+// already have the new size; they all still hold old_capacity books, so the
+// caller keeps its old capacity and nothing is lost.
+int book_columns_resize(BookColumns *columns, int old_capacity, int new_capacity) {
+    int16_t *years = lib_realloc(columns->years, sizeof(int16_t) * new_capacity);
+    if (years == NULL) return 0;
+    columns->years = years;
+    
+    uint16_t *pages = lib_realloc(columns->pages, sizeof(uint16_t) * new_capacity);
+    if (pages == NULL) return 0;
+    columns->pages = pages;
+    
+    uint8_t *author_counts = lib_realloc(columns->author_counts, sizeof(uint8_t) * new_capacity);
+    if (author_counts == NULL) return 0;
+    columns->author_counts = author_counts;
+    
+    int old_words = BITMAP_WORDS(old_capacity);
+    int new_words = BITMAP_WORDS(new_capacity);
+    if (new_words < old_words) {
+        // A failed shrink leaves the bigger bitmap, which is still valid
+        uint64_t *available = lib_realloc(columns->available, sizeof(uint64_t) * new_words);
+        if (available != NULL) columns->available = available;
+    } else if (new_words > old_words) {
+        uint64_t *available = lib_realloc(columns->available, sizeof(uint64_t) * new_words);
+        if (available == NULL) return 0;
+        memset(&available[old_words], 0, sizeof(uint64_t) * (new_words - old_words));
+        columns->available = available;
+    }
+    return 1;
+}
+
+void book_columns_store(BookColumns *columns, int position, const Book *book) {
+    columns->years[position] = book->year;
+    columns->pages[position] = book->pages;
+    columns->author_counts[position] = book->author_count;
+    book_columns_set_available(columns, position, book->is_available);
+}
+
+// Copies the book at `from` over `to` and clears the availability bit of
+// `from`, which is about to fall past the end of the catalog
+void book_columns_move(BookColumns *columns, int to, int from) {
+    columns->years[to] = columns->years[from];
+    columns->pages[to] = columns->pages[from];
+    columns->author_counts[to] = columns->author_counts[from];
+    uint64_t word = __atomic_load_n(&columns->available[from / 64], __ATOMIC_RELAXED);
+    book_columns_set_available(columns, to, (word >> (from % 64)) & 1);
+    book_columns_set_available(columns, from, 0);
+}
+
+void book_columns_set_available(BookColumns *columns, int position, int available) {
+    uint64_t bit = 1ULL << (position % 64);
+    if (available) {
+        __atomic_fetch_or(&columns->available[position / 64], bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&columns->available[position / 64], ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+/* ================== RUNNING STATISTICS ==================== */
+
+int activity_heap_init(ActivityHeap *heap, int capacity) {
+    heap->heap = lib_malloc(sizeof(int) * capacity);
+    heap->where = lib_malloc(sizeof(int) * capacity);
+    if (heap->heap == NULL || heap->where == NULL) {
+        lib_free(heap->heap);
+        lib_free(heap->where);
+        return 0;
+    }
+    heap->count = 0;
+    heap->capacity = capacity;
+    return 1;
+}
+
+void activity_heap_free(ActivityHeap *heap) {
+    lib_free(heap->heap);
+    lib_free(heap->where);
+    heap->heap = NULL;
+    heap->where = NULL;
+    heap->count = 0;
+    heap->capacity = 0;
+}
+
+int activity_heap_reserve(ActivityHeap *heap, int capacity) {
+    if (capacity <= heap->capacity) {
+        return 1;
+    }
+    
+    int *new_heap = lib_realloc(heap->heap, sizeof(int) * capacity);
+    if (new_heap == NULL) {
+        return 0;
+    }
+    heap->heap = new_heap;
+    int *new_where = lib_realloc(heap->where, sizeof(int) * capacity);
+    if (new_where == NULL) {
+        return 0;
+    }
+    heap->where = new_where;
+    heap->capacity = capacity;
+    return 1;
+}
+
+// Whether student a ranks above student b: more loans, then lower position
+static int activity_before(const StudentSystem *sys, int a, int b) {
+    int count_a = sys->students[a].borrowed_count;
+    int count_b = sys->students[b].borrowed_count;
+    return count_a > count_b || (count_a == count_b && a < b);
+}
+
+static void activity_heap_swap(ActivityHeap *heap, int i, int j) {
+    int tmp = heap->heap[i];
+    heap->heap[i] = heap->heap[j];
+    heap->heap[j] = tmp;
+    heap->where[heap->heap[i]] = i;
+    heap->where[heap->heap[j]] = j;
+}
+
+static void activity_heap_sift_up(StudentSystem *sys, int i) {
+    ActivityHeap *heap = &sys->activity;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!activity_before(sys, heap->heap[i], heap->heap[parent])) break;
+        activity_heap_swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+static void activity_heap_sift_down(StudentSystem *sys, int i) {
+    ActivityHeap *heap = &sys->activity;
+    while (1) {
+        int best = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap->count && activity_before(sys, heap->heap[left], heap->heap[best])) best = left;
+        if (right < heap->count && activity_before(sys, heap->heap[right], heap->heap[best])) best = right;
+        if (best == i) break;
+        activity_heap_swap(heap, i, best);
+        i = best;
+    }
+}
+
+void activity_heap_push(StudentSystem *sys, int position) {
+    ActivityHeap *heap = &sys->activity;
+    if (heap->count >= heap->capacity) {
+        return; // student_system_reserve keeps room for every student
+    }
+    heap->heap[heap->count] = position;
+    heap->where[position] = heap->count;
+    heap->count++;
+    activity_heap_sift_up(sys, heap->count - 1);
+}
+
+// Restores the order after a student's borrowed_count changed
+void activity_heap_update(StudentSystem *sys, int position) {
+    int i = sys->activity.where[position];
+    activity_heap_sift_up(sys, i);
+    activity_heap_sift_down(sys, sys->activity.where[position]);
+}
+
+void activity_heap_rebuild(StudentSystem *sys) {
+    ActivityHeap *heap = &sys->activity;
+    heap->count = sys->student_count < heap->capacity ? sys->student_count : heap->capacity;
+    for (int i = 0; i < heap->count; i++) {
+        heap->heap[i] = i;
+        heap->where[i] = i;
+    }
+    for (int i = heap->count / 2 - 1; i >= 0; i--) {
+        activity_heap_sift_down(sys, i);
+    }
+}
+
+/* ================== MEMORY ACCOUNTING ==================== */
+
+static size_t string_pool_bytes(const StringPool *pool) {
+    return pool->used;
+}
+
+static size_t string_pool_table_bytes(const StringPool *pool) {
+    return (sizeof(StringRef) + sizeof(unsigned int)) * (size_t)pool->capacity;
+}
+
+static size_t name_index_bytes(const NameIndex *index) {
+    return (sizeof(int) + sizeof(unsigned int)) * (size_t)index->capacity;
+}
+
+static size_t trigram_index_bytes(const TrigramIndex *index) {
+    size_t bytes = sizeof(Posting) * (size_t)index->capacity;
+    for (int i = 0; i < index->capacity; i++) {
+        if (index->postings[i].trigram != TRIGRAM_EMPTY) {
+            bytes += sizeof(int) * (size_t)index->postings[i].capacity;
+        }
+    }
+    return bytes;
+}
+
+static size_t word_index_bytes(const WordIndex *index) {
+    size_t bytes = sizeof(Word) * (size_t)index->word_capacity +
+                   sizeof(int) * ((size_t)index->table_capacity + index->sorted_count) +
+                   string_pool_bytes(&index->strings) + string_pool_table_bytes(&index->strings);
+    for (int i = 0; i < index->word_count; i++) {
+        bytes += sizeof(int) * (size_t)index->words[i].capacity;
+    }
+    return bytes;
+}
+
+static size_t int_index_bytes(const IntIndex *index) {
+    return sizeof(IntBucket) * (size_t)index->bucket_capacity +
+           sizeof(IntEntry) * INT_INDEX_BUCKET * (size_t)index->bucket_count;
+}
+
+static void memory_usage_total(MemoryUsage *usage) {
+    usage->total = usage->records + usage->slots + usage->strings + usage->string_table +
+                   usage->name_index + usage->text_index + usage->word_index +
+                   usage->ordered_index + usage->activity;
+}
+
+// Walks every posting list, so it takes a moment on a large catalog
+void library_memory_usage(const Library *lib, MemoryUsage *usage) {
+    memset(usage, 0, sizeof(*usage));
+    usage->records = sizeof(Book) * (size_t)lib->capacity;
+    usage->slots = sizeof(BookSlot) * (size_t)lib->slot_capacity +
+                   (sizeof(int16_t) + sizeof(uint16_t) + sizeof(uint8_t)) * (size_t)lib->capacity +
+                   sizeof(uint64_t) * BITMAP_WORDS(lib->capacity);
+    usage->strings = string_pool_bytes(&lib->strings);
+    usage->string_table = string_pool_table_bytes(&lib->strings);
+    usage->name_index = name_index_bytes(&lib->title_index);
+    usage->text_index = trigram_index_bytes(&lib->text_index);
+    usage->word_index = word_index_bytes(&lib->word_index);
+    usage->ordered_index = int_index_bytes(&lib->year_index) + int_index_bytes(&lib->page_index);
+    memory_usage_total(usage);
+}
+
+void student_system_memory_usage(const StudentSystem *sys, MemoryUsage *usage) {
+    memset(usage, 0, sizeof(*usage));
+    usage->records = sizeof(Student) * (size_t)sys->student_capacity;
+    usage->strings = string_pool_bytes(&sys->strings);
+    usage->string_table = string_pool_table_bytes(&sys->strings);
+    usage->name_index = name_index_bytes(&sys->name_index);
+    usage->activity = 2 * sizeof(int) * (size_t)sys->activity.capacity;
+    memory_usage_total(usage);
+}
+
+/* ================== PARALLEL SCAN ==================== */
+
+// Persistent pool that runs one scan at a time over [0, item_count), cut
+// into chunks. The calling thread works on chunks too, so a pool on a
+// single-core machine has no threads and a scan simply runs inline. A scan
+// started while another one owns the pool (server workers) also runs
+// inline rather than waiting.
+typedef struct {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t busy;      // Held by the thread whose scan owns the pool
+    pthread_mutex_t lock;      // Guards the job fields below
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned long generation;  // Bumped for every job
+    ScanFunction function;
+    void *context;
+    int item_count;
+    int chunk_count;
+    int next_chunk;            // Next chunk to hand out
+    int chunks_left;           // Chunks not finished yet
+} ScanPool;
+
+static ScanPool scan_pool;
+static pthread_once_t scan_pool_once = PTHREAD_ONCE_INIT;
+
+static void run_scan_chunk(ScanFunction function, void *context, int item_count, int chunk_count, int chunk) {
+    int begin = (int)((long long)item_count * chunk / chunk_count);
+    int end = (int)((long long)item_count * (chunk + 1) / chunk_count);
+    function(context, begin, end, chunk);
+}
+
+// Takes chunks of the current job until none are left; called with lock held
+static void scan_pool_drain(ScanPool *pool) {
+    while (pool->next_chunk < pool->chunk_count) {
+        int chunk = pool->next_chunk++;
+        pthread_mutex_unlock(&pool->lock);
+        run_scan_chunk(pool->function, pool->context, pool->item_count, pool->chunk_count, chunk);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->chunks_left == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+}
+
+static void* scan_pool_worker(void *arg) {
+    ScanPool *pool = arg;
+    unsigned long seen = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->generation == seen) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        seen = pool->generation;
+        scan_pool_drain(pool);
+    }
+    return NULL;
+}
+
+static void scan_pool_start(void) {
+    ScanPool *pool = &scan_pool;
+    pthread_mutex_init(&pool->busy, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus > 1 ? (int)cpus - 1 : 0;
+    if (wanted > SCAN_MAX_THREADS) {
+        wanted = SCAN_MAX_THREADS;
+    }
+    pool->threads = lib_malloc(sizeof(pthread_t) * (wanted + 1));
+    if (pool->threads == NULL) {
+        return;
+    }
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&pool->threads[i], &attr, scan_pool_worker, pool) != 0) break;
+        pool->thread_count++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+int parallel_scan_chunks(int item_count) {
+    pthread_once(&scan_pool_once, scan_pool_start);
+    if (item_count < PARALLEL_SCAN_MIN_ITEMS || scan_pool.thread_count == 0) {
+        return 1;
+    }
+    
+    // A few chunks per thread evens out chunks that match more often
+    int chunks = (scan_pool.thread_count + 1) * 4;
+    int max_chunks = item_count / (PARALLEL_SCAN_MIN_ITEMS / 4);
+    return chunks < max_chunks ? chunks : max_chunks;
+}
+
+void parallel_scan(int item_count, int chunk_count, ScanFunction function, void *context) {
+    ScanPool *pool = &scan_pool;
+    pthread_once(&scan_pool_once, scan_pool_start);
+    
+    if (chunk_count <= 1 || pool->thread_count == 0 || pthread_mutex_trylock(&pool->busy) != 0) {
+        for (int chunk = 0; chunk < chunk_count; chunk++) {
+            run_scan_chunk(function, context, item_count, chunk_count, chunk);
+        }
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->context = context;
+    pool->item_count = item_count;
+    pool->chunk_count = chunk_count;
+    pool->next_chunk = 0;
+    pool->chunks_left = chunk_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    
+    scan_pool_drain(pool);
+    while (pool->chunks_left > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->busy);
+}
+
+// Matching books per chunk, concatenated afterwards in chunk order
+typedef struct {
+    Library *lib;
+    const int *slots;          // Candidate slots, or NULL to scan every position
+    const char *term;
+    Book ***chunk_matches;
+    int *chunk_counts;         // -1 if the chunk ran out of memory
+} MatchScan;
+
+static void match_scan_chunk(void *context, int begin, int end, int chunk) {
+    MatchScan *scan = context;
+    Book **found = NULL;
+    int count = 0, capacity = 0;
+    
+    for (int i = begin; i < end; i++) {
+        Book *book = scan->slots != NULL ? library_book_in_slot(scan->lib, scan->slots[i]) : &scan->lib->books[i];
+        if (!book_matches(scan->lib, book, scan->term)) continue;
+        
+        if (count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            Book **bigger = lib_realloc(found, sizeof(Book*) * capacity);
+            if (bigger == NULL) {
+                lib_free(found);
+                scan->chunk_matches[chunk] = NULL;
+                scan->chunk_counts[chunk] = -1;
+                return;
+            }
+            found = bigger;
+        }
+        found[count++] = book;
+    }
+    scan->chunk_matches[chunk] = found;
+    scan->chunk_counts[chunk] = count;
+}
+
+// Books all live in one array, so address order is catalog order
+static int compare_book_address(const void *a, const void *b) {
+    const Book *x = *(Book * const *)a;
+    const Book *y = *(Book * const *)b;
+    return (x > y) - (x < y);
+}
+
+int collect_matching_books(Library *lib, const int *slots, int count, const char *term, Book ***matches) {
+    int chunk_count = parallel_scan_chunks(count);
+    MatchScan scan = { lib, slots, term, lib_calloc(chunk_count, sizeof(Book**)), lib_calloc(chunk_count, sizeof(int)) };
+    *matches = NULL;
+    if (scan.chunk_matches == NULL || scan.chunk_counts == NULL) {
+        lib_free(scan.chunk_matches);
+        lib_free(scan.chunk_counts);
+        return -1;
+    }
+    
+    parallel_scan(count, chunk_count, match_scan_chunk, &scan);
+    
+    // Merge in chunk order
+    int total = 0, failed = 0;
+    for (int c = 0; c < chunk_count; c++) {
+        if (scan.chunk_counts[c] < 0) {
+            failed = 1;
+        } else {
+            total += scan.chunk_counts[c];
+        }
+    }
+    Book **merged = failed ? NULL : lib_malloc(sizeof(Book*) * (total + 1));
+    if (merged != NULL) {
+        int at = 0;
+        for (int c = 0; c < chunk_count; c++) {
+            if (scan.chunk_counts[c] > 0) {
+                memcpy(merged + at, scan.chunk_matches[c], sizeof(Book*) * scan.chunk_counts[c]);
+                at += scan.chunk_counts[c];
+            }
+        }
+    }
+    for (int c = 0; c < chunk_count; c++) {
+        lib_free(scan.chunk_matches[c]);
+    }
+    lib_free(scan.chunk_matches);
+    lib_free(scan.chunk_counts);
+    
+    if (merged == NULL) {
+        return -1;
+    }
+    
+    // Candidates come in slot order, which removals (a swap with the last
+    // book) pull away from catalog order; only then is there anything to sort
+    if (slots != NULL) {
+        for (int i = 1; i < total; i++) {
+            if (merged[i - 1] > merged[i]) {
+                qsort(merged, total, sizeof(Book*), compare_book_address);
+                break;
+            }
+        }
+    }
+    *matches = merged;
+    return total;
+}
+
+// First position per chunk whose name contains the needle
+typedef struct {
+    const StringPool *pool;    // Pool the names point into
+    const StringRef *names;    // Base of the records' name fields
+    size_t stride;             // Bytes between consecutive records
+    const char *needle;
+    int *chunk_first;
+} FirstMatchScan;
+
+static void first_match_chunk(void *context, int begin, int end, int chunk) {
+    FirstMatchScan *scan = context;
+    scan->chunk_first[chunk] = -1;
+    for (int i = begin; i < end; i++) {
+        const char *name = string_pool_at(scan->pool, *(const StringRef *)((const char *)scan->names + scan->stride * i));
+        if (case_insensitive_search(name, scan->needle)) {
+            scan->chunk_first[chunk] = i;
+            return;
+        }
+    }
+}
+
+int parallel_find_first(const StringPool *pool, const StringRef *names, size_t stride, int count, const char *needle) {
+    int chunk_count = parallel_scan_chunks(count);
+    int single = -1;
+    FirstMatchScan scan = { pool, names, stride, needle, chunk_count > 1 ? lib_malloc(sizeof(int) * chunk_count) : &single };
+    if (scan.chunk_first == NULL) {
+        chunk_count = 1;
+        scan.chunk_first = &single;
+    }
+    
+    parallel_scan(count, chunk_count, first_match_chunk, &scan);
+    
+    int first = -1;
+    for (int c = 0; c < chunk_count && first < 0; c++) {
+        first = scan.chunk_first[c];
+    }
+    if (scan.chunk_first != &single) {
+        lib_free(scan.chunk_first);
+    }
+    return first;
+}
+
+/* ================== BULK LOAD ==================== */
+
+// Loading a catalog one insert at a time keeps every index current on
+// every book: a probe into the title table, a posting append for each
+// trigram and word, two ordered-index inserts, most of them cache misses.
+// Between library_bulk_begin() and library_bulk_finish() inserts only
+// append the record. The finish turns the new books into sorted integer
+// keys and writes each posting list, bucket and run of the title table
+// front to back. Until then the new books cannot be found, so only
+// inserts and loans may run in between.
+#define BULK_ROUND_BITS  16
+#define BULK_ROUND_BOOKS (1 << BULK_ROUND_BITS) // Books whose trigrams and words are sorted together
+#define BULK_TITLE_BITS  22         // Title inserts are ordered by this many bits of their home slot
+#define BULK_MAX_CHUNKS  ((SCAN_MAX_THREADS + 1) * 4)
+#define RADIX_BITS       11
+#define RADIX_DIGITS     ((64 + RADIX_BITS - 1) / RADIX_BITS)
+
+void library_bulk_begin(Library *lib) {
+    if (lib->bulk_start < 0) {
+        lib->bulk_start = lib->book_count;
+    }
+}
+
+// LSD radix sort of keys through scratch by their bits from `low` up; keys
+// equal there keep their order. One pass counts every digit, and digits
+// that are the same in all keys are skipped. Returns whichever of the two
+// arrays holds the result.
+static uint64_t* radix_sort_keys(uint64_t *keys, uint64_t *scratch, int count, int low) {
+    int counts[RADIX_DIGITS][1 << RADIX_BITS];
+    int digits = (64 - low + RADIX_BITS - 1) / RADIX_BITS;
+    uint64_t mask = (1u << RADIX_BITS) - 1;
+    
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < count; i++) {
+        uint64_t key = keys[i] >> low;
+        for (int d = 0; d < digits; d++, key >>= RADIX_BITS) {
+            counts[d][key & mask]++;
+        }
+    }
+    
+    for (int d = 0; d < digits; d++) {
+        int shift = low + d * RADIX_BITS;
+        if (counts[d][(keys[0] >> shift) & mask] == count) continue;
+        
+        int total = 0;
+        for (int digit = 0; digit <= (int)mask; digit++) {
+            int n = counts[d][digit];
+            counts[d][digit] = total;
+            total += n;
+        }
+        for (int i = 0; i < count; i++) {
+            scratch[counts[d][(keys[i] >> shift) & mask]++] = keys[i];
+        }
+        
+        uint64_t *sorted = scratch;
+        scratch = keys;
+        keys = sorted;
+    }
+    return keys;
+}
+
+// Runs are sorted on their own, one per scan chunk, then merged pairwise
+typedef struct {
+    uint64_t *from;
+    uint64_t *to;
+    int count;
+    int low;                   // Lowest bit sorted by
+    int runs;
+    int width;                 // Runs already merged into each group
+} KeySort;
+
+static int key_run_start(const KeySort *sort, int run) {
+    if (run > sort->runs) run = sort->runs;
+    return (int)((long long)sort->count * run / sort->runs);
+}
+
+static void sort_key_run(void *context, int begin, int end, int chunk) {
+    KeySort *sort = context;
+    (void)chunk;
+    uint64_t *sorted = radix_sort_keys(sort->from + begin, sort->to + begin, end - begin, sort->low);
+    if (sorted != sort->from + begin) {
+        memcpy(sort->from + begin, sorted, sizeof(uint64_t) * (end - begin));
+    }
+}
+
+static void merge_key_runs(void *context, int begin, int end, int chunk) {
+    KeySort *sort = context;
+    (void)begin;
+    (void)end;
+    int first = chunk * 2 * sort->width;
+    int a = key_run_start(sort, first);
+    int middle = key_run_start(sort, first + sort->width);
+    int last = key_run_start(sort, first + 2 * sort->width);
+    
+    // Ties go to the left run, which holds the earlier keys
+    int i = a, j = middle, out = a;
+    while (i < middle && j < last) {
+        sort->to[out++] = (sort->from[j] >> sort->low) < (sort->from[i] >> sort->low) ? sort->from[j++]
+                                                                                   : sort->from[i++];
+    }
+    memcpy(sort->to + out, sort->from + i, sizeof(uint64_t) * (middle - i));
+    out += middle - i;
+    memcpy(sort->to + out, sort->from + j, sizeof(uint64_t) * (last - j));
+}
+
+// Sorts keys by their bits from `low` up, using scratch and every scan
+// thread; returns the array that holds the result
+static uint64_t* parallel_sort_keys(uint64_t *keys, uint64_t *scratch, int count, int low) {
+    KeySort sort = { keys, scratch, count, low, parallel_scan_chunks(count), 1 };
+    parallel_scan(count, sort.runs, sort_key_run, &sort);
+    
+    for (; sort.width < sort.runs; sort.width *= 2) {
+        int groups = (sort.runs + 2 * sort.width - 1) / (2 * sort.width);
+        parallel_scan(groups, groups, merge_key_runs, &sort);
+        uint64_t *merged = sort.to;
+        sort.to = sort.from;
+        sort.from = merged;
+    }
+    return sort.from;
+}
+
+// Key arrays of one build step, reused by the next
+typedef struct {
+    uint64_t *keys;
+    uint64_t *scratch;
+    int capacity;
+} BulkBuffers;
+
+static int bulk_buffers_reserve(BulkBuffers *buffers, int count) {
+    if (count <= buffers->capacity) {
+        return 1;
+    }
+    int capacity = buffers->capacity * 2 > count ? buffers->capacity * 2 : count;
+    uint64_t *keys = lib_realloc(buffers->keys, sizeof(uint64_t) * capacity);
+    if (keys != NULL) buffers->keys = keys;
+    uint64_t *scratch = lib_realloc(buffers->scratch, sizeof(uint64_t) * capacity);
+    if (scratch != NULL) buffers->scratch = scratch;
+    if (keys == NULL || scratch == NULL) {
+        return 0;
+    }
+    buffers->capacity = capacity;
+    return 1;
+}
+
+// The keys of the new books, filled in parallel, one chunk of books per scan chunk
+typedef struct {
+    Library *lib;
+    int start;                 // Position of the first book of the step
+    uint64_t *keys;
+    int shift;                 // Title table bits, or slot bits of a number key
+    int pages;                 // Page counts rather than years
+    int offsets[BULK_MAX_CHUNKS]; // Trigram keys before each chunk
+} BulkKeys;
+
+// Hash rotated so the slot a title starts probing at is in the top bits,
+// then its book slot: in key order the inserts sweep the table once
+static void title_keys_chunk(void *context, int begin, int end, int chunk) {
+    BulkKeys *bulk = context;
+    (void)chunk;
+    for (int i = begin; i < end; i++) {
+        const Book *book = &bulk->lib->books[bulk->start + i];
+        uint32_t hash = case_folded_hash(book_title(bulk->lib, book));
+        uint32_t rotated = (hash >> bulk->shift) | (hash << (32 - bulk->shift));
+        bulk->keys[i] = (uint64_t)rotated << 32 | (uint32_t)book->slot;
+    }
+}
+
+// Year or page count made non-negative, then the book slot
+static void number_keys_chunk(void *context, int begin, int end, int chunk) {
+    BulkKeys *bulk = context;
+    const BookColumns *columns = &bulk->lib->columns;
+    (void)chunk;
+    for (int i = begin; i < end; i++) {
+        int position = bulk->start + i;
+        int value = bulk->pages ? columns->pages[position] : columns->years[position];
+        bulk->keys[i] = (uint64_t)(value - BOOK_YEAR_MIN) << bulk->shift | (uint32_t)bulk->lib->books[position].slot;
+    }
+}
+
+static int text_trigrams(const char *text) {
+    int len = strlen(text);
+    return len >= 3 ? len - 2 : 0;
+}
+
+static void count_trigrams_chunk(void *context, int begin, int end, int chunk) {
+    BulkKeys *bulk = context;
+    int count = 0;
+    for (int i = begin; i < end; i++) {
+        const Book *book = &bulk->lib->books[bulk->start + i];
+        count += text_trigrams(book_title(bulk->lib, book));
+        for (int j = 0; j < book->author_count; j++) {
+            count += text_trigrams(book_author(bulk->lib, book, j));
+        }
+    }
+    bulk->offsets[chunk] = count;
+}
+
+// Trigram, then the book's place in the round
+static void trigram_keys_chunk(void *context, int begin, int end, int chunk) {
+    BulkKeys *bulk = context;
+    uint64_t *key = bulk->keys + bulk->offsets[chunk];
+    for (int i = begin; i < end; i++) {
+        const Book *book = &bulk->lib->books[bulk->start + i];
+        for (int j = -1; j < book->author_count; j++) {
+            const char *text = j < 0 ? book_title(bulk->lib, book) : book_author(bulk->lib, book, j);
+            for (int len = strlen(text), k = 0; k + 3 <= len; k++) {
+                *key++ = (uint64_t)pack_trigram(text + k) << BULK_ROUND_BITS | (uint64_t)i;
+            }
+        }
+    }
+}
+
+static int bulk_build_titles(Library *lib, BulkBuffers *buffers, int count) {
+    NameIndex *index = &lib->title_index;
+    if (!name_index_reserve(index, index->live + count) || !bulk_buffers_reserve(buffers, count)) {
+        return 0;
+    }
+    
+    // Titles that hash alike stay in book order, as single inserts place them
+    BulkKeys bulk = { lib, lib->bulk_start, buffers->keys, __builtin_ctz((unsigned int)index->capacity), 0, { 0 } };
+    int sorted_bits = bulk.shift < BULK_TITLE_BITS ? bulk.shift : BULK_TITLE_BITS;
+    parallel_scan(count, parallel_scan_chunks(count), title_keys_chunk, &bulk);
+    uint64_t *sorted = parallel_sort_keys(buffers->keys, buffers->scratch, count, 64 - sorted_bits);
+    for (int i = 0; i < count; i++) {
+        uint32_t rotated = (uint32_t)(sorted[i] >> 32);
+        uint32_t hash = (rotated << bulk.shift) | (rotated >> (32 - bulk.shift));
+        name_index_place(index, hash, (int)(uint32_t)sorted[i]);
+    }
+    return 1;
+}
+
+static int bulk_build_numbers(Library *lib, BulkBuffers *buffers, int count, IntIndex *index, int pages) {
+    if (!bulk_buffers_reserve(buffers, count)) {
+        return 0;
+    }
+    BulkKeys bulk = { lib, lib->bulk_start, buffers->keys, 32 - __builtin_clz((unsigned int)lib->slot_count), pages, { 0 } };
+    parallel_scan(count, parallel_scan_chunks(count), number_keys_chunk, &bulk);
+    uint64_t *sorted = parallel_sort_keys(buffers->keys, buffers->scratch, count, 0);
+    
+    // Unpacked in place into the other array; an entry is no wider than a key
+    IntEntry *entries = (IntEntry *)(sorted == buffers->keys ? buffers->scratch : buffers->keys);
+    uint64_t slot_mask = ((uint64_t)1 << bulk.shift) - 1;
+    for (int i = 0; i < count; i++) {
+        entries[i].key = (int)(sorted[i] >> bulk.shift) + BOOK_YEAR_MIN;
+        entries[i].slot = (int)(sorted[i] & slot_mask);
+    }
+    return int_index_merge(index, entries, count);
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Adds sorted, distinct entries to a sorted posting list. Fresh slots are
+// above everything listed and append; reused slots are merged in, and the
+// merge drops the list's dead entries on the way.
+static int posting_list_add(int **list, int *count, int *capacity, int *dead, const int *added, int added_count) {
+    int needed = *count + added_count;
+    if (*count == 0 || ((*list)[*count - 1] & INT_MAX) < added[0]) {
+        if (needed > *capacity) {
+            int new_capacity = *capacity * 2 > needed ? *capacity * 2 : needed;
+            int *bigger = lib_realloc(*list, sizeof(int) * new_capacity);
+            if (bigger == NULL) {
+                return 0;
+            }
+            *list = bigger;
+            *capacity = new_capacity;
+        }
+        memcpy(*list + *count, added, sizeof(int) * added_count);
+        *count = needed;
+        return 1;
+    }
+    
+    int *merged = lib_malloc(sizeof(int) * needed);
+    if (merged == NULL) {
+        return 0;
+    }
+    int i = 0, j = 0, out = 0;
+    while (i < *count || j < added_count) {
+        if (i < *count && (*list)[i] < 0) {
+            i++;
+        } else if (j == added_count || (i < *count && (*list)[i] < added[j])) {
+            merged[out++] = (*list)[i++];
+        } else {
+            if (i < *count && (*list)[i] == added[j]) i++;
+            merged[out++] = added[j++];
+        }
+    }
+    lib_free(*list);
+    *list = merged;
+    *count = out;
+    *capacity = needed;
+    *dead = 0;
+    return 1;
+}
+
+// Walks keys of the form key << (BULK_ROUND_BITS + flag_bits) | place in
+// round << flag_bits | flags, one key at a time. Each key's places become
+// slot << flag_bits | flags in values, sorted and distinct, for add.
+typedef int (*KeyGroup)(Library *lib, unsigned int key, const int *values, int count);
+
+static int bulk_add_groups(Library *lib, const uint64_t *sorted, int count, int begin, int flag_bits,
+                           int *values, KeyGroup add) {
+    int shift = BULK_ROUND_BITS + flag_bits;
+    int flag_mask = (1 << flag_bits) - 1;
+    int i = 0;
+    while (i < count) {
+        unsigned int key = (unsigned int)(sorted[i] >> shift);
+        int value_count = 0;
+        int in_order = 1;
+        for (; i < count && (unsigned int)(sorted[i] >> shift) == key; i++) {
+            int place = (int)(sorted[i] >> flag_bits) & (BULK_ROUND_BOOKS - 1);
+            int value = lib->books[begin + place].slot << flag_bits | ((int)sorted[i] & flag_mask);
+            if (value_count > 0 && values[value_count - 1] >= value) {
+                if (values[value_count - 1] == value) continue;
+                in_order = 0;
+            }
+            values[value_count++] = value;
+        }
+        
+        // Books on reused slots are out of slot order
+        if (!in_order) {
+            qsort(values, value_count, sizeof(int), compare_ints);
+            int distinct = 1;
+            for (int j = 1; j < value_count; j++) {
+                if (values[j] != values[distinct - 1]) values[distinct++] = values[j];
+            }
+            value_count = distinct;
+        }
+        if (!add(lib, key, values, value_count)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int add_trigram_group(Library *lib, unsigned int trigram, const int *slots, int count) {
+    Posting *posting = trigram_index_get_or_create(&lib->text_index, trigram);
+    return posting != NULL && posting_list_add(&posting->books, &posting->count, &posting->capacity, &posting->dead, slots, count);
+}
+
+static int add_word_group(Library *lib, unsigned int id, const int *entries, int count) {
+    Word *word = &lib->word_index.words[id];
+    return posting_list_add(&word->entries, &word->count, &word->capacity, &word->dead, entries, count);
+}
+
+static int bulk_build_trigrams(Library *lib, BulkBuffers *buffers, int begin, int count) {
+    BulkKeys bulk = { lib, begin, NULL, 0, 0, { 0 } };
+    int chunks = parallel_scan_chunks(count);
+    parallel_scan(count, chunks, count_trigrams_chunk, &bulk);
+    int total = 0;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        int n = bulk.offsets[chunk];
+        bulk.offsets[chunk] = total;
+        total += n;
+    }
+    if (total == 0) {
+        return 1;
+    }
+    if (!bulk_buffers_reserve(buffers, total)) {
+        return 0;
+    }
+    
+    bulk.keys = buffers->keys;
+    parallel_scan(count, chunks, trigram_keys_chunk, &bulk);
+    uint64_t *sorted = parallel_sort_keys(buffers->keys, buffers->scratch, total, 0);
+    int *values = (int *)(sorted == buffers->keys ? buffers->scratch : buffers->keys);
+    return bulk_add_groups(lib, sorted, total, begin, 0, values, add_trigram_group);
+}
+
+// Word ids are handed out in the order words first appear, as single
+// inserts would, so this pass runs on one thread; only the sort is shared
+static int bulk_build_words(Library *lib, BulkBuffers *buffers, int begin, int count) {
+    WordIndex *index = &lib->word_index;
+    char folded[INDEXED_WORD_MAX];
+    int total = 0;
+    
+    for (int i = 0; i < count; i++) {
+        const Book *book = &lib->books[begin + i];
+        for (int j = -1; j < book->author_count; j++) {
+            const char *text = j < 0 ? book_title(lib, book) : book_author(lib, book, j);
+            int len;
+            while ((len = next_word(&text, folded)) > 0) {
+                int id = word_index_get_or_create(index, folded, len);
+                if (id < 0 || !bulk_buffers_reserve(buffers, total + 1)) {
+                    return 0;
+                }
+                buffers->keys[total++] = (uint64_t)id << (BULK_ROUND_BITS + 1) | (uint64_t)i << 1 | (j >= 0);
+            }
+        }
+    }
+    if (total == 0) {
+        return 1;
+    }
+    
+    uint64_t *sorted = parallel_sort_keys(buffers->keys, buffers->scratch, total, 0);
+    int *values = (int *)(sorted == buffers->keys ? buffers->scratch : buffers->keys);
+    return bulk_add_groups(lib, sorted, total, begin, 1, values, add_word_group);
+}
+
+// Indexes the books added since library_bulk_begin(). Returns 0 if memory
+// ran out, leaving some of them unindexed.
+int library_bulk_finish(Library *lib) {
+    int start = lib->bulk_start;
+    if (start < 0 || start == lib->book_count) {
+        lib->bulk_start = -1;
+        return 1;
+    }
+    
+    // Titles and numbers in one sort each; trigrams and words, a few dozen
+    // keys a book, a round of books at a time
+    BulkBuffers buffers = { NULL, NULL, 0 };
+    int count = lib->book_count - start;
+    int ok = bulk_build_titles(lib, &buffers, count) &&
+             bulk_build_numbers(lib, &buffers, count, &lib->year_index, 0) &&
+             bulk_build_numbers(lib, &buffers, count, &lib->page_index, 1);
+    for (int begin = start; ok && begin < lib->book_count; begin += BULK_ROUND_BOOKS) {
+        int round = lib->book_count - begin < BULK_ROUND_BOOKS ? lib->book_count - begin : BULK_ROUND_BOOKS;
+        ok = bulk_build_trigrams(lib, &buffers, begin, round) &&
+             bulk_build_words(lib, &buffers, begin, round);
+    }
+    
+    lib_free(buffers.keys);
+    lib_free(buffers.scratch);
+    lib->bulk_start = -1;
+    return ok;
+}
+
+/* ================== SNAPSHOT PERSISTENCE ==================== */
+
+static uint64_t snapshot_align(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+// Zero bytes up to the next image boundary
+static int write_snapshot_padding(FILE *fp, uint64_t *offset) {
+    static const char zeros[4096];
+    uint64_t end = snapshot_align(*offset);
+    while (*offset < end) {
+        size_t chunk = end - *offset < sizeof(zeros) ? (size_t)(end - *offset) : sizeof(zeros);
+        if (fwrite(zeros, 1, chunk, fp) != chunk) {
+            return 0;
+        }
+        *offset += chunk;
+    }
+    return 1;
+}
+
+// Interns a string into a snapshot image, returning its offset there or
+// UINT32_MAX if the image is full
+static StringRef snapshot_intern(StringPool *image, const char *str) {
+    const char *copy = string_pool_intern(image, str);
+    return copy != NULL ? string_pool_ref(image, copy) : UINT32_MAX;
+}
+
+int save_snapshot(const char *path, Library *lib, StudentSystem *sys, uint64_t journal_seq) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    // The live pools also hold strings of deleted books, so the images are
+    // rebuilt from what the records still use. All strings go in first so
+    // they sit together ahead of the author arrays.
+    StringPool books_image, students_image;
+    if (!string_pool_init(&books_image)) {
+        fprintf(stderr, "snapshot: out of memory\n");
+        return 0;
+    }
+    if (!string_pool_init(&students_image)) {
+        string_pool_free(&books_image);
+        fprintf(stderr, "snapshot: out of memory\n");
+        return 0;
+    }
+    
+    int ok = 1;
+    for (int i = 0; ok && i < lib->book_count; i++) {
+        Book *book = &lib->books[i];
+        ok = snapshot_intern(&books_image, book_title(lib, book)) != UINT32_MAX;
+        for (int j = 0; ok && j < book->author_count; j++) {
+            ok = snapshot_intern(&books_image, book_author(lib, book, j)) != UINT32_MAX;
+        }
+    }
+    for (int i = 0; ok && i < sys->student_count; i++) {
+        ok = snapshot_intern(&students_image, student_name(sys, &sys->students[i])) != UINT32_MAX;
+    }
+    
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.book_count = lib->book_count;
+    header.student_count = sys->student_count;
+    header.journal_seq = journal_seq;
+    header.book_strings_text = books_image.used;
+    header.books_offset = sizeof(SnapshotHeader);
+    header.students_offset = header.books_offset + sizeof(SnapshotBook) * (uint64_t)header.book_count;
+    header.book_strings_offset = snapshot_align(header.students_offset +
+                                                sizeof(SnapshotStudent) * (uint64_t)header.student_count);
+    
+    FILE *fp = NULL;
+    if (ok) {
+        fp = fopen(tmp_path, "wb");
+        if (fp == NULL) {
+            fprintf(stderr, "snapshot: cannot write '%s': %s\n", tmp_path, strerror(errno));
+            string_pool_free(&books_image);
+            string_pool_free(&students_image);
+            return 0;
+        }
+        // The image sizes are only known once the records are written
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    }
+    
+    for (int i = 0; ok && i < lib->book_count; i++) {
+        Book *book = &lib->books[i];
+        SnapshotBook record;
+        memset(&record, 0, sizeof(record));
+        record.title = snapshot_intern(&books_image, book_title(lib, book));
+        record.author_count = book->author_count;
+        record.year = book->year;
+        record.pages = book->pages;
+        record.borrower = book->is_available ? -1 : book->borrower;
+        
+        if (book->author_count == 1) {
+            record.authors = snapshot_intern(&books_image, book_author(lib, book, 0));
+        } else if (book->author_count > 1) {
+            StringRef *names = string_pool_alloc(&books_image, sizeof(StringRef) * book->author_count);
+            if (names == NULL) {
+                ok = 0;
+                break;
+            }
+            for (int j = 0; j < book->author_count; j++) {
+                names[j] = snapshot_intern(&books_image, book_author(lib, book, j));
+            }
+            record.authors = string_pool_ref(&books_image, names);
+        }
+        ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+    }
+    
+    for (int i = 0; ok && i < sys->student_count; i++) {
+        SnapshotStudent record;
+        record.student_id = sys->students[i].student_id;
+        record.name = snapshot_intern(&students_image, student_name(sys, &sys->students[i]));
+        record.max_books = sys->students[i].max_books;
+        record.reserved = 0;
+        ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+    }
+    
+    // String images, each on an alignment boundary so loading can map it
+    uint64_t offset = header.students_offset + sizeof(SnapshotStudent) * (uint64_t)header.student_count;
+    header.book_strings_size = books_image.used;
+    header.student_strings_offset = snapshot_align(header.book_strings_offset + header.book_strings_size);
+    header.student_strings_size = students_image.used;
+    ok = ok && write_snapshot_padding(fp, &offset) &&
+         fwrite(books_image.base, 1, books_image.used, fp) == books_image.used;
+    offset += books_image.used;
+    ok = ok && write_snapshot_padding(fp, &offset) &&
+         fwrite(students_image.base, 1, students_image.used, fp) == students_image.used;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+    
+    string_pool_free(&books_image);
+    string_pool_free(&students_image);
+    if (fp == NULL) {
+        fprintf(stderr, "snapshot: string pool exceeds 4 GiB\n");
+        return 0;
+    }
+    
+    // Make the new file durable before it replaces the old one
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "snapshot: write to '%s' failed: %s\n", path, strerror(errno));
+        remove(tmp_path);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// An image must start with the empty string and end its text on a NUL
+static int snapshot_image_valid(const char *file, uint64_t offset, uint64_t size, uint64_t text) {
+    if (text == 0 || text > size || size > STRING_POOL_RESERVE) return 0;
+    return file[offset] == '\0' && file[offset + text - 1] == '\0';
+}
+
+static int validate_snapshot(const SnapshotHeader *header, size_t file_size) {
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        fprintf(stderr, "snapshot: not a library snapshot (bad magic)\n");
+        return 0;
+    }
+    if (header->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "snapshot: unsupported version %u (expected %d)\n", header->version, SNAPSHOT_VERSION);
+        return 0;
+    }
+    
+    // Records back to back, then each image at the next boundary
+    uint64_t end = header->books_offset + sizeof(SnapshotBook) * (uint64_t)header->book_count;
+    if (header->books_offset != sizeof(SnapshotHeader) || end != header->students_offset) return 0;
+    end += sizeof(SnapshotStudent) * (uint64_t)header->student_count;
+    if (header->book_strings_offset != snapshot_align(end)) return 0;
+    end = header->book_strings_offset + header->book_strings_size;
+    if (header->student_strings_offset != snapshot_align(end)) return 0;
+    end = header->student_strings_offset + header->student_strings_size;
+    if (end != file_size) return 0;
+    
+    // Student images hold nothing but strings
+    return snapshot_image_valid((const char *)header, header->book_strings_offset,
+                                header->book_strings_size, header->book_strings_text) &&
+           snapshot_image_valid((const char *)header, header->student_strings_offset,
+                                header->student_strings_size, header->student_strings_size);
+}
+
+static int snapshot_book_valid(const SnapshotHeader *header, const SnapshotBook *record, const char *image) {
+    if (record->title >= header->book_strings_text ||
+        record->borrower >= (int32_t)header->student_count) return 0;
+    if (record->author_count == 1) {
+        return record->authors < header->book_strings_text;
+    }
+    if (record->author_count > 1) {
+        if (record->authors % sizeof(StringRef) != 0 ||
+            record->authors + sizeof(StringRef) * (uint64_t)record->author_count > header->book_strings_size) return 0;
+        const StringRef *names = (const StringRef *)(image + record->authors);
+        for (int i = 0; i < record->author_count; i++) {
+            if (names[i] >= header->book_strings_text) return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps the string images and copies the records; the indexes are not part
+// of the snapshot and are rebuilt by a bulk load, so a load takes time
+// linear in the number of books
+int load_snapshot(const char *path, Library **lib_out, StudentSystem **sys_out, Snapshot **snapshot_out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "snapshot: '%s' is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "snapshot: cannot map '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    const SnapshotHeader *header = map;
+    if (!validate_snapshot(header, st.st_size)) {
+        fprintf(stderr, "snapshot: '%s' is corrupt\n", path);
+        munmap(map, st.st_size);
+        close(fd);
+        return -1;
+    }
+    
+    const char *base = map;
+    const SnapshotBook *book_records = (const SnapshotBook *)(base + header->books_offset);
+    const SnapshotStudent *student_records = (const SnapshotStudent *)(base + header->students_offset);
+    const char *book_image = base + header->book_strings_offset;
+    
+    Snapshot *snapshot = lib_calloc(1, sizeof(Snapshot));
+    Library *lib = create_library(header->book_count > 2 ? (int)header->book_count : 2);
+    StudentSystem *sys = create_student_system(header->student_count > 2 ? (int)header->student_count : 2);
+    if (snapshot == NULL || lib == NULL || sys == NULL) {
+        fprintf(stderr, "snapshot: out of memory\n");
+        goto fail;
+    }
+    snapshot->journal_seq = header->journal_seq;
+    
+    // Check every record before building anything from them
+    for (uint32_t i = 0; i < header->book_count; i++) {
+        if (!snapshot_book_valid(header, &book_records[i], book_image)) goto corrupt;
+    }
+    for (uint32_t i = 0; i < header->student_count; i++) {
+        const SnapshotStudent *record = &student_records[i];
+        if (record->name >= header->student_strings_size ||
+            record->max_books < 0 || record->max_books > MAX_BOOKS) goto corrupt;
+    }
+    
+    // Records keep their offsets: the images become the pools as they are
+    if (!string_pool_load(&lib->strings, fd, header->book_strings_offset, book_image,
+                          header->book_strings_size, header->book_strings_text) ||
+        !string_pool_load(&sys->strings, fd, header->student_strings_offset,
+                          base + header->student_strings_offset,
+                          header->student_strings_size, header->student_strings_size)) {
+        fprintf(stderr, "snapshot: out of memory\n");
+        goto fail;
+    }
+    
+    for (uint32_t i = 0; i < header->student_count; i++) {
+        const SnapshotStudent *record = &student_records[i];
+        Student *student = &sys->students[i];
+        student->student_id = record->student_id;
+        student->name = record->name;
+        student->borrowed_count = 0;
+        student->max_books = record->max_books;
+        name_index_insert(&sys->name_index, student_name(sys, student), i);
+        sys->student_count++;
+    }
+    
+    // The records are laid down first and indexed together at the end
+    library_bulk_begin(lib);
+    for (uint32_t i = 0; i < header->book_count; i++) {
+        const SnapshotBook *record = &book_records[i];
+        Book *book = &lib->books[i];
+        book->title = record->title;
+        book->authors = record->author_count > 0 ? record->authors : 0;
+        book->author_count = record->author_count;
+        book->year = record->year;
+        book->pages = record->pages;
+        book->is_available = 1;
+        book->borrower = -1;
+        book->slot = (int)i;
+        lib->slots[i].position = (int)i;
+        lib->slots[i].generation = 0;
+        lib->slot_count++;
+        
+        // Loans are stored as the student's record number, which is the
+        // student's position once loaded
+        if (record->borrower >= 0) {
+            Student *student = &sys->students[record->borrower];
+            if (student->borrowed_count < student->max_books) {
+                book->is_available = 0;
+                book->borrower = record->borrower;
+                student->borrowed_books[student->borrowed_count++] = book->slot;
+                lib->borrowed_total++;
+            }
+        }
+        book_columns_store(&lib->columns, i, book);
+        lib->author_total += book->author_count;
+        lib->page_total += book->pages;
+        lib->book_count++;
+    }
+    
+    if (!library_bulk_finish(lib)) {
+        fprintf(stderr, "snapshot: out of memory\n");
+        goto fail;
+    }
+    
+    // Loan counts are final only now, order the students once
+    activity_heap_rebuild(sys);
+    
+    // The pools hold their own mappings, the file is no longer needed
+    munmap(map, st.st_size);
+    close(fd);
+    *lib_out = lib;
+    *sys_out = sys;
+    *snapshot_out = snapshot;
+    return 1;
+    
+corrupt:
+    fprintf(stderr, "snapshot: '%s' has out-of-range references\n", path);
+fail:
+    destroy_library(lib);
+    destroy_student_system(sys);
+    lib_free(snapshot);
+    munmap(map, st.st_size);
+    close(fd);
+    return -1;
+}
+
+void release_snapshot(Snapshot *snapshot) {
+    lib_free(snapshot);
+}
+
+/* ================== WRITE-AHEAD JOURNAL ==================== */
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t journal_checksum(const unsigned char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Payload encoding: int32 values and uint16 length-prefixed strings
+static size_t put_int(unsigned char *out, int32_t value) {
+    memcpy(out, &value, sizeof(value));
+    return sizeof(value);
+}
+
+static size_t put_string(unsigned char *out, const char *str) {
+    uint16_t len = (uint16_t)strlen(str);
+    memcpy(out, &len, sizeof(len));
+    memcpy(out + sizeof(len), str, len);
+    return sizeof(len) + len;
+}
+
+static int journal_sync_locked(Journal *journal) {
+    if (journal->pending == 0) {
+        return 1;
+    }
+    if (fdatasync(journal->fd) != 0) {
+        fprintf(stderr, "journal: fsync failed: %s\n", strerror(errno));
+        return 0;
+    }
+    journal->pending = 0;
+    return 1;
+}
+
+static int journal_append(Journal *journal, int type, const unsigned char *payload, size_t length) {
+    unsigned char stack_buffer[1024];
+    size_t total = sizeof(JournalRecordHeader) + length;
+    unsigned char *record = total <= sizeof(stack_buffer) ? stack_buffer : lib_malloc(total);
+    if (record == NULL) {
+        return 0;
+    }
+    
+    JournalRecordHeader header;
+    header.length = (uint32_t)length;
+    header.checksum = journal_checksum(payload, length);
+    header.type = type;
+    memcpy(record + sizeof(header), payload, length);
+    
+    // Sequence numbers must follow file order, so they are taken under the lock
+    pthread_mutex_lock(&journal->lock);
+    header.seq = journal->next_seq;
+    memcpy(record, &header, sizeof(header));
+    
+    // One sequential write per operation, always at the end of the last
+    // whole record; the record reaches the kernel before the change is
+    // applied in memory
+    ssize_t written = journal->broken ? -1 : pwrite(journal->fd, record, total, journal->size);
+    if (record != stack_buffer) {
+        lib_free(record);
+    }
+    if (journal->broken) {
+        fprintf(stderr, "journal: damaged, changes are refused until the next snapshot\n");
+        pthread_mutex_unlock(&journal->lock);
+        return 0;
+    }
+    if (written != (ssize_t)total) {
+        fprintf(stderr, "journal: write failed: %s\n", strerror(errno));
+        
+        // A record after a partial one would never be replayed
+        if (written > 0 && ftruncate(journal->fd, journal->size) != 0) {
+            fprintf(stderr, "journal: ends in a partial record, changes are refused until the next snapshot\n");
+            journal->broken = 1;
+        }
+        pthread_mutex_unlock(&journal->lock);
+        return 0;
+    }
+    
+    journal->next_seq++;
+    journal->size += total;
+    
+    // Group commit: pay for fsync once per batch rather than per record
+    int ok = 1;
+    long long now = monotonic_ms();
+    if (journal->pending == 0) {
+        journal->first_pending_ms = now;
+    }
+    journal->pending++;
+    if (journal->pending >= JOURNAL_GROUP_RECORDS || now - journal->first_pending_ms >= JOURNAL_GROUP_MS) {
+        ok = journal_sync_locked(journal);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return ok;
+}
+
+int journal_log_add_book(Journal *journal, const Library *lib, const Book *book) {
+    const char *title = book_title(lib, book);
+    size_t length = strlen(title) + 2 + 3 * sizeof(int32_t);
+    int too_long = strlen(title) > 0xFFFF;
+    for (int i = 0; i < book->author_count; i++) {
+        length += strlen(book_author(lib, book, i)) + 2;
+        too_long |= strlen(book_author(lib, book, i)) > 0xFFFF;
+    }
+    if (too_long) {
+        return 0; // Strings are stored with a 16-bit length
+    }
+    
+    unsigned char *payload = lib_malloc(length);
+    if (payload == NULL) {
+        return 0;
+    }
+    
+    size_t at = put_string(payload, title);
+    at += put_int(payload + at, book->year);
+    at += put_int(payload + at, book->pages);
+    at += put_int(payload + at, book->author_count);
+    for (int i = 0; i < book->author_count; i++) {
+        at += put_string(payload + at, book_author(lib, book, i));
+    }
+    
+    int ok = journal_append(journal, JOURNAL_ADD_BOOK, payload, at);
+    lib_free(payload);
+    return ok;
+}
+
+int journal_log_add_student(Journal *journal, int student_id, const char *name) {
+    size_t name_length = strlen(name);
+    if (name_length > 0xFFFF) {
+        return 0; // Strings are stored with a 16-bit length
+    }
+    
+    unsigned char *payload = lib_malloc(sizeof(int32_t) + 2 + name_length);
+    if (payload == NULL) {
+        return 0;
+    }
+    
+    size_t at = put_int(payload, student_id);
+    at += put_string(payload + at, name);
+    int ok = journal_append(journal, JOURNAL_ADD_STUDENT, payload, at);
+    lib_free(payload);
+    return ok;
+}
+
+int journal_log_position(Journal *journal, int type, int book_position, int student_position) {
+    unsigned char payload[2 * sizeof(int32_t)];
+    size_t at = put_int(payload, book_position);
+    at += put_int(payload + at, student_position);
+    return journal_append(journal, type, payload, at);
+}
+
+int journal_sync(Journal *journal) {
+    if (journal == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&journal->lock);
+    int ok = journal_sync_locked(journal);
+    pthread_mutex_unlock(&journal->lock);
+    return ok;
+}
+
+// Cursor over a record payload; every read is bounds-checked
+typedef struct {
+    const unsigned char *data;
+    size_t length;
+    size_t at;
+    int ok;
+} PayloadReader;
+
+static int32_t get_int(PayloadReader *reader) {
+    int32_t value = 0;
+    if (reader->at + sizeof(value) > reader->length) {
+        reader->ok = 0;
+        return 0;
+    }
+    memcpy(&value, reader->data + reader->at, sizeof(value));
+    reader->at += sizeof(value);
+    return value;
+}
+
+// Copies the next string to *cursor as a C string and advances the cursor;
+// a scratch buffer of the payload's length always has room for all of them
+static const char* get_string(PayloadReader *reader, char **cursor) {
+    uint16_t len = 0;
+    char *out = *cursor;
+    out[0] = '\0';
+    if (reader->at + sizeof(len) > reader->length) {
+        reader->ok = 0;
+        return out;
+    }
+    memcpy(&len, reader->data + reader->at, sizeof(len));
+    reader->at += sizeof(len);
+    if (reader->at + len > reader->length) {
+        reader->ok = 0;
+        return out;
+    }
+    memcpy(out, reader->data + reader->at, len);
+    out[len] = '\0';
+    reader->at += len;
+    *cursor += len + 1;
+    return out;
+}
+
+static int replay_record(int type, PayloadReader *reader, Library *lib, StudentSystem *sys) {
+    switch (type) {
+        case JOURNAL_ADD_BOOK:
+        case JOURNAL_ADD_STUDENT: {
+            char *scratch = lib_malloc(reader->length + 1);
+            char *cursor = scratch;
+            if (scratch == NULL) return 0;
+            
+            int ok = 0;
+            if (type == JOURNAL_ADD_STUDENT) {
+                int student_id = get_int(reader);
+                const char *name = get_string(reader, &cursor);
+                ok = reader->ok && student_system_insert(sys, student_id, name);
+            } else {
+                const char *title = get_string(reader, &cursor);
+                int year = get_int(reader);
+                int pages = get_int(reader);
+                int author_count = get_int(reader);
+                const char **authors = NULL;
+                if (reader->ok && author_count >= 0 && (size_t)author_count <= reader->length) {
+                    authors = lib_malloc(sizeof(char*) * (author_count + 1));
+                }
+                if (authors != NULL) {
+                    for (int i = 0; i < author_count; i++) {
+                        authors[i] = get_string(reader, &cursor);
+                    }
+                    ok = reader->ok && library_insert_book(lib, title, authors, author_count, year, pages);
+                    lib_free(authors);
+                }
+            }
+            lib_free(scratch);
+            return ok;
+        }
+        case JOURNAL_REMOVE_BOOK: {
+            int position = get_int(reader);
+            return reader->ok && library_delete_book(lib, sys, position);
+        }
+        case JOURNAL_BORROW:
+        case JOURNAL_RETURN: {
+            int book_position = get_int(reader);
+            int student_position = get_int(reader);
+            if (!reader->ok || book_position < 0 || book_position >= lib->book_count ||
+                student_position < 0 || student_position >= sys->student_count) return 0;
+            
+            Book *book = &lib->books[book_position];
+            Student *student = &sys->students[student_position];
+            int result = type == JOURNAL_BORROW ? lend_book(lib, sys, book, student)
+                                                : receive_book(lib, sys, book, student);
+            return result == LOAN_OK;
+        }
+        default:
+            return 0;
+    }
+}
+
+Journal* open_journal(const char *path, Library *lib, StudentSystem *sys, uint64_t snapshot_seq, int *replayed_out) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "journal: cannot open '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    Journal *journal = lib_malloc(sizeof(Journal));
+    struct stat st;
+    if (journal == NULL || fstat(fd, &st) != 0) {
+        lib_free(journal);
+        close(fd);
+        return NULL;
+    }
+    journal->fd = fd;
+    pthread_mutex_init(&journal->lock, NULL);
+    journal->next_seq = snapshot_seq + 1;
+    journal->pending = 0;
+    journal->first_pending_ms = 0;
+    journal->size = 0;
+    journal->broken = 0;
+    
+    // Replay everything newer than the snapshot. The library has no journal
+    // attached yet, so replayed operations are not logged a second time.
+    unsigned char *data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "journal: cannot map '%s': %s\n", path, strerror(errno));
+            close(fd);
+            lib_free(journal);
+            return NULL;
+        }
+    }
+    
+    long long offset = 0;
+    int replayed = 0;
+    while (offset + (long long)sizeof(JournalRecordHeader) <= st.st_size) {
+        JournalRecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        const unsigned char *payload = data + offset + sizeof(header);
+        if (offset + (long long)sizeof(header) + header.length > st.st_size ||
+            journal_checksum(payload, header.length) != header.checksum) {
+            break; // Torn record from a crash mid-append: the log ends here
+        }
+        
+        if (header.seq > snapshot_seq) {
+            PayloadReader reader = { payload, header.length, 0, 1 };
+            if (!replay_record(header.type, &reader, lib, sys)) {
+                fprintf(stderr, "journal: record #%llu could not be applied\n", (unsigned long long)header.seq);
+            }
+            replayed++;
+        }
+        if (header.seq >= journal->next_seq) {
+            journal->next_seq = header.seq + 1;
+        }
+        offset += sizeof(header) + header.length;
+    }
+    
+    if (data != NULL) {
+        munmap(data, st.st_size);
+    }
+    
+    // Drop any torn tail so new records follow the last complete one
+    if (offset != st.st_size && ftruncate(fd, offset) != 0) {
+        fprintf(stderr, "journal: cannot truncate '%s': %s\n", path, strerror(errno));
+        close(fd);
+        lib_free(journal);
+        return NULL;
+    }
+    lseek(fd, offset, SEEK_SET);
+    journal->size = offset;
+    
+    if (replayed_out != NULL) {
+        *replayed_out = replayed;
+    }
+    lib->journal = journal;
+    sys->journal = journal;
+    return journal;
+}
+
+int journal_needs_compaction(Journal *journal) {
+    if (journal == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&journal->lock);
+    int needed = journal->size >= JOURNAL_COMPACT_BYTES;
+    pthread_mutex_unlock(&journal->lock);
+    return needed;
+}
+
+// Writes the snapshot and empties the journal, whatever the journal holds
+static int fold_journal(Journal *journal, const char *snapshot_path, Library *lib, StudentSystem *sys) {
+    // The snapshot records the last folded sequence number, so if we crash
+    // before the truncate the old records are skipped on replay
+    if (!journal_sync(journal) || !save_snapshot(snapshot_path, lib, sys, journal->next_seq - 1)) {
+        return 0;
+    }
+    if (ftruncate(journal->fd, 0) != 0 || lseek(journal->fd, 0, SEEK_SET) != 0 || fsync(journal->fd) != 0) {
+        fprintf(stderr, "journal: cannot truncate: %s\n", strerror(errno));
+        return 0;
+    }
+    journal->size = 0;
+    journal->broken = 0;
+    return 1;
+}
+
+int compact_journal(Journal *journal, const char *snapshot_path, Library *lib, StudentSystem *sys) {
+    // Nothing changed since the snapshot (a read-only run such as --list)
+    if (journal->size == 0) {
+        return 1;
+    }
+    return fold_journal(journal, snapshot_path, lib, sys);
+}
+
+void close_journal(Journal *journal) {
+    if (journal == NULL) return;
+    
+    journal_sync(journal);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    lib_free(journal);
+}
+
+/* ================== BATCH MODE ==================== */
+
+// Line-oriented reader over a large buffer. Lines are handed out in place
+// (newline replaced by NUL), so parsing a line never copies or allocates.
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t size;           // Buffer capacity
+    size_t start;          // First unread byte
+    size_t end;            // One past the last buffered byte
+    int eof;
+} LineReader;
+
+#define LINE_READER_CHUNK (1 << 20)
+
+// Next complete line already in the buffer (or the unterminated last one
+// once the input has ended), NULL if more must be read first
+static char* buffered_line(LineReader *reader) {
+    char *line = reader->buffer + reader->start;
+    char *newline = memchr(line, '\n', reader->end - reader->start);
+    if (newline != NULL) {
+        *newline = '\0';
+        reader->start = newline + 1 - reader->buffer;
+        if (newline > line && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        return line;
+    }
+    
+    if (reader->eof && reader->start < reader->end) {
+        // Last line without a trailing newline; there is always a spare byte
+        reader->buffer[reader->end] = '\0';
+        reader->start = reader->end;
+        return line;
+    }
+    return NULL;
+}
+
+// Moves the partial line to the front and reads once, growing the buffer
+// only for very long lines. Returns 0 if that growth fails.
+static int reader_fill(LineReader *reader) {
+    size_t pending = reader->end - reader->start;
+    memmove(reader->buffer, reader->buffer + reader->start, pending);
+    reader->start = 0;
+    reader->end = pending;
+    if (reader->size - reader->end < reader->size / 2) {
+        char *bigger = lib_realloc(reader->buffer, reader->size * 2);
+        if (bigger == NULL) {
+            return 0;
+        }
+        reader->buffer = bigger;
+        reader->size *= 2;
+    }
+    
+    ssize_t got;
+    do {
+        got = read(reader->fd, reader->buffer + reader->end, reader->size - reader->end - 1);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        reader->eof = 1;
+    } else {
+        reader->end += got;
+    }
+    return 1;
+}
+
+static char* next_line(LineReader *reader) {
+    char *line;
+    while ((line = buffered_line(reader)) == NULL && !reader->eof) {
+        if (!reader_fill(reader)) {
+            return NULL;
+        }
+    }
+    return line;
+}
+
+// Splits a line on tabs in place; returns the number of fields found
+static int split_fields(char *line, char **fields, int max_fields) {
+    int count = 0;
+    while (count < max_fields) {
+        fields[count++] = line;
+        char *tab = strchr(line, '\t');
+        if (tab == NULL) break;
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return count;
+}
+
+int parse_int(const char *text, int *value) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || parsed < INT32_MIN || parsed > INT32_MAX) {
+        return 0;
+    }
+    *value = (int)parsed;
+    return 1;
+}
+
+// "low..high", "low..", "..high" or a single value; a missing side is open
+int parse_bounds(char *text, int *low, int *high) {
+    char *dots = strstr(text, "..");
+    if (dots == NULL) {
+        return parse_int(text, low) && parse_int(text, high);
+    }
+    *dots = '\0';
+    *low = INT_MIN;
+    *high = INT_MAX;
+    return (text[0] == '\0' || parse_int(text, low)) &&
+           (dots[2] == '\0' || parse_int(dots + 2, high));
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Message for a LOAN_* result, NULL for LOAN_OK
+static const char* loan_error(int result) {
+    switch (result) {
+        case LOAN_OK:            return NULL;
+        case LOAN_NOT_AVAILABLE: return "book is already borrowed";
+        case LOAN_LIMIT_REACHED: return "student reached the borrowing limit";
+        case LOAN_NOT_BORROWED:  return "book is not borrowed";
+        case LOAN_WRONG_STUDENT: return "book is borrowed by another student";
+        default:                 return "operation failed";
+    }
+}
+
+// Applies one tab-separated command; returns NULL on success or an error message
+static const char* run_batch_command(char **fields, int field_count, Library *lib, StudentSystem *sys,
+                                     const char ***author_buffer, int *author_capacity) {
+    const char *op = fields[0];
+    
+    if (strcmp(op, "book") == 0) {
+        // book <title> <author;author...> <year> <pages>
+        int year, pages;
+        if (field_count != 5) return "usage: book<TAB>title<TAB>authors<TAB>year<TAB>pages";
+        if (!parse_int(fields[3], &year) || !parse_int(fields[4], &pages)) return "year and pages must be numbers";
+        
+        int author_count = 0;
+        char *author = fields[2];
+        while (*author != '\0') {
+            if (author_count >= *author_capacity) {
+                int new_capacity = *author_capacity * 2;
+                const char **bigger = lib_realloc(*author_buffer, sizeof(char*) * new_capacity);
+                if (bigger == NULL) return "out of memory";
+                *author_buffer = bigger;
+                *author_capacity = new_capacity;
+            }
+            (*author_buffer)[author_count++] = author;
+            char *separator = strchr(author, ';');
+            if (separator == NULL) break;
+            *separator = '\0';
+            author = separator + 1;
+        }
+        
+        const char *invalid = library_check_book(year, pages, author_count);
+        if (invalid != NULL) return invalid;
+        return library_insert_book(lib, fields[1], *author_buffer, author_count, year, pages) ? NULL : "could not add book";
+    }
+    
+    if (strcmp(op, "student") == 0) {
+        // student <id> <name>; registering the same student again changes
+        // nothing, so a registration that may have half failed can be resent
+        int student_id;
+        if (field_count != 3) return "usage: student<TAB>id<TAB>name";
+        if (!parse_int(fields[1], &student_id)) return "student id must be a number";
+        Student *existing = find_student_by_name(sys, fields[2]);
+        if (existing != NULL && existing->student_id == student_id) return NULL;
+        return student_system_insert(sys, student_id, fields[2]) ? NULL : "could not add student";
+    }
+    
+    if (strcmp(op, "remove") == 0) {
+        // remove <title>
+        if (field_count != 2) return "usage: remove<TAB>title";
+        Book *book = find_book_by_title(lib, fields[1]);
+        if (book == NULL) return "book not found";
+        return library_delete_book(lib, sys, (int)(book - lib->books)) ? NULL : "could not remove book";
+    }
+    
+    if (strcmp(op, "borrow") == 0 || strcmp(op, "return") == 0) {
+        // borrow|return <student name> <title>
+        if (field_count != 3) return "usage: borrow|return<TAB>student<TAB>title";
+        Student *student = find_student_by_name(sys, fields[1]);
+        if (student == NULL) return "student not found";
+        Book *book = find_book_by_title(lib, fields[2]);
+        if (book == NULL) return "book not found";
+        
+        int result = op[0] == 'b' ? lend_book(lib, sys, book, student) : receive_book(lib, sys, book, student);
+        return loan_error(result);
+    }
+    
+    return "unknown command";
+}
+
+int run_batch(const char *path, Library *lib, StudentSystem *sys, const char *snapshot_path) {
+    LineReader reader = { 0, NULL, LINE_READER_CHUNK, 0, 0, 0 };
+    
+    if (strcmp(path, "-") != 0) {
+        reader.fd = open(path, O_RDONLY);
+        if (reader.fd < 0) {
+            fprintf(stderr, "batch: cannot open '%s': %s\n", path, strerror(errno));
+            return 0;
+        }
+    }
+    
+    int author_capacity = 16;
+    const char **authors = lib_malloc(sizeof(char*) * author_capacity);
+    reader.buffer = lib_malloc(reader.size);
+    if (reader.buffer == NULL || authors == NULL) {
+        fprintf(stderr, "batch: out of memory\n");
+        lib_free(reader.buffer);
+        lib_free(authors);
+        if (reader.fd != 0) close(reader.fd);
+        return 0;
+    }
+    
+    long line_number = 0;
+    long operations = 0;
+    long failures = 0;
+    double started = monotonic_seconds();
+    
+    char *line;
+    while ((line = next_line(&reader)) != NULL) {
+        line_number++;
+        if (line[0] == '\0' || line[0] == '#') continue;
+        
+        char *fields[6];
+        int field_count = split_fields(line, fields, 6);
+        
+        // A run of book lines is bulk loaded; every other command needs the
+        // indexes complete
+        if (strcmp(fields[0], "book") == 0) {
+            library_bulk_begin(lib);
+        } else if (!library_bulk_finish(lib)) {
+            fprintf(stderr, "batch: out of memory while indexing, searches may miss books\n");
+            failures++;
+        }
+        const char *error = run_batch_command(fields, field_count, lib, sys, &authors, &author_capacity);
+        operations++;
+        if (error != NULL) {
+            failures++;
+            fprintf(stderr, "batch: line %ld: %s: %s\n", line_number, fields[0], error);
+        } else if ((strcmp(fields[0], "book") == 0 && lib->missed_indexes != 0) ||
+                   (strcmp(fields[0], "student") == 0 && sys->missed_indexes != 0)) {
+            fprintf(stderr, "batch: line %ld: %s: an index is full, lookups may miss it\n", line_number, fields[0]);
+        }
+        
+        if (journal_needs_compaction(lib->journal)) {
+            compact_journal(lib->journal, snapshot_path, lib, sys);
+        }
+    }
+    
+    if (!library_bulk_finish(lib)) {
+        fprintf(stderr, "batch: out of memory while indexing, searches may miss books\n");
+        failures++;
+    }
+    
+    // A feed that weeded many titles should not keep their slots around
+    library_shrink_to_fit(lib);
+    
+    double elapsed = monotonic_seconds() - started;
+    fprintf(stderr, "batch: %ld operations (%ld failed) in %.3f s, %.0f ops/s\n",
+            operations, failures, elapsed, elapsed > 0 ? operations / elapsed : 0.0);
+    
+    lib_free(authors);
+    lib_free(reader.buffer);
+    if (reader.fd != 0) close(reader.fd);
+    return failures == 0;
+}
+
+/* ================== CSV / TSV IMPORT AND EXPORT ==================== */
+
+// Catalog files have one book per record:
+//   title, authors (separated by ';'), year, pages, available (1/0), borrowed_by
+// Files ending in .tsv or .tab are tab-separated without quoting, anything
+// else is CSV with RFC 4180 quoting. A first record naming the columns in
+// that order, the first four at least, is treated as a header.
+
+#define CSV_CHUNK (1 << 20)
+
+enum { CSV_FIELD_START, CSV_UNQUOTED, CSV_QUOTED, CSV_QUOTE_IN_QUOTED };
+
+// Streaming record parser. Input is read in large chunks and field bytes
+// are collected into one record buffer that is reused for every record,
+// so steady-state parsing does no heap allocation at all.
+typedef struct {
+    int fd;
+    char delimiter;
+    int quoting;           // 1 for CSV, 0 for TSV
+    char *chunk;
+    size_t chunk_len;
+    size_t chunk_pos;
+    int eof;
+    char *record;          // Field bytes, each field NUL-terminated
+    size_t record_len;
+    size_t record_size;
+    size_t field_begin;    // Offset where the field being parsed starts
+    size_t *field_starts;
+    int field_count;
+    int field_capacity;
+} CsvReader;
+
+static int is_tsv_path(const char *path) {
+    const char *dot = strrchr(path, '.');
+    return dot != NULL && (strcmp(dot, ".tsv") == 0 || strcmp(dot, ".tab") == 0);
+}
+
+static int csv_put_byte(CsvReader *reader, char c) {
+    if (reader->record_len + 1 >= reader->record_size) {
+        char *bigger = lib_realloc(reader->record, reader->record_size * 2);
+        if (bigger == NULL) return 0;
+        reader->record = bigger;
+        reader->record_size *= 2;
+    }
+    reader->record[reader->record_len++] = c;
+    return 1;
+}
+
+static int csv_end_field(CsvReader *reader) {
+    if (reader->field_count >= reader->field_capacity) {
+        size_t *bigger = lib_realloc(reader->field_starts, sizeof(size_t) * reader->field_capacity * 2);
+        if (bigger == NULL) return 0;
+        reader->field_starts = bigger;
+        reader->field_capacity *= 2;
+    }
+    if (!csv_put_byte(reader, '\0')) return 0;
+    
+    reader->field_starts[reader->field_count++] = reader->field_begin;
+    reader->field_begin = reader->record_len;
+    return 1;
+}
+
+// Returns 1 with a record in reader->record/field_starts, 0 at end of input, -1 on error
+static int csv_next_record(CsvReader *reader) {
+    int state = CSV_FIELD_START;
+    reader->record_len = 0;
+    reader->field_begin = 0;
+    reader->field_count = 0;
+    int has_data = 0;
+    
+    while (1) {
+        if (reader->chunk_pos == reader->chunk_len) {
+            if (reader->eof) break;
+            ssize_t got = read(reader->fd, reader->chunk, CSV_CHUNK);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) return -1;
+            if (got == 0) {
+                reader->eof = 1;
+                break;
+            }
+            reader->chunk_len = got;
+            reader->chunk_pos = 0;
+        }
+        
+        char c = reader->chunk[reader->chunk_pos++];
+        has_data = 1;
+        
+        if (c == '\r' && state != CSV_QUOTED) continue;
+        
+        switch (state) {
+            case CSV_QUOTED:
+                if (c == '"') {
+                    state = CSV_QUOTE_IN_QUOTED;
+                } else if (!csv_put_byte(reader, c)) {
+                    return -1;
+                }
+                continue;
+            case CSV_QUOTE_IN_QUOTED:
+                if (c == '"') { // Doubled quote inside a quoted field
+                    if (!csv_put_byte(reader, c)) return -1;
+                    state = CSV_QUOTED;
+                    continue;
+                }
+                break;
+            case CSV_FIELD_START:
+                if (c == '"' && reader->quoting) {
+                    state = CSV_QUOTED;
+                    continue;
+                }
+                break;
+            default:
+                break;
+        }
+        
+        if (c == reader->delimiter) {
+            if (!csv_end_field(reader)) return -1;
+            state = CSV_FIELD_START;
+        } else if (c == '\n') {
+            return csv_end_field(reader) ? 1 : -1;
+        } else {
+            if (!csv_put_byte(reader, c)) return -1;
+            state = CSV_UNQUOTED;
+        }
+    }
+    
+    // Final record without a trailing newline
+    if (!has_data) return 0;
+    return csv_end_field(reader) ? 1 : -1;
+}
+
+// A header row names the first four columns or more, in order, ignoring case
+static int is_header_record(char **fields, int field_count) {
+    static const char *const columns[] = { "title", "authors", "year", "pages", "available", "borrowed_by" };
+    if (field_count < 4 || field_count > 6) return 0;
+    for (int i = 0; i < field_count; i++) {
+        if (strcasecmp(fields[i], columns[i]) != 0) return 0;
+    }
+    return 1;
+}
+
+static int parse_flag(const char *text) {
+    return strcmp(text, "0") != 0 && strcasecmp(text, "no") != 0 && strcasecmp(text, "false") != 0;
+}
+
+int import_catalog(const char *path, Library *lib, StudentSystem *sys, const char *snapshot_path) {
+    CsvReader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.delimiter = is_tsv_path(path) ? '\t' : ',';
+    reader.quoting = reader.delimiter == ',';
+    reader.fd = strcmp(path, "-") == 0 ? 0 : open(path, O_RDONLY);
+    if (reader.fd < 0) {
+        fprintf(stderr, "import: cannot open '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    
+    reader.chunk = lib_malloc(CSV_CHUNK);
+    reader.record_size = 4096;
+    reader.record = lib_malloc(reader.record_size);
+    reader.field_capacity = 8;
+    reader.field_starts = lib_malloc(sizeof(size_t) * reader.field_capacity);
+    int author_capacity = 16;
+    const char **authors = lib_malloc(sizeof(char*) * author_capacity);
+    if (reader.chunk == NULL || reader.record == NULL || reader.field_starts == NULL || authors == NULL) {
+        fprintf(stderr, "import: out of memory\n");
+        lib_free(reader.chunk);
+        lib_free(reader.record);
+        lib_free(reader.field_starts);
+        lib_free(authors);
+        if (reader.fd != 0) close(reader.fd);
+        return 0;
+    }
+    
+    // A bulk import is made durable by the snapshot written as soon as it
+    // ends, not by journaling every record
+    Journal *journal = lib->journal;
+    lib->journal = NULL;
+    sys->journal = NULL;
+    
+    long record_number = 0;
+    long imported = 0;
+    long failures = 0;
+    double started = monotonic_seconds();
+    int status;
+    library_bulk_begin(lib);
+    
+    while ((status = csv_next_record(&reader)) == 1) {
+        record_number++;
+        char *fields[6];
+        for (int i = 0; i < 6; i++) {
+            fields[i] = i < reader.field_count ? reader.record + reader.field_starts[i] : "";
+        }
+        
+        if (reader.field_count == 1 && fields[0][0] == '\0') continue; // Blank line
+        if (record_number == 1 && is_header_record(fields, reader.field_count)) continue;
+        
+        int year, pages;
+        if (reader.field_count < 4 || !parse_int(fields[2], &year) || !parse_int(fields[3], &pages)) {
+            fprintf(stderr, "import: record %ld: expected title, authors, year, pages\n", record_number);
+            failures++;
+            continue;
+        }
+        
+        // Split the author list in place
+        int author_count = 0;
+        int authors_complete = 1;
+        char *author = fields[1];
+        while (*author != '\0') {
+            if (author_count >= author_capacity) {
+                const char **bigger = lib_realloc(authors, sizeof(char*) * author_capacity * 2);
+                if (bigger == NULL) {
+                    authors_complete = 0;
+                    break;
+                }
+                authors = bigger;
+                author_capacity *= 2;
+            }
+            authors[author_count++] = author;
+            char *separator = strchr(author, ';');
+            if (separator == NULL) break;
+            *separator = '\0';
+            author = separator + 1;
+        }
+        if (!authors_complete) {
+            fprintf(stderr, "import: record %ld: out of memory for the author list\n", record_number);
+            failures++;
+            continue;
+        }
+        
+        const char *invalid = library_check_book(year, pages, author_count);
+        if (invalid != NULL) {
+            fprintf(stderr, "import: record %ld: %s\n", record_number, invalid);
+            failures++;
+            continue;
+        }
+        if (!library_insert_book(lib, fields[0], authors, author_count, year, pages)) {
+            fprintf(stderr, "import: record %ld: could not add '%s'\n", record_number, fields[0]);
+            failures++;
+            continue;
+        }
+        imported++;
+        
+        // Restore the loan when the borrower is a known student
+        if (reader.field_count >= 6 && !parse_flag(fields[4]) && fields[5][0] != '\0') {
+            Student *student = find_student_by_name(sys, fields[5]);
+            if (student == NULL ||
+                lend_book(lib, sys, &lib->books[lib->book_count - 1], student) != LOAN_OK) {
+                fprintf(stderr, "import: record %ld: '%s' kept available, cannot lend to '%s'\n",
+                        record_number, fields[0], fields[5]);
+            }
+        }
+    }
+    
+    if (!library_bulk_finish(lib)) {
+        fprintf(stderr, "import: out of memory while indexing, searches may miss books\n");
+        failures++;
+    }
+    
+    // Journal records name books by array position, so the imported books
+    // must be in the snapshot before anything else is logged
+    lib->journal = journal;
+    sys->journal = journal;
+    if (journal != NULL && imported > 0 && !fold_journal(journal, snapshot_path, lib, sys)) {
+        fprintf(stderr, "import: could not save the snapshot '%s'\n", snapshot_path);
+        failures++;
+    }
+    
+    if (status < 0) {
+        fprintf(stderr, "import: read error in '%s': %s\n", path, strerror(errno));
+        failures++;
+    }
+    
+    double elapsed = monotonic_seconds() - started;
+    fprintf(stderr, "import: %ld books (%ld failed) in %.3f s, %.0f records/s\n",
+            imported, failures, elapsed, elapsed > 0 ? imported / elapsed : 0.0);
+    
+    lib_free(reader.chunk);
+    lib_free(reader.record);
+    lib_free(reader.field_starts);
+    lib_free(authors);
+    if (reader.fd != 0) close(reader.fd);
+    return failures == 0;
+}
+
+// A buffer without an fd keeps everything until it is given one
+void output_flush(OutputBuffer *out) {
+    if (out->fd < 0) {
+        return;
+    }
+    size_t done = 0;
+    while (out->ok && done < out->len) {
+        ssize_t wrote = write(out->fd, out->data + done, out->len - done);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) {
+            out->ok = 0;
+            break;
+        }
+        done += wrote;
+    }
+    out->len = 0;
+}
+
+// Makes room for len more bytes in a buffer without an fd
+static int output_grow(OutputBuffer *out, size_t len) {
+    size_t size = out->size;
+    while (size - out->len < len) {
+        size *= 2;
+    }
+    char *data = lib_realloc(out->data, size);
+    if (data == NULL) {
+        out->ok = 0;
+        return 0;
+    }
+    out->data = data;
+    out->size = size;
+    return 1;
+}
+
+void output_bytes(OutputBuffer *out, const char *bytes, size_t len) {
+    if (out->len + len > out->size) {
+        if (out->fd < 0) {
+            if (!output_grow(out, len)) return;
+        } else {
+            output_flush(out);
+        }
+    }
+    if (len > out->size) {
+        // Oversized piece: write it straight through
+        OutputBuffer direct = { out->fd, (char *)bytes, len, out->ok, len };
+        output_flush(&direct);
+        out->ok = direct.ok;
+        return;
+    }
+    memcpy(out->data + out->len, bytes, len);
+    out->len += len;
+}
+
+void output_char(OutputBuffer *out, char c) {
+    if (out->len == out->size) {
+        if (out->fd < 0) {
+            if (!output_grow(out, 1)) return;
+        } else {
+            output_flush(out);
+        }
+    }
+    out->data[out->len++] = c;
+}
+
+void output_string(OutputBuffer *out, const char *text) {
+    output_bytes(out, text, strlen(text));
+}
+
+// Decimal digits without going through printf
+void output_int(OutputBuffer *out, long long value) {
+    char digits[24];
+    int count = 0;
+    unsigned long long magnitude = value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    
+    if (value < 0) {
+        output_char(out, '-');
+    }
+    while (count > 0) {
+        output_char(out, digits[--count]);
+    }
+}
+
+void output_field(OutputBuffer *out, const char *text, char delimiter) {
+    if (delimiter == '\t') {
+        // TSV has no quoting: tabs and line breaks inside a value become spaces
+        for (const char *p = text; *p != '\0'; p++) {
+            output_char(out, (*p == '\t' || *p == '\n' || *p == '\r') ? ' ' : *p);
+        }
+        return;
+    }
+    
+    if (strpbrk(text, ",\"\r\n") == NULL) {
+        output_bytes(out, text, strlen(text));
+        return;
+    }
+    output_char(out, '"');
+    for (const char *p = text; *p != '\0'; p++) {
+        if (*p == '"') output_char(out, '"');
+        output_char(out, *p);
+    }
+    output_char(out, '"');
+}
+
+int export_catalog(const char *path, Library *lib, StudentSystem *sys) {
+    char delimiter = is_tsv_path(path) ? '\t' : ',';
+    OutputBuffer out = { 1, lib_malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    if (out.data == NULL) {
+        fprintf(stderr, "export: out of memory\n");
+        return 0;
+    }
+    if (strcmp(path, "-") != 0) {
+        out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out.fd < 0) {
+            fprintf(stderr, "export: cannot create '%s': %s\n", path, strerror(errno));
+            lib_free(out.data);
+            return 0;
+        }
+    }
+    
+    char number[32];
+    const char *header = delimiter == '\t' ? "title\tauthors\tyear\tpages\tavailable\tborrowed_by\n"
+                                           : "title,authors,year,pages,available,borrowed_by\n";
+    output_bytes(&out, header, strlen(header));
+    
+    for (int i = 0; i < lib->book_count && out.ok; i++) {
+        const Book *book = &lib->books[i];
+        output_field(&out, book_title(lib, book), delimiter);
+        output_char(&out, delimiter);
+        
+        // Authors are joined with ';' inside a single (possibly quoted) field
+        int needs_quotes = 0;
+        for (int j = 0; j < book->author_count; j++) {
+            needs_quotes |= delimiter == ',' && strpbrk(book_author(lib, book, j), ",\"\r\n") != NULL;
+        }
+        if (needs_quotes) output_char(&out, '"');
+        for (int j = 0; j < book->author_count; j++) {
+            if (j > 0) output_char(&out, ';');
+            if (needs_quotes) {
+                for (const char *p = book_author(lib, book, j); *p != '\0'; p++) {
+                    if (*p == '"') output_char(&out, '"');
+                    output_char(&out, *p);
+                }
+            } else {
+                output_field(&out, book_author(lib, book, j), delimiter);
+            }
+        }
+        if (needs_quotes) output_char(&out, '"');
+        
+        int len = snprintf(number, sizeof(number), "%c%d%c%d%c%d%c", delimiter, book->year, delimiter,
+                           book->pages, delimiter, book->is_available, delimiter);
+        output_bytes(&out, number, len);
+        if (!book->is_available) {
+            output_field(&out, student_name(sys, &sys->students[book->borrower]), delimiter);
+        }
+        output_char(&out, '\n');
+    }
+    output_flush(&out);
+    
+    int ok = out.ok;
+    if (out.fd != 1 && close(out.fd) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "export: write to '%s' failed: %s\n", path, strerror(errno));
+    } else {
+        fprintf(stderr, "export: %d books written to '%s'\n", lib->book_count, path);
+    }
+    lib_free(out.data);
+    return ok;
+}
+
+/* ================== SERVER MODE ==================== */
+
+// Daemon serving many desks over a Unix socket. Each request line uses the
+// batch syntax (book, student, remove, borrow, return) or one of the read
+// commands below; the reply is zero or more tab-separated data lines and a
+// final status line, "OK" or "ERR <message>".
+//
+//   search<TAB>term       books whose title or an author contains term
+//   list                  every book
+//   stats                 the statistics screens as name<TAB>value lines
+//   loans<TAB>student     the student's borrowed books
+//   metrics               operation latencies and counters as one JSON line
+//
+// Reads and loans share the catalog lock; adds, removes and compaction take
+// it exclusively. A loan additionally locks the stripe of its book and of
+// its student, so loans on different books and students run side by side.
+//
+// Workers are handed requests, not clients: between requests a connection
+// waits in the accepting thread's poll set, and only one with input is
+// queued for a worker. The worker count limits how many requests run at
+// once; any number of desks can stay connected.
+#define SERVER_LOCK_STRIPES 64
+#define SERVER_IDLE_MS      JOURNAL_GROUP_MS   // Poll interval, also flushes idle group commits
+#define CONNECTION_BUFFER   4096               // Input buffer per client, grows for longer lines
+
+// A client and what it has sent that is not answered yet
+typedef struct Connection {
+    int fd;
+    LineReader reader;
+    struct Connection *next;   // In the ready or returned list
+} Connection;
+
+// Clients of the server and the router
+typedef struct {
+    Connection *ready;         // Have input and wait for a worker, oldest first
+    Connection *ready_tail;
+    Connection *returned;      // Answered, waiting to rejoin the poll set
+    pthread_mutex_t lock;
+    pthread_cond_t has_ready;
+    int wake[2];               // Pipe that interrupts the poll when a client is returned
+    int stopping;
+    
+    // Only the accepting thread touches these
+    Connection **idle;         // Waiting for input
+    struct pollfd *polls;      // Listener, wake pipe, then one per idle client
+    int idle_count;
+    int idle_capacity;
+} ConnectionQueue;
+
+typedef struct {
+    Library *lib;
+    StudentSystem *sys;
+    const char *snapshot_path;
+    pthread_rwlock_t catalog_lock;
+    pthread_mutex_t book_stripes[SERVER_LOCK_STRIPES];    // Loan state of books, by slot
+    pthread_mutex_t student_stripes[SERVER_LOCK_STRIPES]; // Loan lists, by student position
+    ConnectionQueue connections;
+} Server;
+
+static volatile sig_atomic_t server_stop_requested = 0;
+
+static void server_handle_signal(int signum) {
+    (void)signum;
+    server_stop_requested = 1;
+}
+
+static pthread_mutex_t* book_stripe(Server *server, const Book *book) {
+    return &server->book_stripes[(unsigned int)book->slot % SERVER_LOCK_STRIPES];
+}
+
+static pthread_mutex_t* student_stripe(Server *server, const Student *student) {
+    return &server->student_stripes[(unsigned int)(student - server->sys->students) % SERVER_LOCK_STRIPES];
+}
+
+// One book as title, authors, year, pages, available, borrower; with a view,
+// the loan as it stood when the view was opened
+static void server_write_book(Server *server, OutputBuffer *out, Book *book, LoanView *view) {
+    char number[64];
+    output_field(out, book_title(server->lib, book), '\t');
+    output_char(out, '\t');
+    for (int j = 0; j < book->author_count; j++) {
+        if (j > 0) output_char(out, ';');
+        output_field(out, book_author(server->lib, book, j), '\t');
+    }
+    
+    // Loans change under the shared lock; read them under the book's stripe
+    pthread_mutex_lock(book_stripe(server, book));
+    int borrower = view != NULL ? loan_view_borrower(view, book) : book->borrower;
+    pthread_mutex_unlock(book_stripe(server, book));
+    int available = borrower < 0;
+    
+    int len = snprintf(number, sizeof(number), "\t%d\t%d\t%d\t", book->year, book->pages, available);
+    output_bytes(out, number, len);
+    if (!available) {
+        output_field(out, student_name(server->sys, &server->sys->students[borrower]), '\t');
+    }
+    output_char(out, '\n');
+}
+
+static void server_write_stat(OutputBuffer *out, const char *name, long long value) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s\t%lld\n", name, value);
+    output_bytes(out, line, len);
+}
+
+static const char* server_search(Server *server, OutputBuffer *out, const char *term) {
+    Book **found = NULL;
+    int found_count = library_find_books(server->lib, term, &found);
+    if (found_count < 0) {
+        return "out of memory";
+    }
+    
+    for (int i = 0; i < found_count; i++) {
+        server_write_book(server, out, found[i], NULL);
+    }
+    lib_free(found);
+    return NULL;
+}
+
+// Each hit as its score followed by the book
+static const char* server_rank(Server *server, OutputBuffer *out, const char *query) {
+    SearchHit hits[RANKED_RESULTS];
+    int hit_count = library_rank_books(server->lib, query, RANKED_RESULTS, hits);
+    if (hit_count < 0) {
+        return "out of memory";
+    }
+    
+    for (int i = 0; i < hit_count; i++) {
+        output_int(out, hits[i].score);
+        output_char(out, '\t');
+        server_write_book(server, out, hits[i].book, NULL);
+    }
+    return NULL;
+}
+
+static const char* server_complete(Server *server, OutputBuffer *out, const char *prefix) {
+    const char *words[RANKED_RESULTS];
+    int word_count = library_complete_word(server->lib, prefix, RANKED_RESULTS, words);
+    if (word_count < 0) {
+        return "out of memory";
+    }
+    
+    for (int i = 0; i < word_count; i++) {
+        output_string(out, words[i]);
+        output_char(out, '\n');
+    }
+    return NULL;
+}
+
+// range [year=A..B] [pages=A..B] [available|borrowed]
+static const char* server_range(Server *server, OutputBuffer *out, char **fields, int field_count) {
+    const char *usage = "usage: range[<TAB>year=FROM..TO][<TAB>pages=MIN..MAX][<TAB>available|borrowed]";
+    BookRange range;
+    book_range_init(&range);
+    for (int i = 1; i < field_count; i++) {
+        if (strncmp(fields[i], "year=", 5) == 0) {
+            if (!parse_bounds(fields[i] + 5, &range.year_min, &range.year_max)) return usage;
+        } else if (strncmp(fields[i], "pages=", 6) == 0) {
+            if (!parse_bounds(fields[i] + 6, &range.pages_min, &range.pages_max)) return usage;
+        } else if (strcmp(fields[i], "available") == 0) {
+            range.availability = RANGE_AVAILABLE;
+        } else if (strcmp(fields[i], "borrowed") == 0) {
+            range.availability = RANGE_BORROWED;
+        } else {
+            return usage;
+        }
+    }
+    
+    // Availability comes from the bitmap, which loans update atomically
+    Book **found = NULL;
+    int found_count = library_range_books(server->lib, &range, &found);
+    if (found_count < 0) {
+        return "out of memory";
+    }
+    
+    for (int i = 0; i < found_count; i++) {
+        server_write_book(server, out, found[i], NULL);
+    }
+    lib_free(found);
+    return NULL;
+}
+
+static const char* server_stats(Server *server, OutputBuffer *out) {
+    Library *lib = server->lib;
+    StudentSystem *sys = server->sys;
+    
+    LibraryStats stats;
+    library_stats(lib, sys, &stats);
+    
+    server_write_stat(out, "books", stats.book_count);
+    server_write_stat(out, "authors", stats.author_total);
+    server_write_stat(out, "average_pages", stats.average_pages);
+    server_write_stat(out, "total_pages", lib->page_total);
+    if (stats.newest != NULL && stats.oldest != NULL) {
+        server_write_stat(out, "newest_year", stats.newest->year);
+        server_write_stat(out, "oldest_year", stats.oldest->year);
+    }
+    if (stats.shortest != NULL && stats.longest != NULL) {
+        server_write_stat(out, "min_pages", stats.shortest->pages);
+        server_write_stat(out, "max_pages", stats.longest->pages);
+    }
+    server_write_stat(out, "students", stats.student_count);
+    server_write_stat(out, "borrowed", stats.borrowed_total);
+    server_write_stat(out, "available", stats.book_count - stats.borrowed_total);
+    if (stats.most_active != NULL) {
+        output_bytes(out, "most_active\t", 12);
+        output_field(out, student_name(server->sys, stats.most_active), '\t');
+        char line[64];
+        int len = snprintf(line, sizeof(line), "\t%d\n", stats.most_active_loans);
+        output_bytes(out, line, len);
+    }
+    return NULL;
+}
+
+static const char* server_loan(Server *server, char **fields, int field_count) {
+    if (field_count != 3) return "usage: borrow|return<TAB>student<TAB>title";
+    Student *student = find_student_by_name(server->sys, fields[1]);
+    if (student == NULL) return "student not found";
+    Book *book = find_book_by_title(server->lib, fields[2]);
+    if (book == NULL) return "book not found";
+    
+    // Book stripe before student stripe everywhere, so two loans never wait
+    // on each other in opposite order
+    pthread_mutex_t *book_lock = book_stripe(server, book);
+    pthread_mutex_t *student_lock = student_stripe(server, student);
+    pthread_mutex_lock(book_lock);
+    pthread_mutex_lock(student_lock);
+    int result = fields[0][0] == 'b' ? lend_book(server->lib, server->sys, book, student)
+                                     : receive_book(server->lib, server->sys, book, student);
+    pthread_mutex_unlock(student_lock);
+    pthread_mutex_unlock(book_lock);
+    return loan_error(result);
+}
+
+// A worker thread with the author scratch array batch commands parse into
+typedef struct {
+    Server *server;
+    const char **authors;
+    int author_capacity;
+} ServerWorker;
+
+static const char* server_command(void *context, OutputBuffer *out, char **fields, int field_count) {
+    ServerWorker *worker = context;
+    Server *server = worker->server;
+    const char *op = fields[0];
+    const char *error;
+    
+#ifndef LIBRARY_NO_METRICS
+    // The counters are read atomically and need no catalog lock
+    if (strcmp(op, "metrics") == 0) {
+        metrics_report(out, METRICS_JSON);
+        return NULL;
+    }
+#endif
+    
+    if (strcmp(op, "borrow") == 0 || strcmp(op, "return") == 0) {
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        error = server_loan(server, fields, field_count);
+    } else if (strcmp(op, "search") == 0) {
+        if (field_count != 2) return "usage: search<TAB>term";
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        error = server_search(server, out, fields[1]);
+    } else if (strcmp(op, "rank") == 0) {
+        if (field_count != 2) return "usage: rank<TAB>query";
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        error = server_rank(server, out, fields[1]);
+    } else if (strcmp(op, "complete") == 0) {
+        if (field_count != 2) return "usage: complete<TAB>prefix";
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        error = server_complete(server, out, fields[1]);
+    } else if (strcmp(op, "range") == 0) {
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        error = server_range(server, out, fields, field_count);
+    } else if (strcmp(op, "list") == 0) {
+        // Loans go on while the list is rendered; the view shows them all as
+        // of one moment (or as each book is reached, if memory is short).
+        // The rows go to memory and reach the client after the unlock.
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        LoanView *view = loan_view_open(server->sys);
+        for (int i = 0; i < server->lib->book_count; i++) {
+            server_write_book(server, out, &server->lib->books[i], view);
+        }
+        loan_view_close(server->sys, view);
+        error = NULL;
+    } else if (strcmp(op, "stats") == 0) {
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        error = server_stats(server, out);
+    } else if (strcmp(op, "loans") == 0) {
+        if (field_count != 2) return "usage: loans<TAB>student";
+        pthread_rwlock_rdlock(&server->catalog_lock);
+        Student *student = find_student_by_name(server->sys, fields[1]);
+        error = student == NULL ? "student not found" : NULL;
+        if (student != NULL) {
+            pthread_mutex_lock(student_stripe(server, student));
+            for (int i = 0; i < student->borrowed_count; i++) {
+                output_field(out, book_title(server->lib, library_book_in_slot(server->lib, student->borrowed_books[i])), '\t');
+                output_bytes(out, "\t\n", 2);
+            }
+            pthread_mutex_unlock(student_stripe(server, student));
+        }
+    } else {
+        // Everything else changes the catalog's shape and runs alone
+        pthread_rwlock_wrlock(&server->catalog_lock);
+        error = run_batch_command(fields, field_count, server->lib, server->sys, &worker->authors, &worker->author_capacity);
+    }
+    
+    pthread_rwlock_unlock(&server->catalog_lock);
+    return error;
+}
+
+// Applies one request and returns NULL or the error message
+typedef const char* (*CommandHandler)(void *context, OutputBuffer *out, char **fields, int field_count);
+
+// Reads from the client once and answers every complete request it has
+// sent, in one write. The replies are kept in memory until the commands
+// are done, so no catalog lock is held while a client is slow to read.
+// Returns 0 once the client has hung up or cannot be written to.
+static int serve_connection(Connection *connection, OutputBuffer *out, CommandHandler handle, void *context) {
+    LineReader *reader = &connection->reader;
+    out->fd = -1;
+    out->len = 0;
+    out->ok = 1;
+    if (!reader_fill(reader)) {
+        return 0;
+    }
+    
+    char *line;
+    while (out->ok && (line = buffered_line(reader)) != NULL) {
+        if (line[0] == '\0' || line[0] == '#') continue;
+    
+        char *fields[6];
+        int field_count = split_fields(line, fields, 6);
+        const char *error = handle(context, out, fields, field_count);
+        if (error == NULL) {
+            output_bytes(out, "OK\n", 3);
+        } else {
+            output_bytes(out, "ERR ", 4);
+            output_bytes(out, error, strlen(error));
+            output_char(out, '\n');
+        }
+    }
+    out->fd = connection->fd;
+    output_flush(out);
+    
+    // A long listing should not pin its memory to the worker
+    if (out->size > OUTPUT_BUFFER_SIZE) {
+        char *smaller = lib_realloc(out->data, OUTPUT_BUFFER_SIZE);
+        if (smaller != NULL) {
+            out->data = smaller;
+            out->size = OUTPUT_BUFFER_SIZE;
+        }
+    }
+    return out->ok && !reader->eof;
+}
+
+static void connection_close(Connection *connection) {
+    close(connection->fd);
+    lib_free(connection->reader.buffer);
+    lib_free(connection);
+}
+
+static void connection_list_close(Connection *connection) {
+    while (connection != NULL) {
+        Connection *next = connection->next;
+        connection_close(connection);
+        connection = next;
+    }
+}
+
+static int connection_queue_init(ConnectionQueue *queue) {
+    memset(queue, 0, sizeof(*queue));
+    if (pipe(queue->wake) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(queue->wake[i], F_SETFL, fcntl(queue->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(queue->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->has_ready, NULL);
+    return 1;
+}
+
+// Closes every client still connected; the workers must have stopped
+static void connection_queue_destroy(ConnectionQueue *queue) {
+    connection_list_close(queue->ready);
+    connection_list_close(queue->returned);
+    for (int i = 0; i < queue->idle_count; i++) {
+        connection_close(queue->idle[i]);
+    }
+    close(queue->wake[0]);
+    close(queue->wake[1]);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->has_ready);
+    lib_free(queue->idle);
+    lib_free(queue->polls);
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Adds a client to the poll set; one that cannot be added is dropped
+static void connection_queue_watch(ConnectionQueue *queue, Connection *connection) {
+    if (queue->idle_count == queue->idle_capacity) {
+        int capacity = queue->idle_capacity > 0 ? queue->idle_capacity * 2 : 16;
+        Connection **idle = lib_realloc(queue->idle, sizeof(Connection*) * capacity);
+        if (idle != NULL) {
+            queue->idle = idle;
+        }
+        struct pollfd *polls = idle != NULL ? lib_realloc(queue->polls, sizeof(struct pollfd) * (capacity + 2)) : NULL;
+        if (polls == NULL) {
+            connection_close(connection);
+            return;
+        }
+        queue->polls = polls;
+        queue->idle_capacity = capacity;
+    }
+    queue->idle[queue->idle_count++] = connection;
+}
+
+// Waits up to timeout_ms for a new client or input from a connected one.
+// Clients with input are queued for the workers. Returns the number of
+// clients accepted, or -1 if nothing happened.
+static int connection_queue_poll(ConnectionQueue *queue, int listen_fd, int timeout_ms) {
+    if (queue->polls == NULL) {
+        queue->polls = lib_malloc(sizeof(struct pollfd) * 2);
+        if (queue->polls == NULL) {
+            return -1;
+        }
+    }
+    queue->polls[0] = (struct pollfd){ listen_fd, POLLIN, 0 };
+    queue->polls[1] = (struct pollfd){ queue->wake[0], POLLIN, 0 };
+    for (int i = 0; i < queue->idle_count; i++) {
+        queue->polls[i + 2] = (struct pollfd){ queue->idle[i]->fd, POLLIN, 0 };
+    }
+    if (poll(queue->polls, queue->idle_count + 2, timeout_ms) <= 0) {
+        return -1;
+    }
+    
+    // Input, a hang-up or an error all go to a worker, which finds out which
+    Connection *first = NULL, *last = NULL;
+    int kept = 0;
+    for (int i = 0; i < queue->idle_count; i++) {
+        Connection *connection = queue->idle[i];
+        if (queue->polls[i + 2].revents == 0) {
+            queue->idle[kept++] = connection;
+            continue;
+        }
+        connection->next = NULL;
+        if (last != NULL) last->next = connection;
+        else first = connection;
+        last = connection;
+    }
+    queue->idle_count = kept;
+    
+    // Drain the pipe before taking the returned list: a client returned
+    // after that writes to the pipe again
+    if (queue->polls[1].revents != 0) {
+        char drain[64];
+        while (read(queue->wake[0], drain, sizeof(drain)) > 0);
+    }
+    pthread_mutex_lock(&queue->lock);
+    if (first != NULL) {
+        if (queue->ready_tail != NULL) queue->ready_tail->next = first;
+        else queue->ready = first;
+        queue->ready_tail = last;
+        pthread_cond_broadcast(&queue->has_ready);
+    }
+    Connection *returned = queue->returned;
+    queue->returned = NULL;
+    pthread_mutex_unlock(&queue->lock);
+    
+    while (returned != NULL) {
+        Connection *next = returned->next;
+        connection_queue_watch(queue, returned);
+        returned = next;
+    }
+    
+    if (!(queue->polls[0].revents & POLLIN)) {
+        return 0;
+    }
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return 0;
+    }
+    Connection *connection = lib_calloc(1, sizeof(Connection));
+    char *buffer = connection != NULL ? lib_malloc(CONNECTION_BUFFER) : NULL;
+    if (buffer == NULL) {
+        lib_free(connection);
+        close(fd);
+        return 0;
+    }
+    connection->fd = fd;
+    connection->reader = (LineReader){ fd, buffer, CONNECTION_BUFFER, 0, 0, 0 };
+    connection_queue_watch(queue, connection);
+    return 1;
+}
+
+// Next client with input for a worker, or NULL once the queue is stopped
+// and empty
+static Connection* connection_queue_pop(ConnectionQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->ready == NULL && !queue->stopping) {
+        pthread_cond_wait(&queue->has_ready, &queue->lock);
+    }
+    Connection *connection = queue->ready;
+    if (connection != NULL) {
+        queue->ready = connection->next;
+        if (queue->ready == NULL) {
+            queue->ready_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return connection;
+}
+
+// Hands an answered client back to the poll set, or closes it
+static void connection_queue_return(ConnectionQueue *queue, Connection *connection, int open) {
+    pthread_mutex_lock(&queue->lock);
+    if (!open || queue->stopping) {
+        pthread_mutex_unlock(&queue->lock);
+        connection_close(connection);
+        return;
+    }
+    connection->next = queue->returned;
+    queue->returned = connection;
+    pthread_mutex_unlock(&queue->lock);
+    
+    // A full pipe already holds a wake-up
+    ssize_t wrote = write(queue->wake[1], "", 1);
+    (void)wrote;
+}
+
+// Stops the workers once the clients already queued are answered; clients
+// waiting for input are closed with the queue
+static void connection_queue_stop(ConnectionQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->has_ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int unix_address(struct sockaddr_un *address, const char *socket_path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        return 0;
+    }
+    strcpy(address->sun_path, socket_path);
+    return 1;
+}
+
+// Listening socket at the path, replacing a stale one; -1 on failure.
+// Messages start with the mode's name.
+static int listen_on_socket(const char *socket_path, const char *mode) {
+    struct sockaddr_un address;
+    if (!unix_address(&address, socket_path)) {
+        fprintf(stderr, "%s: socket path '%s' is too long\n", mode, socket_path);
+        return -1;
+    }
+    
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "%s: socket: %s\n", mode, strerror(errno));
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "%s: cannot listen on '%s': %s\n", mode, socket_path, strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+// Stop on SIGINT/SIGTERM; a client hanging up must not kill the daemon
+static void catch_stop_signals(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void* server_worker(void *arg) {
+    ServerWorker *worker = arg;
+    Server *server = worker->server;
+    
+    OutputBuffer out = { -1, lib_malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    worker->author_capacity = 16;
+    worker->authors = lib_malloc(sizeof(char*) * worker->author_capacity);
+    
+    Connection *connection;
+    while ((connection = connection_queue_pop(&server->connections)) != NULL) {
+        int open = out.data != NULL && worker->authors != NULL &&
+                   serve_connection(connection, &out, server_command, worker);
+        connection_queue_return(&server->connections, connection, open);
+    }
+    
+    lib_free(out.data);
+    lib_free(worker->authors);
+    return NULL;
+}
+
+int run_server(const char *socket_path, int worker_count, Library *lib, StudentSystem *sys, const char *snapshot_path) {
+    int listen_fd = listen_on_socket(socket_path, "serve");
+    if (listen_fd < 0) {
+        return 0;
+    }
+    
+    Server *server = lib_calloc(1, sizeof(Server));
+    ServerWorker *workers = lib_malloc(sizeof(ServerWorker) * worker_count);
+    pthread_t *threads = lib_malloc(sizeof(pthread_t) * worker_count);
+    if (server == NULL || workers == NULL || threads == NULL ||
+        !connection_queue_init(&server->connections)) {
+        fprintf(stderr, "serve: out of memory\n");
+        lib_free(server);
+        lib_free(workers);
+        lib_free(threads);
+        close(listen_fd);
+        unlink(socket_path);
+        return 0;
+    }
+    
+    server->lib = lib;
+    server->sys = sys;
+    server->snapshot_path = snapshot_path;
+    pthread_rwlock_init(&server->catalog_lock, NULL);
+    for (int i = 0; i < SERVER_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&server->book_stripes[i], NULL);
+        pthread_mutex_init(&server->student_stripes[i], NULL);
+    }
+    catch_stop_signals();
+    
+    int started = 0;
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].server = server;
+        if (pthread_create(&threads[i], NULL, server_worker, &workers[i]) != 0) break;
+        started++;
+    }
+    fprintf(stderr, "serve: listening on '%s' with %d workers\n", socket_path, started);
+    
+    // The accepting thread also does the housekeeping: idle group commits
+    // are flushed and the journal is compacted while no one else runs
+    long long served = 0;
+    while (started > 0 && !server_stop_requested) {
+        int accepted = connection_queue_poll(&server->connections, listen_fd, SERVER_IDLE_MS);
+        if (accepted < 0) {
+            journal_sync(lib->journal);
+        }
+        if (journal_needs_compaction(lib->journal)) {
+            pthread_rwlock_wrlock(&server->catalog_lock);
+            compact_journal(lib->journal, snapshot_path, lib, sys);
+            pthread_rwlock_unlock(&server->catalog_lock);
+        }
+        if (accepted > 0) {
+            served += accepted;
+        }
+    }
+    
+    connection_queue_stop(&server->connections);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    close(listen_fd);
+    unlink(socket_path);
+    fprintf(stderr, "serve: stopped after %lld connections\n", served);
+    
+    pthread_rwlock_destroy(&server->catalog_lock);
+    for (int i = 0; i < SERVER_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&server->book_stripes[i]);
+        pthread_mutex_destroy(&server->student_stripes[i]);
+    }
+    connection_queue_destroy(&server->connections);
+    lib_free(server);
+    lib_free(workers);
+    lib_free(threads);
+    return started > 0;
+}
+
+/* ================== SHARDED MODE ==================== */
+
+// A router in front of shard processes on this host, each an ordinary
+// server (--serve) with its own snapshot, journal and socket: the router's
+// paths with ".0", ".1", ... appended. A book lives on the shard its
+// case-folded title hashes to. Students are registered on every shard,
+// since a loan needs its borrower on the book's shard, and there are far
+// fewer of them than books. Clients speak the server protocol:
+//
+//   book, remove, borrow, return      the shard that owns the title
+//   student                           every shard, retried where it failed
+//   search, list, range, loans        every shard, rows one shard after another
+//   rank, complete                    every shard, merged best first
+//   stats                             every shard, added up
+//   metrics                           every shard, one JSON line each
+//
+// The loan limit spans shards: before a borrow the router counts the
+// student's loans on every shard, holding a lock for that student, so the
+// shards must only be reached through the router.
+#define ROUTER_SHARDS_MAX    64
+#define ROUTER_STUDENT_LOCKS 64
+#define ROUTER_START_MS      50   // Poll interval while the shards start
+
+typedef struct {
+    int shard_count;
+    char (*sockets)[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pid_t *pids;               // Shard processes, 0 once reaped
+    pthread_mutex_t student_locks[ROUTER_STUDENT_LOCKS]; // Borrow checks, by student name
+    ConnectionQueue connections;
+} Router;
+
+// A router worker's connection to one shard, opened on first use and kept
+// for the next requests. Shards run as many workers as the router, so a
+// request from every router worker can run on a shard at once.
+typedef struct {
+    int fd;                    // -1 while not connected
+    LineReader reader;
+    OutputBuffer out;
+} ShardLink;
+
+typedef struct {
+    Router *router;
+    ShardLink *links;          // One per shard
+    char error[256];           // Text of the last shard error passed on
+} RouterWorker;
+
+// Shard owning a title. The hash is mixed first: the shard's own hash
+// tables index by its low bits, which would otherwise be the same for
+// every title on a shard.
+static int router_shard(const Router *router, const char *title) {
+    uint32_t mixed = case_folded_hash(title) * 2654435761u;
+    return (int)(((uint64_t)mixed * (uint64_t)router->shard_count) >> 32);
+}
+
+static int connect_socket(const char *socket_path) {
+    struct sockaddr_un address;
+    if (!unix_address(&address, socket_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void shard_link_close(ShardLink *link) {
+    if (link->fd >= 0) {
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+static int shard_link_open(Router *router, ShardLink *link, int shard) {
+    if (link->fd >= 0) {
+        return 1;
+    }
+    if (link->reader.buffer == NULL) {
+        link->reader.buffer = lib_malloc(LINE_READER_CHUNK);
+        link->reader.size = LINE_READER_CHUNK;
+    }
+    if (link->out.data == NULL) {
+        link->out.data = lib_malloc(OUTPUT_BUFFER_SIZE);
+        link->out.size = OUTPUT_BUFFER_SIZE;
+    }
+    if (link->reader.buffer == NULL || link->out.data == NULL) {
+        return 0;
+    }
+    
+    link->fd = connect_socket(router->sockets[shard]);
+    link->reader.fd = link->fd;
+    link->reader.start = 0;
+    link->reader.end = 0;
+    link->reader.eof = 0;
+    link->out.fd = link->fd;
+    link->out.len = 0;
+    link->out.ok = 1;
+    return link->fd >= 0;
+}
+
+// Writes the request line to a shard, fields joined by tabs again
+static int shard_send(RouterWorker *worker, int shard, char **fields, int field_count) {
+    ShardLink *link = &worker->links[shard];
+    if (!shard_link_open(worker->router, link, shard)) {
+        shard_link_close(link);
+        return 0;
+    }
+    for (int i = 0; i < field_count; i++) {
+        if (i > 0) output_char(&link->out, '\t');
+        output_string(&link->out, fields[i]);
+    }
+    output_char(&link->out, '\n');
+    output_flush(&link->out);
+    if (!link->out.ok) {
+        shard_link_close(link);
+        return 0;
+    }
+    return 1;
+}
+
+// Receives each data line of a reply
+typedef void (*ReplyLine)(void *context, char *line);
+
+// Reads a shard's reply up to its status line, passing the data lines to
+// emit. Returns NULL for OK, else the error, copied to the worker unless
+// an earlier shard already failed the request.
+static const char* shard_reply(RouterWorker *worker, int shard, int sent, ReplyLine emit, void *context) {
+    ShardLink *link = &worker->links[shard];
+    char *line = NULL;
+    while (sent && (line = next_line(&link->reader)) != NULL) {
+        if (strcmp(line, "OK") == 0) {
+            return NULL;
+        }
+        if (strncmp(line, "ERR ", 4) == 0) {
+            break;
+        }
+        if (emit != NULL) emit(context, line);
+    }
+    
+    if (worker->error[0] == '\0') {
+        if (line != NULL) {
+            snprintf(worker->error, sizeof(worker->error), "%s", line + 4);
+        } else {
+            snprintf(worker->error, sizeof(worker->error), "shard %d is unavailable", shard);
+        }
+    }
+    if (line == NULL) {
+        shard_link_close(link); // Reconnect on the next request
+    }
+    return worker->error;
+}
+
+static const char* router_forward(RouterWorker *worker, int shard, char **fields, int field_count,
+                                  ReplyLine emit, void *context) {
+    worker->error[0] = '\0';
+    int sent = shard_send(worker, shard, fields, field_count);
+    return shard_reply(worker, shard, sent, emit, context);
+}
+
+// Sends the request to every shard before reading any reply, so the shards
+// work on it side by side. Replies are read in shard order; the first error
+// is the one returned.
+static const char* router_broadcast(RouterWorker *worker, char **fields, int field_count,
+                                    ReplyLine emit, void *context) {
+    int shard_count = worker->router->shard_count;
+    int sent[ROUTER_SHARDS_MAX];
+    const char *error = NULL;
+    
+    worker->error[0] = '\0';
+    for (int i = 0; i < shard_count; i++) {
+        sent[i] = shard_send(worker, i, fields, field_count);
+    }
+    for (int i = 0; i < shard_count; i++) {
+        const char *shard_error = shard_reply(worker, i, sent[i], emit, context);
+        if (error == NULL) error = shard_error;
+    }
+    return error;
+}
+
+static void relay_line(void *context, char *line) {
+    OutputBuffer *out = context;
+    output_string(out, line);
+    output_char(out, '\n');
+}
+
+// Registers a student on every shard. There is no way to take a student
+// back off a shard, so instead of undoing the shards that took it, the
+// shards that failed are sent it once more: registering a student twice
+// leaves one copy. A shard that fails again fails the request, and the
+// client can resend it as often as needed.
+static const char* router_student(RouterWorker *worker, OutputBuffer *out, char **fields, int field_count) {
+    int shard_count = worker->router->shard_count;
+    int sent[ROUTER_SHARDS_MAX];
+    int missing[ROUTER_SHARDS_MAX];
+    int missing_count = 0;
+    
+    worker->error[0] = '\0';
+    for (int i = 0; i < shard_count; i++) {
+        sent[i] = shard_send(worker, i, fields, field_count);
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (shard_reply(worker, i, sent[i], relay_line, out) != NULL) {
+            missing[missing_count++] = i;
+        }
+    }
+    if (missing_count == 0) {
+        return NULL;
+    }
+    
+    // A shard that dropped its connection is reached again on a new one
+    worker->error[0] = '\0';
+    for (int i = 0; i < missing_count; i++) {
+        sent[i] = shard_send(worker, missing[i], fields, field_count);
+    }
+    const char *error = NULL;
+    for (int i = 0; i < missing_count; i++) {
+        const char *shard_error = shard_reply(worker, missing[i], sent[i], relay_line, out);
+        if (error == NULL) error = shard_error;
+    }
+    return error;
+}
+
+static void count_line(void *context, char *line) {
+    (void)line;
+    (*(int *)context)++;
+}
+
+// Ranked hits from every shard; scores do not depend on the rest of the
+// catalog, so hits from different shards compare directly
+typedef struct {
+    char **lines;              // "score<TAB>book", in arrival order
+    int *scores;
+    int count;
+    int capacity;
+    int failed;                // Ran out of memory
+} HitMerge;
+
+static void collect_hit(void *context, char *line) {
+    HitMerge *merge = context;
+    if (merge->count == merge->capacity) {
+        int capacity = merge->capacity == 0 ? 64 : merge->capacity * 2;
+        char **lines = lib_realloc(merge->lines, sizeof(char*) * capacity);
+        if (lines != NULL) merge->lines = lines;
+        int *scores = lib_realloc(merge->scores, sizeof(int) * capacity);
+        if (scores != NULL) merge->scores = scores;
+        if (lines == NULL || scores == NULL) {
+            merge->failed = 1;
+            return;
+        }
+        merge->capacity = capacity;
+    }
+    char *copy = lib_strdup(line);
+    if (copy == NULL) {
+        merge->failed = 1;
+        return;
+    }
+    merge->scores[merge->count] = atoi(line);
+    merge->lines[merge->count++] = copy;
+}
+
+static const char* router_rank(RouterWorker *worker, OutputBuffer *out, char **fields, int field_count) {
+    HitMerge merge = { NULL, NULL, 0, 0, 0 };
+    const char *error = router_broadcast(worker, fields, field_count, collect_hit, &merge);
+    
+    // Best RANKED_RESULTS by score; equal scores keep shard order
+    int shown = 0;
+    for (; error == NULL && !merge.failed && shown < RANKED_RESULTS && shown < merge.count; shown++) {
+        int best = shown;
+        for (int i = shown + 1; i < merge.count; i++) {
+            if (merge.scores[i] > merge.scores[best]) best = i;
+        }
+        char *line = merge.lines[best];
+        int score = merge.scores[best];
+        memmove(&merge.lines[shown + 1], &merge.lines[shown], sizeof(char*) * (best - shown));
+        memmove(&merge.scores[shown + 1], &merge.scores[shown], sizeof(int) * (best - shown));
+        merge.lines[shown] = line;
+        merge.scores[shown] = score;
+        relay_line(out, line);
+    }
+    
+    for (int i = 0; i < merge.count; i++) {
+        lib_free(merge.lines[i]);
+    }
+    lib_free(merge.lines);
+    lib_free(merge.scores);
+    return error != NULL ? error : merge.failed ? "out of memory" : NULL;
+}
+
+// Completions from every shard, each list most used first
+typedef struct {
+    char *words[ROUTER_SHARDS_MAX][RANKED_RESULTS];
+    int counts[ROUTER_SHARDS_MAX];
+    int shard;                 // Shard whose reply is being read
+} WordMerge;
+
+static void collect_word(void *context, char *line) {
+    WordMerge *merge = context;
+    if (merge->counts[merge->shard] < RANKED_RESULTS) {
+        merge->words[merge->shard][merge->counts[merge->shard]++] = lib_strdup(line);
+    }
+}
+
+static const char* router_complete(RouterWorker *worker, OutputBuffer *out, char **fields, int field_count) {
+    Router *router = worker->router;
+    WordMerge *merge = lib_calloc(1, sizeof(WordMerge));
+    if (merge == NULL) {
+        return "out of memory";
+    }
+    
+    worker->error[0] = '\0';
+    int sent[ROUTER_SHARDS_MAX];
+    const char *error = NULL;
+    for (int i = 0; i < router->shard_count; i++) {
+        sent[i] = shard_send(worker, i, fields, field_count);
+    }
+    for (int i = 0; i < router->shard_count; i++) {
+        merge->shard = i;
+        const char *shard_error = shard_reply(worker, i, sent[i], collect_word, merge);
+        if (error == NULL) error = shard_error;
+    }
+    
+    // Shards hold similar mixes of books, so the lists are interleaved rank
+    // by rank and words seen on an earlier shard are skipped
+    const char *shown[RANKED_RESULTS];
+    int shown_count = 0;
+    for (int rank = 0; error == NULL && rank < RANKED_RESULTS && shown_count < RANKED_RESULTS; rank++) {
+        for (int i = 0; i < router->shard_count && shown_count < RANKED_RESULTS; i++) {
+            const char *word = rank < merge->counts[i] ? merge->words[i][rank] : NULL;
+            if (word == NULL) continue;
+            int seen = 0;
+            for (int j = 0; j < shown_count && !seen; j++) {
+                seen = strcmp(shown[j], word) == 0;
+            }
+            if (seen) continue;
+            shown[shown_count++] = word;
+            relay_line(out, (char *)word);
+        }
+    }
+    
+    for (int i = 0; i < router->shard_count; i++) {
+        for (int j = 0; j < merge->counts[i]; j++) {
+            lib_free(merge->words[i][j]);
+        }
+    }
+    lib_free(merge);
+    return error;
+}
+
+// Statistics added up over the shards. Students are on every shard, so
+// their count is any one shard's.
+typedef struct {
+    long long books, authors, total_pages, students, borrowed;
+    long long newest_year, oldest_year, min_pages, max_pages;
+    int has_years, has_pages;
+} StatsMerge;
+
+static void collect_stat(void *context, char *line) {
+    StatsMerge *merge = context;
+    char *tab = strchr(line, '\t');
+    if (tab == NULL) return;
+    *tab = '\0';
+    long long value = strtoll(tab + 1, NULL, 10);
+    
+    if (strcmp(line, "books") == 0) merge->books += value;
+    else if (strcmp(line, "authors") == 0) merge->authors += value;
+    else if (strcmp(line, "total_pages") == 0) merge->total_pages += value;
+    else if (strcmp(line, "students") == 0 && value > merge->students) merge->students = value;
+    else if (strcmp(line, "borrowed") == 0) merge->borrowed += value;
+    else if (strcmp(line, "newest_year") == 0) {
+        if (!merge->has_years || value > merge->newest_year) merge->newest_year = value;
+    } else if (strcmp(line, "oldest_year") == 0) {
+        if (!merge->has_years || value < merge->oldest_year) merge->oldest_year = value;
+        merge->has_years = 1;
+    } else if (strcmp(line, "min_pages") == 0) {
+        if (!merge->has_pages || value < merge->min_pages) merge->min_pages = value;
+    } else if (strcmp(line, "max_pages") == 0) {
+        if (!merge->has_pages || value > merge->max_pages) merge->max_pages = value;
+        merge->has_pages = 1;
+    }
+}
+
+// Same lines as a single server, except most_active: a student's loans are
+// spread over the shards and no shard sees the total
+static const char* router_stats(RouterWorker *worker, OutputBuffer *out, char **fields, int field_count) {
+    StatsMerge merge;
+    memset(&merge, 0, sizeof(merge));
+    const char *error = router_broadcast(worker, fields, field_count, collect_stat, &merge);
+    if (error != NULL) {
+        return error;
+    }
+    
+    server_write_stat(out, "books", merge.books);
+    server_write_stat(out, "authors", merge.authors);
+    server_write_stat(out, "average_pages", merge.books > 0 ? merge.total_pages / merge.books : 0);
+    server_write_stat(out, "total_pages", merge.total_pages);
+    if (merge.has_years) {
+        server_write_stat(out, "newest_year", merge.newest_year);
+        server_write_stat(out, "oldest_year", merge.oldest_year);
+    }
+    if (merge.has_pages) {
+        server_write_stat(out, "min_pages", merge.min_pages);
+        server_write_stat(out, "max_pages", merge.max_pages);
+    }
+    server_write_stat(out, "students", merge.students);
+    server_write_stat(out, "borrowed", merge.borrowed);
+    server_write_stat(out, "available", merge.books - merge.borrowed);
+    return NULL;
+}
+
+// Counts the student's loans on every shard, then borrows on the book's
+// shard, all under the student's lock so two borrows cannot both pass the
+// count
+static const char* router_borrow(RouterWorker *worker, char **fields, int field_count) {
+    Router *router = worker->router;
+    if (field_count != 3) return "usage: borrow|return<TAB>student<TAB>title";
+    
+    pthread_mutex_t *lock = &router->student_locks[case_folded_hash(fields[1]) % ROUTER_STUDENT_LOCKS];
+    pthread_mutex_lock(lock);
+    int loans = 0;
+    char *query[2] = { "loans", fields[1] };
+    const char *error = router_broadcast(worker, query, 2, count_line, &loans);
+    if (error == NULL && loans >= MAX_BOOKS) {
+        error = loan_error(LOAN_LIMIT_REACHED);
+    }
+    if (error == NULL) {
+        error = router_forward(worker, router_shard(router, fields[2]), fields, field_count, NULL, NULL);
+    }
+    pthread_mutex_unlock(lock);
+    return error;
+}
+
+static const char* router_command(void *context, OutputBuffer *out, char **fields, int field_count) {
+    RouterWorker *worker = context;
+    Router *router = worker->router;
+    const char *op = fields[0];
+    
+    if (strcmp(op, "borrow") == 0) {
+        return router_borrow(worker, fields, field_count);
+    }
+    if (strcmp(op, "book") == 0 || strcmp(op, "remove") == 0 || strcmp(op, "return") == 0) {
+        // A request missing its title goes to shard 0 for the usage message
+        int title = strcmp(op, "return") == 0 ? 2 : 1;
+        int shard = title < field_count ? router_shard(router, fields[title]) : 0;
+        return router_forward(worker, shard, fields, field_count, relay_line, out);
+    }
+    if (strcmp(op, "rank") == 0) {
+        return router_rank(worker, out, fields, field_count);
+    }
+    if (strcmp(op, "complete") == 0) {
+        return router_complete(worker, out, fields, field_count);
+    }
+    if (strcmp(op, "stats") == 0) {
+        return router_stats(worker, out, fields, field_count);
+    }
+    if (strcmp(op, "student") == 0) {
+        return router_student(worker, out, fields, field_count);
+    }
+    if (strcmp(op, "search") == 0 || strcmp(op, "list") == 0 ||
+        strcmp(op, "range") == 0 || strcmp(op, "loans") == 0 || strcmp(op, "metrics") == 0) {
+        return router_broadcast(worker, fields, field_count, relay_line, out);
+    }
+    
+    // Anything else is answered by a shard, which knows the right error
+    return router_forward(worker, 0, fields, field_count, relay_line, out);
+}
+
+static void* router_worker(void *arg) {
+    RouterWorker *worker = arg;
+    Router *router = worker->router;
+    
+    OutputBuffer out = { -1, lib_malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    worker->links = lib_calloc(router->shard_count, sizeof(ShardLink));
+    for (int i = 0; worker->links != NULL && i < router->shard_count; i++) {
+        worker->links[i].fd = -1;
+    }
+    
+    Connection *connection;
+    while ((connection = connection_queue_pop(&router->connections)) != NULL) {
+        int open = out.data != NULL && worker->links != NULL &&
+                   serve_connection(connection, &out, router_command, worker);
+        connection_queue_return(&router->connections, connection, open);
+    }
+    
+    for (int i = 0; worker->links != NULL && i < router->shard_count; i++) {
+        shard_link_close(&worker->links[i]);
+        lib_free(worker->links[i].reader.buffer);
+        lib_free(worker->links[i].out.data);
+    }
+    lib_free(worker->links);
+    lib_free(out.data);
+    return NULL;
+}
+
+// A catalog split one way cannot be read another way: titles would be
+// looked for on the wrong shard. The first start records the shard count.
+static int router_check_layout(const char *snapshot_path, int shard_count) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.shards", snapshot_path);
+    
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        int saved = 0;
+        int ok = fscanf(fp, "%d", &saved) == 1 && saved == shard_count;
+        fclose(fp);
+        if (!ok) {
+            fprintf(stderr, "shards: '%s' is split into %d shards, not %d\n", snapshot_path, saved, shard_count);
+        }
+        return ok;
+    }
+    
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "shards: cannot write '%s': %s\n", path, strerror(errno));
+        return 0;
+    }
+    fprintf(fp, "%d\n", shard_count);
+    return fclose(fp) == 0;
+}
+
+// Starts a shard as this same program in server mode. Everything the child
+// needs is prepared before the fork, which only execs.
+static pid_t spawn_shard(const char *program, int shard, int worker_count, const char *snapshot_path,
+                         const char *journal_path, const char *socket_path) {
+    char snapshot[4096], journal[4096], workers[16];
+    snprintf(snapshot, sizeof(snapshot), "%s.%d", snapshot_path, shard);
+    snprintf(journal, sizeof(journal), "%s.%d", journal_path, shard);
+    snprintf(workers, sizeof(workers), "%d", worker_count);
+    char *argv[] = { (char *)program, "--snapshot", snapshot, "--journal", journal,
+                     "--serve", (char *)socket_path, "--workers", workers, NULL };
+    
+    // The path we were started by keeps the shards' process name; a bare
+    // name was found on PATH, so fall back to our own executable
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (strchr(program, '/') != NULL) execv(program, argv);
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Waits until the shard accepts connections; 0 if it exited or we were stopped
+static int wait_for_shard(Router *router, int shard) {
+    while (!server_stop_requested) {
+        int fd = connect_socket(router->sockets[shard]);
+        if (fd >= 0) {
+            close(fd);
+            return 1;
+        }
+        if (waitpid(router->pids[shard], NULL, WNOHANG) == router->pids[shard]) {
+            router->pids[shard] = 0;
+            fprintf(stderr, "shards: shard %d exited during start-up\n", shard);
+            return 0;
+        }
+        poll(NULL, 0, ROUTER_START_MS);
+    }
+    return 0;
+}
+
+// Asks the shards to stop (they save their snapshots) and reaps them;
+// returns 1 if every one exited cleanly
+static int stop_shards(Router *router) {
+    int clean = 1;
+    for (int i = 0; i < router->shard_count; i++) {
+        if (router->pids[i] > 0) kill(router->pids[i], SIGTERM);
+    }
+    for (int i = 0; i < router->shard_count; i++) {
+        if (router->pids[i] <= 0) continue;
+        int status;
+        while (waitpid(router->pids[i], &status, 0) < 0 && errno == EINTR);
+        clean &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return clean;
+}
+
+int run_router(const char *socket_path, int shard_count, int worker_count, const char *program,
+               const char *snapshot_path, const char *journal_path) {
+    if (shard_count < 1 || shard_count > ROUTER_SHARDS_MAX) {
+        fprintf(stderr, "shards: between 1 and %d shards are supported\n", ROUTER_SHARDS_MAX);
+        return 0;
+    }
+    if (!router_check_layout(snapshot_path, shard_count)) {
+        return 0;
+    }
+    
+    Router *router = lib_calloc(1, sizeof(Router));
+    RouterWorker *workers = lib_calloc(worker_count, sizeof(RouterWorker));
+    pthread_t *threads = lib_malloc(sizeof(pthread_t) * worker_count);
+    if (router == NULL || workers == NULL || threads == NULL ||
+        (router->sockets = lib_malloc(sizeof(*router->sockets) * shard_count)) == NULL ||
+        (router->pids = lib_calloc(shard_count, sizeof(pid_t))) == NULL ||
+        !connection_queue_init(&router->connections)) {
+        fprintf(stderr, "shards: out of memory\n");
+        if (router != NULL) {
+            lib_free(router->sockets);
+            lib_free(router->pids);
+        }
+        lib_free(router);
+        lib_free(workers);
+        lib_free(threads);
+        return 0;
+    }
+    router->shard_count = shard_count;
+    for (int i = 0; i < ROUTER_STUDENT_LOCKS; i++) {
+        pthread_mutex_init(&router->student_locks[i], NULL);
+    }
+    catch_stop_signals();
+    
+    // Each shard gets as many workers as the router, see ShardLink
+    int ok = 1;
+    for (int i = 0; ok && i < shard_count; i++) {
+        int len = snprintf(router->sockets[i], sizeof(router->sockets[i]), "%s.%d", socket_path, i);
+        if (len < 0 || (size_t)len >= sizeof(router->sockets[i])) {
+            fprintf(stderr, "shards: socket path '%s' is too long\n", socket_path);
+            ok = 0;
+            break;
+        }
+        unlink(router->sockets[i]); // Only the new shard's socket counts as started
+        router->pids[i] = spawn_shard(program, i, worker_count, snapshot_path, journal_path, router->sockets[i]);
+        if (router->pids[i] < 0) {
+            fprintf(stderr, "shards: cannot start shard %d: %s\n", i, strerror(errno));
+            router->pids[i] = 0;
+            ok = 0;
+        }
+    }
+    for (int i = 0; ok && i < shard_count; i++) {
+        ok = wait_for_shard(router, i);
+    }
+    
+    int listen_fd = ok ? listen_on_socket(socket_path, "shards") : -1;
+    int started = 0;
+    for (int i = 0; listen_fd >= 0 && i < worker_count; i++) {
+        workers[i].router = router;
+        if (pthread_create(&threads[i], NULL, router_worker, &workers[i]) != 0) break;
+        started++;
+    }
+    if (listen_fd >= 0) {
+        fprintf(stderr, "shards: routing '%s' to %d shards with %d workers\n", socket_path, shard_count, started);
+    }
+    
+    long long served = 0;
+    while (started > 0 && !server_stop_requested) {
+        int accepted = connection_queue_poll(&router->connections, listen_fd, SERVER_IDLE_MS);
+    
+        // A shard that dies takes its books offline; requests for them fail
+        // until the router is restarted
+        for (int i = 0; i < shard_count; i++) {
+            if (router->pids[i] > 0 && waitpid(router->pids[i], NULL, WNOHANG) == router->pids[i]) {
+                router->pids[i] = 0;
+                fprintf(stderr, "shards: shard %d exited\n", i);
+                ok = 0;
+            }
+        }
+        if (accepted > 0) {
+            served += accepted;
+        }
+    }
+    
+    connection_queue_stop(&router->connections);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path);
+        fprintf(stderr, "shards: stopped after %lld connections\n", served);
+    }
+    ok = stop_shards(router) && ok && started > 0;
+    
+    for (int i = 0; i < ROUTER_STUDENT_LOCKS; i++) {
+        pthread_mutex_destroy(&router->student_locks[i]);
+    }
+    connection_queue_destroy(&router->connections);
+    lib_free(router->sockets);
+    lib_free(router->pids);
+    lib_free(router);
+    lib_free(workers);
+    lib_free(threads);
+    return ok;
+}
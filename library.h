@@ -0,0 +1,551 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Engine of the library system: the catalog, students and loans, their
+// indexes and persistence, plus the batch, CSV and server front ends.
+// Nothing in here prompts; the interactive menu in library_system.c is
+// one client, library_bench.c another.
+
+// Books are packed so tens of millions fit in memory: strings are 32-bit
+// offsets into the library's string pool (read them with book_title() and
+// book_author()), and each number has the narrowest type its range needs.
+// A single author, the common case, is stored inline instead of in an array.
+typedef uint32_t StringRef;    // Byte offset of a string in its pool
+
+#define BOOK_YEAR_MIN    INT16_MIN
+#define BOOK_YEAR_MAX    INT16_MAX
+#define BOOK_PAGES_MAX   UINT16_MAX
+#define BOOK_AUTHORS_MAX UINT8_MAX
+
+typedef struct {
+    StringRef title;
+    StringRef authors;     // The author's name if author_count is 1, else an
+                           // array of author_count names in the pool
+    int borrower;          // Position of the borrowing student (-1 if available)
+    int slot;              // Stable slot in the library's slot map
+    int16_t year;
+    uint16_t pages;
+    uint8_t author_count;
+    uint8_t is_available;  // 1 if available, 0 if borrowed
+} Book;
+
+// Books are kept densely packed and removal moves the last book into the
+// hole, so array positions change. Each book also owns a slot that never
+// moves while it lives; the indexes and handles refer to books by slot.
+typedef struct {
+    int position;          // Array position of the book, next free slot if released
+    unsigned int generation; // Bumped every time the slot is released
+} BookSlot;
+
+// Reference to a book that survives removals of other books. A handle to a
+// removed book stops resolving, even once its slot is reused.
+typedef struct {
+    int slot;
+    unsigned int generation;
+} BookHandle;
+
+#define MAX_BOOKS 3        // Loans a student can hold at once
+
+// A loan is a pair of links: the book records the student's position and the
+// student records the book's slot. Neither side copies or compares names.
+typedef struct {
+    int student_id;
+    StringRef name;        // In the student pool, read it with student_name()
+    int borrowed_books[MAX_BOOKS]; // Slots of the borrowed books
+    uint8_t borrowed_count;
+    uint8_t max_books;     // Maximum books this student can borrow (default 3)
+} Student;
+
+// Interned strings (and small arrays) in one reserved address range. The
+// range never moves, so a StringRef and a pointer into the pool both stay
+// valid; pages are only backed once written. Offset 0 holds the empty
+// string. Nothing is freed on its own: the pool lives until the owning
+// Library/StudentSystem is destroyed.
+#define STRING_POOL_RESERVE     ((size_t)1 << 32)  // All a StringRef can address
+#define STRING_POOL_MIN_RESERVE ((size_t)1 << 26)  // Smallest range tried if address space is short
+
+typedef struct {
+    char *base;
+    size_t used;           // Bytes handed out
+    size_t reserved;       // Size of the range
+    StringRef *strings;    // Open-addressing table of interned strings (0 = empty)
+    unsigned int *hashes;  // Cached hash for each slot
+    int capacity;          // Number of slots (always a power of two)
+    int count;             // Interned strings
+} StringPool;
+
+static inline char* string_pool_at(const StringPool *pool, StringRef ref) {
+    return pool->base + ref;
+}
+
+static inline StringRef string_pool_ref(const StringPool *pool, const void *pointer) {
+    return (StringRef)((const char *)pointer - pool->base);
+}
+
+// Open-addressing hash index from a case-folded name to an entry number
+// (a book slot or a student position). Slots hold the entry number (or one
+// of the markers below) and the
+// cached hash, so growing the table never has to touch the strings again.
+#define INDEX_EMPTY   -1
+#define INDEX_DELETED -2
+
+typedef struct {
+    int *positions;        // Entry number stored in each slot
+    unsigned int *hashes;  // Case-folded hash of the key in each slot
+    int capacity;          // Number of slots (always a power of two)
+    int used;              // Live + deleted slots, drives resizing
+    int live;              // Live entries, decides between purging and doubling
+} NameIndex;
+
+// Inverted index from every case-folded 3-byte substring (trigram) of the
+// titles and authors to the sorted list of book slots containing it.
+// A substring query can only match books present in the posting list of
+// each of its trigrams, so search only verifies the intersection.
+#define TRIGRAM_EMPTY 0xFFFFFFFFu
+
+typedef struct {
+    unsigned int trigram;  // Three folded bytes packed into 24 bits
+    int *books;            // Sorted book slots containing the trigram
+    int count;
+    int capacity;
+    int dead;              // Removed entries still in books (sign bit set)
+} Posting;
+
+typedef struct {
+    Posting *postings;     // Open-addressing table keyed by trigram
+    int capacity;          // Number of slots (always a power of two)
+    int used;              // Occupied slots
+} TrigramIndex;
+
+// Dictionary of the case-folded words of titles and authors, for ranked
+// search. Each word lists the books it appears in as sorted entries
+// (slot << 1 | 1 if the word is in an author name). The words also form a
+// BK-tree by edit distance for typo-tolerant lookups, and a sorted array of
+// them answers prefix queries. Both catch up with new words at the next
+// ranked search.
+#define INDEXED_WORD_MAX 48 // Longer words are cut and matched on their start
+
+typedef struct {
+    char *text;            // Case-folded, in the index's string pool
+    unsigned int hash;
+    int *entries;          // Sorted slot << 1 | in_author
+    int count;             // Entries, dead ones included
+    int capacity;
+    int dead;              // Removed entries still in entries (sign bit set);
+                           // count == dead once every book with the word is gone
+    int bk_child;          // First child in the BK-tree, -1 if none
+    int bk_sibling;        // Next child of the same parent, -1 if none
+    int bk_distance;       // Edit distance to the parent
+} Word;
+
+typedef struct {
+    Word *words;           // Word ids never change; words are only appended
+    int word_count;
+    int word_capacity;
+    int *table;            // Open addressing from hash to word id, -1 if empty
+    int table_capacity;    // Always a power of two
+    int *sorted;           // Word ids in byte order of their text
+    int sorted_count;      // Words merged into sorted and the tree so far
+    pthread_mutex_t sort_lock; // Concurrent readers (server) may catch up
+    StringPool strings;
+} WordIndex;
+
+// Ordered multimap from an integer key (such as a book's year) to book slots.
+// Entries sit in sorted buckets of bounded size, so an insert or removal only
+// moves entries within one bucket and the smallest and largest keys are the
+// ends of the first and last bucket.
+#define INT_INDEX_BUCKET 256
+
+typedef struct {
+    int key;
+    int slot;
+} IntEntry;
+
+typedef struct {
+    IntEntry *entries;     // Sorted by key, then slot
+    int count;
+} IntBucket;
+
+typedef struct {
+    IntBucket *buckets;    // Non-empty buckets in key order
+    int bucket_count;
+    int bucket_capacity;
+    int count;             // Entries across all buckets
+} IntIndex;
+
+// Max-heap of student positions ordered by borrowed_count (lower position
+// first on ties). where[] tracks each student's heap index so a loan change
+// only sifts that one student.
+typedef struct {
+    int *heap;
+    int *where;
+    int count;
+    int capacity;
+} ActivityHeap;
+
+// Loans as they stood at one moment, for long reports that run while loans
+// continue on other threads. Once a view is open, each loan first saves the
+// book's old borrower into every open view, so the view keeps answering
+// with the state it was opened on; only the books loans touch are copied.
+// Books must not be added or removed while a view is open.
+typedef struct LoanView {
+    int *slots;                // Open addressing by book slot, -1 if empty
+    int *borrowers;            // Borrower of each saved book when the view opened
+    int capacity;              // Always a power of two, 0 until a loan saves a book
+    int count;
+    pthread_mutex_t lock;      // Guards the saved books from loans saving more
+    struct LoanView *next;
+} LoanView;
+
+// Change log of the catalog, see library.c for the record format
+#define DEFAULT_JOURNAL_PATH "library.wal"
+
+// Record types, also the type argument of journal_log_position()
+enum {
+    JOURNAL_ADD_BOOK = 1,
+    JOURNAL_REMOVE_BOOK,
+    JOURNAL_ADD_STUDENT,
+    JOURNAL_BORROW,
+    JOURNAL_RETURN
+};
+
+typedef struct Journal Journal;
+
+// Indexes an insert could not enter because they were full. The entry is
+// still added and the front end decides whether to warn; lookups then fall
+// back to slower paths or miss it, as each flag says.
+#define MISSED_TITLE_INDEX  0x01   // Found by fuzzy title search only
+#define MISSED_SEARCH_INDEX 0x02   // Substring searches may miss it
+#define MISSED_WORD_INDEX   0x04   // Ranked search may miss it
+#define MISSED_YEAR_INDEX   0x08   // Newest/oldest may skip it
+#define MISSED_PAGE_INDEX   0x10   // Page ranges may skip it
+#define MISSED_NAME_INDEX   0x20   // Student found by fuzzy search only
+
+// Copies of the scalar book fields that scans read, one array per field in
+// the same order as Library::books. A scan over years and pages streams 4
+// bytes per book instead of pulling whole books through the cache, and
+// availability is one bit per book. Loans flip bits with atomic operations,
+// since server workers lend books that share a bitmap word.
+typedef struct {
+    int16_t *years;
+    uint16_t *pages;
+    uint8_t *author_counts;
+    uint64_t *available;   // Bit i set if books[i] is on the shelf; bits past
+                           // book_count are always clear
+} BookColumns;
+
+typedef struct {
+    Book *books;           // Dynamic array of books
+    int book_count;
+    int capacity;          // Current array capacity
+    BookColumns columns;   // Scan-friendly copies of books[] fields
+    BookSlot *slots;       // Slot map from stable book slots to positions
+    int slot_count;        // Slots handed out so far (live + free)
+    int slot_capacity;
+    int free_slot;         // Head of the released slot list, -1 if none
+    NameIndex title_index; // Exact title lookups
+    TrigramIndex text_index; // Substring search over titles and authors
+    WordIndex word_index;  // Ranked, prefix and typo-tolerant search
+    IntIndex year_index;   // Books ordered by year, for newest/oldest and ranges
+    IntIndex page_index;   // Books ordered by page count
+    int bulk_start;        // First book a bulk load has not indexed yet, -1 if none
+    long long author_total; // Running aggregates kept by the core operations
+    long long page_total;
+    int borrowed_total;
+    int missed_indexes;    // MISSED_* bits of the last insert
+    Journal *journal;      // Change log, NULL while replaying or when disabled
+    StringPool strings;    // Titles, author names and author arrays
+} Library;
+
+typedef struct {
+    Student *students;     // Dynamic array of students
+    int student_count;
+    int student_capacity;
+    NameIndex name_index;  // Exact student name lookups
+    ActivityHeap activity; // Most active student first
+    pthread_mutex_t loan_lock; // Guards loan lists, the activity heap,
+                               // lib->borrowed_total and the open views
+                               // while loans run concurrently
+    LoanView *views;           // Open loan views, NULL if none
+    int missed_indexes;    // MISSED_NAME_INDEX if the last insert missed it
+    Journal *journal;      // Change log, NULL while replaying or when disabled
+    StringPool strings;    // Student names
+} StudentSystem;
+
+#define DEFAULT_SNAPSHOT_PATH "library.snap"
+
+// What a loaded snapshot leaves behind once its string pools have been
+// mapped into the library's and the student system's pools
+typedef struct {
+    uint64_t journal_seq;      // Journal records up to here are already applied
+} Snapshot;
+
+// One result of a ranked search
+#define RANKED_RESULTS 20  // Hits shown by the menu and the server
+
+typedef struct {
+    Book *book;
+    int score;
+} SearchHit;
+
+// Filter for library_range_books(). Bounds are inclusive; INT_MIN and
+// INT_MAX leave a side open.
+#define RANGE_ANY       0
+#define RANGE_AVAILABLE 1
+#define RANGE_BORROWED  2
+
+typedef struct {
+    int year_min, year_max;
+    int pages_min, pages_max;
+    int availability;      // RANGE_ANY, RANGE_AVAILABLE or RANGE_BORROWED
+} BookRange;
+
+// Output is staged in a large buffer and handed to write() a chunk at a time.
+// With fd -1 nothing is written: the buffer grows to hold all the output
+// until an fd is set and it is flushed.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    int ok;                // Cleared by the first failed write or growth
+    size_t size;           // Capacity of data, OUTPUT_BUFFER_SIZE unless it grew
+} OutputBuffer;
+
+// Read-only summary of the catalog, filled from the running totals and indexes
+typedef struct {
+    int book_count;
+    long long author_total;
+    long long average_pages;
+    const Book *newest;        // NULL when the catalog is empty
+    const Book *oldest;
+    const Book *shortest;      // Fewest and most pages, NULL when empty
+    const Book *longest;
+    int student_count;
+    int borrowed_total;
+    const Student *most_active; // NULL when there are no students
+    int most_active_loans;     // Its borrowed_count when the stats were taken
+} LibraryStats;
+
+// Book currently living in a slot; slots held by the indexes and by loans
+// are released before their book goes away, so they are always live
+static inline Book* library_book_in_slot(Library *lib, int slot) {
+    return &lib->books[lib->slots[slot].position];
+}
+
+static inline const char* book_title(const Library *lib, const Book *book) {
+    return string_pool_at(&lib->strings, book->title);
+}
+
+static inline const char* book_author(const Library *lib, const Book *book, int i) {
+    if (book->author_count == 1) {
+        return string_pool_at(&lib->strings, book->authors);
+    }
+    return string_pool_at(&lib->strings, ((const StringRef *)string_pool_at(&lib->strings, book->authors))[i]);
+}
+
+static inline const char* student_name(const StudentSystem *sys, const Student *student) {
+    return string_pool_at(&sys->strings, student->name);
+}
+
+// Bytes held by a Library or StudentSystem, part by part. Counted from what
+// is allocated (array capacities, pool bytes in use), not what is live, and
+// without the allocator's own overhead.
+typedef struct {
+    size_t records;        // Book or student array
+    size_t slots;          // Slot map and scan columns (books only)
+    size_t strings;        // String pool bytes in use
+    size_t string_table;   // Intern table of the string pool
+    size_t name_index;     // Title or student name index
+    size_t text_index;     // Trigram postings (books only)
+    size_t word_index;     // Ranked-search dictionary and postings (books only)
+    size_t ordered_index;  // Year and page indexes (books only)
+    size_t activity;       // Most-active heap (students only)
+    size_t total;
+} MemoryUsage;
+
+/* ================ FUNCTION DECLARATIONS ================== */
+
+// Library Functions
+Library* create_library(int initial_capacity);
+void destroy_library(Library *lib);
+
+// Helper Functions
+void cleanup_book(Book *book);
+int case_insensitive_search(const char *haystack, const char *needle);
+int parse_int(const char *text, int *value);
+int parse_bounds(char *text, int *low, int *high);
+
+// Hash Index Functions
+unsigned int case_folded_hash(const char *str);
+int case_insensitive_equals(const char *a, const char *b);
+int name_index_init(NameIndex *index, int expected_entries);
+void name_index_free(NameIndex *index);
+int name_index_insert(NameIndex *index, const char *key, int position);
+void name_index_remove(NameIndex *index, const char *key, int position);
+int name_index_reserve(NameIndex *index, int expected_entries);
+
+// String Pool Functions
+int string_pool_init(StringPool *pool);
+void string_pool_free(StringPool *pool);
+void* string_pool_alloc(StringPool *pool, size_t size);
+char* string_pool_intern(StringPool *pool, const char *str);
+int string_pool_load(StringPool *pool, int fd, uint64_t offset, const char *image, size_t size, size_t text_size);
+
+// Trigram Index Functions
+int trigram_index_init(TrigramIndex *index);
+void trigram_index_free(TrigramIndex *index);
+int trigram_index_add_book(TrigramIndex *index, const Library *lib, const Book *book, int position);
+void trigram_index_remove_book(TrigramIndex *index, const Library *lib, const Book *book, int position);
+int trigram_index_candidates(TrigramIndex *index, const char *term, int **candidates, int *candidate_count);
+
+// Word Index Functions
+int word_index_init(WordIndex *index);
+void word_index_free(WordIndex *index);
+int word_index_add_book(WordIndex *index, const Library *lib, const Book *book, int slot);
+void word_index_remove_book(WordIndex *index, const Library *lib, const Book *book, int slot);
+
+// Book Column Functions
+int book_columns_init(BookColumns *columns, int capacity);
+void book_columns_free(BookColumns *columns);
+int book_columns_resize(BookColumns *columns, int old_capacity, int new_capacity);
+void book_columns_store(BookColumns *columns, int position, const Book *book);
+void book_columns_move(BookColumns *columns, int to, int from);
+void book_columns_set_available(BookColumns *columns, int position, int available);
+
+// Ordered Index Functions
+int int_index_init(IntIndex *index);
+void int_index_free(IntIndex *index);
+int int_index_insert(IntIndex *index, int key, int slot);
+void int_index_remove(IntIndex *index, int key, int slot);
+const IntEntry* int_index_first(const IntIndex *index);
+const IntEntry* int_index_last(const IntIndex *index);
+int int_index_count_range(const IntIndex *index, int low, int high);
+int int_index_range(const IntIndex *index, int low, int high, int **slots);
+
+// Running Statistics Functions
+int activity_heap_init(ActivityHeap *heap, int capacity);
+void activity_heap_free(ActivityHeap *heap);
+int activity_heap_reserve(ActivityHeap *heap, int capacity);
+void activity_heap_push(StudentSystem *sys, int position);
+void activity_heap_update(StudentSystem *sys, int position);
+void activity_heap_rebuild(StudentSystem *sys);
+
+// Parallel Scan Functions
+#define PARALLEL_SCAN_MIN_ITEMS 16384  // Smaller scans are not worth waking threads for
+#define SCAN_MAX_THREADS        64
+typedef void (*ScanFunction)(void *context, int begin, int end, int chunk);
+int parallel_scan_chunks(int item_count);
+void parallel_scan(int item_count, int chunk_count, ScanFunction function, void *context);
+int collect_matching_books(Library *lib, const int *slots, int count, const char *term, Book ***matches);
+int parallel_find_first(const StringPool *pool, const StringRef *names, size_t stride, int count, const char *needle);
+
+// Core Operations (no prompts; shared by the menu and journal replay)
+#define LIBRARY_MIN_CAPACITY 16   // Shrinking never goes below this
+#define LOAN_OK             1
+#define LOAN_FAILED         0
+#define LOAN_NOT_AVAILABLE -1
+#define LOAN_LIMIT_REACHED -2
+#define LOAN_NOT_BORROWED  -3
+#define LOAN_WRONG_STUDENT -4
+
+int library_reserve(Library *lib, int min_capacity);
+void library_shrink_to_fit(Library *lib);
+const char* library_check_book(int year, int pages, int author_count);
+int library_insert_book(Library *lib, const char *title, const char **authors, int author_count, int year, int pages);
+int library_delete_book(Library *lib, StudentSystem *sys, int position);
+BookHandle library_book_handle(const Library *lib, const Book *book);
+Book* library_resolve_book(Library *lib, BookHandle handle);
+int library_find_books(Library *lib, const char *term, Book ***matches);
+void library_stats(Library *lib, StudentSystem *sys, LibraryStats *stats);
+void library_memory_usage(const Library *lib, MemoryUsage *usage);
+void student_system_memory_usage(const StudentSystem *sys, MemoryUsage *usage);
+int library_rank_books(Library *lib, const char *query, int limit, SearchHit *hits);
+int library_complete_word(Library *lib, const char *prefix, int limit, const char **words);
+void book_range_init(BookRange *range);
+int library_range_books(Library *lib, const BookRange *range, Book ***matches);
+int student_system_reserve(StudentSystem *sys, int min_capacity);
+int student_system_insert(StudentSystem *sys, int student_id, const char *name);
+int lend_book(Library *lib, StudentSystem *sys, Book *book, Student *student);
+int receive_book(Library *lib, StudentSystem *sys, Book *book, Student *student);
+
+// Loan View Functions (the caller keeps the book's loan from changing while
+// it reads, as for lend_book())
+LoanView* loan_view_open(StudentSystem *sys);
+void loan_view_close(StudentSystem *sys, LoanView *view);
+int loan_view_borrower(LoanView *view, const Book *book);
+
+// Bulk Load Functions (books inserted in between are indexed by the finish;
+// until then only inserts and loans may run)
+void library_bulk_begin(Library *lib);
+int library_bulk_finish(Library *lib);
+
+// Student Functions
+StudentSystem* create_student_system(int initial_capacity);
+void destroy_student_system(StudentSystem *sys);
+void cleanup_student(Student *student);
+Student* find_student_by_name(StudentSystem *sys, const char *name);
+Book* find_book_by_title(Library *lib, const char *title);
+Student* find_student_by_name_fuzzy(StudentSystem *sys, const char *name);
+Book* find_book_by_title_fuzzy(Library *lib, const char *title);
+
+// Snapshot Persistence Functions
+int save_snapshot(const char *path, Library *lib, StudentSystem *sys, uint64_t journal_seq);
+int load_snapshot(const char *path, Library **lib, StudentSystem **sys, Snapshot **snapshot);
+void release_snapshot(Snapshot *snapshot);
+
+// Journal Functions
+Journal* open_journal(const char *path, Library *lib, StudentSystem *sys, uint64_t snapshot_seq, int *replayed);
+int journal_log_add_book(Journal *journal, const Library *lib, const Book *book);
+int journal_log_add_student(Journal *journal, int student_id, const char *name);
+int journal_log_position(Journal *journal, int type, int book_position, int student_position);
+int journal_sync(Journal *journal);
+int journal_needs_compaction(Journal *journal);
+int compact_journal(Journal *journal, const char *snapshot_path, Library *lib, StudentSystem *sys);
+void close_journal(Journal *journal);
+
+// Batch Mode Functions
+int run_batch(const char *path, Library *lib, StudentSystem *sys, const char *snapshot_path);
+
+// CSV/TSV Import and Export Functions
+int import_catalog(const char *path, Library *lib, StudentSystem *sys, const char *snapshot_path);
+int export_catalog(const char *path, Library *lib, StudentSystem *sys);
+
+// Output Buffer Functions
+void output_flush(OutputBuffer *out);
+void output_bytes(OutputBuffer *out, const char *bytes, size_t len);
+void output_char(OutputBuffer *out, char c);
+void output_string(OutputBuffer *out, const char *text);
+void output_int(OutputBuffer *out, long long value);
+void output_field(OutputBuffer *out, const char *text, char delimiter);
+
+// Latency Histogram Functions. Log-linear buckets: 16 per power of two, so a
+// quantile read back is within about 6% of the exact value.
+#define HISTOGRAM_SUB_BITS    4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS     ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_limit(int bucket);
+uint64_t histogram_quantile(const uint64_t *buckets, uint64_t total, double q, uint64_t max);
+
+// Instrumentation Functions. Building with -DLIBRARY_NO_METRICS compiles the
+// timers, counters and these functions out entirely.
+#define METRICS_TEXT 0
+#define METRICS_JSON 1
+#ifndef LIBRARY_NO_METRICS
+void metrics_report(OutputBuffer *out, int format);
+int metrics_watch_signals(void);
+#endif
+
+// Server Mode Functions
+int run_server(const char *socket_path, int worker_count, Library *lib, StudentSystem *sys, const char *snapshot_path);
+int run_router(const char *socket_path, int shard_count, int worker_count, const char *program,
+               const char *snapshot_path, const char *journal_path);
+
+#endif
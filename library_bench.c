@@ -0,0 +1,476 @@
+// Benchmark for the catalog operations. Builds a synthetic catalog, drives
+// the same core operations the menu uses (without the prompts) and prints
+// the results as JSON, so runs can be compared across changes.
+//
+//   gcc -O2 -o library_bench library_bench.c library.c -pthread -lm
+//   ./library_bench --books 1000000 --seed 42 > results.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "library.h"
+
+/* ================== LATENCY HISTOGRAM ==================== */
+
+// Samples go into the engine's log-linear histogram (library.h), so the
+// percentiles here and in the metrics report are read the same way
+typedef struct {
+    const char *name;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t max_ns;
+    long long samples;
+    long long succeeded;       // Operations that returned success
+    double seconds;            // Sum of all sample times
+} Latency;
+
+static void latency_record(Latency *latency, uint64_t ns, int ok) {
+    latency->counts[histogram_bucket(ns)]++;
+    if (ns > latency->max_ns) {
+        latency->max_ns = ns;
+    }
+    latency->samples++;
+    latency->succeeded += ok != 0;
+    latency->seconds += ns / 1e9;
+}
+
+static double latency_percentile(const Latency *latency, double fraction) {
+    if (latency->samples == 0) {
+        return 0;
+    }
+    return (double)histogram_quantile(latency->counts, (uint64_t)latency->samples, fraction, latency->max_ns);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* ================== SYNTHETIC CATALOG ==================== */
+
+// xorshift64*: fast, and the same seed gives the same catalog everywhere
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int rng_below(int limit) {
+    return (int)(rng_next() % (uint64_t)limit);
+}
+
+static double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipf distribution over n ranks: a few words and authors are very common,
+// most are rare, as in real catalogs
+typedef struct {
+    double *cdf;
+    int count;
+} Zipf;
+
+static int zipf_init(Zipf *zipf, int count, double exponent) {
+    zipf->cdf = malloc(sizeof(double) * count);
+    if (zipf->cdf == NULL) {
+        return 0;
+    }
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += 1.0 / pow(i + 1, exponent);
+        zipf->cdf[i] = total;
+    }
+    for (int i = 0; i < count; i++) {
+        zipf->cdf[i] /= total;
+    }
+    zipf->count = count;
+    return 1;
+}
+
+static int zipf_pick(const Zipf *zipf) {
+    double u = rng_unit();
+    int low = 0, high = zipf->count - 1;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (zipf->cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static const char *syllables[] = {
+    "an", "ar", "bel", "bra", "cal", "cor", "da", "del", "en", "er", "fal", "gar",
+    "hel", "in", "ka", "lin", "lo", "mar", "mor", "na", "nor", "ol", "pa", "ran",
+    "ri", "sa", "sel", "ta", "tor", "ul", "va", "wen", "yor", "zen"
+};
+#define SYLLABLE_COUNT ((int)(sizeof(syllables) / sizeof(syllables[0])))
+
+static const char *first_names[] = {
+    "Ada", "Alan", "Anna", "Carlos", "Chen", "Clara", "David", "Elena", "Emma",
+    "Farah", "George", "Hana", "Ivan", "James", "Julia", "Kenji", "Laura", "Leo",
+    "Maria", "Marco", "Nadia", "Omar", "Paul", "Priya", "Rosa", "Sam", "Sofia",
+    "Tom", "Vera", "Yuki"
+};
+#define FIRST_NAME_COUNT ((int)(sizeof(first_names) / sizeof(first_names[0])))
+
+#define VOCABULARY_SIZE 4096
+#define WORD_MAX        24
+
+typedef struct {
+    char (*words)[WORD_MAX];   // Title words, most common first
+    char (*authors)[64];       // "First Surname", most prolific first
+    int author_count;
+    Zipf word_ranks;
+    Zipf author_ranks;
+} Corpus;
+
+static void make_word(char *out, int capitalize) {
+    int parts = 2 + rng_below(3);
+    out[0] = '\0';
+    for (int i = 0; i < parts; i++) {
+        strcat(out, syllables[rng_below(SYLLABLE_COUNT)]);
+    }
+    if (capitalize) {
+        out[0] = (char)toupper((unsigned char)out[0]);
+    }
+}
+
+static int corpus_init(Corpus *corpus, int book_count) {
+    corpus->author_count = book_count / 8 > 100 ? book_count / 8 : 100;
+    corpus->words = malloc(sizeof(*corpus->words) * VOCABULARY_SIZE);
+    corpus->authors = malloc(sizeof(*corpus->authors) * corpus->author_count);
+    if (corpus->words == NULL || corpus->authors == NULL ||
+        !zipf_init(&corpus->word_ranks, VOCABULARY_SIZE, 1.0) ||
+        !zipf_init(&corpus->author_ranks, corpus->author_count, 0.8)) {
+        return 0;
+    }
+
+    for (int i = 0; i < VOCABULARY_SIZE; i++) {
+        make_word(corpus->words[i], 1);
+    }
+    for (int i = 0; i < corpus->author_count; i++) {
+        char surname[WORD_MAX];
+        make_word(surname, 1);
+        snprintf(corpus->authors[i], sizeof(corpus->authors[i]), "%s %s",
+                 first_names[rng_below(FIRST_NAME_COUNT)], surname);
+    }
+    return 1;
+}
+
+static void corpus_free(Corpus *corpus) {
+    free(corpus->words);
+    free(corpus->authors);
+    free(corpus->word_ranks.cdf);
+    free(corpus->author_ranks.cdf);
+}
+
+// Titles of one to six Zipf-chosen words; mostly one author, some two or three
+static void make_book(const Corpus *corpus, char *title, size_t title_size,
+                      const char **authors, int *author_count, int *year, int *pages) {
+    int words = 1 + rng_below(6);
+    size_t used = 0;
+    title[0] = '\0';
+    for (int i = 0; i < words && used + WORD_MAX + 1 < title_size; i++) {
+        used += snprintf(title + used, title_size - used, "%s%s", i ? " " : "",
+                         corpus->words[zipf_pick(&corpus->word_ranks)]);
+    }
+
+    int roll = rng_below(100);
+    *author_count = roll < 75 ? 1 : roll < 95 ? 2 : 3;
+    for (int i = 0; i < *author_count; i++) {
+        authors[i] = corpus->authors[zipf_pick(&corpus->author_ranks)];
+    }
+
+    // Recent years are the most common; page counts cluster around 300
+    int age = (int)(-40.0 * log(1.0 - rng_unit()));
+    *year = 2024 - (age < 500 ? age : 500);
+    int spread = 0;
+    for (int i = 0; i < 4; i++) {
+        spread += rng_below(200);
+    }
+    *pages = spread - 80 > 20 ? spread - 80 : 20;
+}
+
+// A search term in the mix users type: title words, author names, and
+// short fragments that are too short for the trigram index
+static void make_search_term(const Corpus *corpus, char *term, size_t term_size) {
+    int roll = rng_below(10);
+    if (roll < 4) {
+        snprintf(term, term_size, "%s", corpus->words[zipf_pick(&corpus->word_ranks)]);
+    } else if (roll < 8) {
+        const char *author = corpus->authors[zipf_pick(&corpus->author_ranks)];
+        snprintf(term, term_size, "%s", strchr(author, ' ') + 1);
+    } else {
+        const char *word = corpus->words[rng_below(VOCABULARY_SIZE)];
+        snprintf(term, term_size, "%.2s", word + rng_below((int)strlen(word) - 1));
+    }
+}
+
+// A year and page window like a reader would ask for: a decade or two,
+// sometimes with a page limit, sometimes only what is on the shelf
+static void make_range(BookRange *range) {
+    book_range_init(range);
+    if (rng_below(4) != 0) {
+        range->year_max = 2024 - rng_below(100);
+        range->year_min = range->year_max - 1 - rng_below(20);
+    }
+    int roll = rng_below(3);
+    if (roll == 0) {
+        range->pages_max = 100 + rng_below(200);
+    } else if (roll == 1) {
+        range->pages_min = 300 + rng_below(400);
+    }
+    range->availability = rng_below(3) == 0 ? RANGE_AVAILABLE : RANGE_ANY;
+}
+
+/* ================== BENCHMARK ==================== */
+
+typedef struct {
+    int books;
+    int students;
+    int searches;
+    int loans;
+    int removes;
+    uint64_t seed;
+    int bulk;                  // Build through library_bulk_begin()/finish()
+} BenchConfig;
+
+static void print_latency(const Latency *latency, int last) {
+    double rate = latency->seconds > 0 ? latency->samples / latency->seconds : 0;
+    printf("    \"%s\": {\"count\": %lld, \"succeeded\": %lld, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f}%s\n",
+           latency->name, latency->samples, latency->succeeded, latency->seconds, rate,
+           latency_percentile(latency, 0.50) / 1e3, latency_percentile(latency, 0.99) / 1e3,
+           last ? "" : ",");
+}
+
+static int run_benchmark(const BenchConfig *config) {
+    static Latency add = { .name = "add_book" }, search = { .name = "search_books" },
+                   borrow = { .name = "borrow_book" }, give_back = { .name = "return_book" },
+                   removal = { .name = "remove_book" }, ranked = { .name = "rank_books" },
+                   ranges = { .name = "range_books" };
+    Corpus corpus;
+    rng_state = config->seed ? config->seed : 1;
+    if (!corpus_init(&corpus, config->books)) {
+        fprintf(stderr, "❌ Memory allocation failed\n");
+        return 0;
+    }
+
+    Library *lib = create_library(LIBRARY_MIN_CAPACITY);
+    StudentSystem *sys = create_student_system(LIBRARY_MIN_CAPACITY);
+    if (lib == NULL || sys == NULL) {
+        fprintf(stderr, "❌ Memory allocation failed\n");
+        return 0;
+    }
+
+    // Build the catalog one book at a time, the way add_book() does, or as
+    // a bulk load whose index build counts toward the build time
+    char title[160];
+    const char *authors[3];
+    int author_count, year, pages;
+    uint64_t build_start = now_ns();
+    if (config->bulk) {
+        library_bulk_begin(lib);
+    }
+    for (int i = 0; i < config->books; i++) {
+        make_book(&corpus, title, sizeof(title), authors, &author_count, &year, &pages);
+        uint64_t start = now_ns();
+        int ok = library_insert_book(lib, title, authors, author_count, year, pages);
+        latency_record(&add, now_ns() - start, ok);
+    }
+    uint64_t index_start = now_ns();
+    if (config->bulk && !library_bulk_finish(lib)) {
+        fprintf(stderr, "❌ Memory allocation failed\n");
+        return 0;
+    }
+    double index_seconds = (now_ns() - index_start) / 1e9;
+    double build_seconds = (now_ns() - build_start) / 1e9;
+
+    for (int i = 0; i < config->students; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s %d", first_names[i % FIRST_NAME_COUNT], i);
+        student_system_insert(sys, 100000 + i, name);
+    }
+
+    for (int i = 0; i < config->searches; i++) {
+        char term[WORD_MAX];
+        Book **found = NULL;
+        make_search_term(&corpus, term, sizeof(term));
+        uint64_t start = now_ns();
+        int count = library_find_books(lib, term, &found);
+        latency_record(&search, now_ns() - start, count > 0);
+        free(found);
+    }
+
+    // Same kind of terms through the word index, best RANKED_RESULTS only
+    for (int i = 0; i < config->searches; i++) {
+        char term[WORD_MAX];
+        SearchHit hits[RANKED_RESULTS];
+        make_search_term(&corpus, term, sizeof(term));
+        uint64_t start = now_ns();
+        int count = library_rank_books(lib, term, RANKED_RESULTS, hits);
+        latency_record(&ranked, now_ns() - start, count > 0);
+    }
+
+    // Loans: students take turns so nobody hits the limit, books are random.
+    // Handles keep track of the loans for the return phase.
+    int loan_total = config->loans;
+    if (loan_total > (long long)config->students * MAX_BOOKS) {
+        loan_total = config->students * MAX_BOOKS;
+    }
+    if (loan_total > lib->book_count) {
+        loan_total = lib->book_count;
+    }
+    BookHandle *loans = malloc(sizeof(BookHandle) * (loan_total > 0 ? loan_total : 1));
+    int *loan_students = malloc(sizeof(int) * (loan_total > 0 ? loan_total : 1));
+    if (loans == NULL || loan_students == NULL) {
+        fprintf(stderr, "❌ Memory allocation failed\n");
+        return 0;
+    }
+    for (int i = 0; i < loan_total; i++) {
+        Book *book;
+        do {
+            book = &lib->books[rng_below(lib->book_count)];
+        } while (!book->is_available);
+        Student *student = &sys->students[i % config->students];
+        loans[i] = library_book_handle(lib, book);
+        loan_students[i] = i % config->students;
+        uint64_t start = now_ns();
+        int result = lend_book(lib, sys, book, student);
+        latency_record(&borrow, now_ns() - start, result == LOAN_OK);
+    }
+
+    // Ranges run while the loans are out, so availability filters something
+    for (int i = 0; i < config->searches; i++) {
+        BookRange range;
+        Book **found = NULL;
+        make_range(&range);
+        uint64_t start = now_ns();
+        int count = library_range_books(lib, &range, &found);
+        latency_record(&ranges, now_ns() - start, count > 0);
+        free(found);
+    }
+
+    // Return in shuffled order
+    for (int i = loan_total - 1; i > 0; i--) {
+        int j = rng_below(i + 1);
+        BookHandle handle = loans[i];
+        int student = loan_students[i];
+        loans[i] = loans[j];
+        loan_students[i] = loan_students[j];
+        loans[j] = handle;
+        loan_students[j] = student;
+    }
+    for (int i = 0; i < loan_total; i++) {
+        Book *book = library_resolve_book(lib, loans[i]);
+        uint64_t start = now_ns();
+        int result = receive_book(lib, sys, book, &sys->students[loan_students[i]]);
+        latency_record(&give_back, now_ns() - start, result == LOAN_OK);
+    }
+    free(loans);
+    free(loan_students);
+
+    for (int i = 0; i < config->removes && lib->book_count > 0; i++) {
+        int position = rng_below(lib->book_count);
+        uint64_t start = now_ns();
+        int ok = library_delete_book(lib, sys, position);
+        latency_record(&removal, now_ns() - start, ok);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    MemoryUsage memory;
+    library_memory_usage(lib, &memory);
+
+    printf("{\n");
+    printf("  \"benchmark\": \"library_bench\",\n");
+    printf("  \"books\": %d,\n", config->books);
+    printf("  \"students\": %d,\n", config->students);
+    printf("  \"seed\": %llu,\n", (unsigned long long)config->seed);
+    printf("  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"bulk\": %s,\n", config->bulk ? "true" : "false");
+    printf("  \"build_seconds\": %.6f,\n", build_seconds);
+    printf("  \"index_seconds\": %.6f,\n", index_seconds);
+    printf("  \"operations\": {\n");
+    print_latency(&add, 0);
+    print_latency(&search, 0);
+    print_latency(&ranked, 0);
+    print_latency(&ranges, 0);
+    print_latency(&borrow, 0);
+    print_latency(&give_back, 0);
+    print_latency(&removal, 1);
+    printf("  },\n");
+    printf("  \"library_bytes\": %zu,\n", memory.total);
+    printf("  \"bytes_per_book\": %.1f,\n", lib->book_count > 0 ? (double)memory.total / lib->book_count : 0.0);
+    printf("  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+    printf("}\n");
+
+    destroy_student_system(sys);
+    destroy_library(lib);
+    corpus_free(&corpus);
+    return 1;
+}
+
+static void print_bench_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--books N] [--students N] [--searches N] [--loans N] [--removes N] [--seed N] [--bulk]\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config = { 100000, -1, 200, -1, -1, 42, 0 };
+
+    for (int i = 1; i < argc; i++) {
+        int value;
+        if (strcmp(argv[i], "--bulk") == 0) {
+            config.bulk = 1;
+            continue;
+        }
+        if (i + 1 >= argc || !parse_int(argv[i + 1], &value) || value < 0) {
+            print_bench_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--books") == 0) {
+            config.books = value;
+        } else if (strcmp(argv[i], "--students") == 0) {
+            config.students = value;
+        } else if (strcmp(argv[i], "--searches") == 0) {
+            config.searches = value;
+        } else if (strcmp(argv[i], "--loans") == 0) {
+            config.loans = value;
+        } else if (strcmp(argv[i], "--removes") == 0) {
+            config.removes = value;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            config.seed = (uint64_t)value;
+        } else {
+            print_bench_usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+
+    // Defaults scale with the catalog: one student per 20 books, a loan for
+    // every tenth book and as many removals
+    if (config.students < 0) {
+        config.students = config.books / 20 > 10 ? config.books / 20 : 10;
+    }
+    if (config.loans < 0) {
+        config.loans = config.books / 10;
+    }
+    if (config.removes < 0) {
+        config.removes = config.books / 10;
+    }
+
+    return run_benchmark(&config) ? 0 : 1;
+}
@@ -1,103 +1,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-
-typedef struct {
-    char *title;
-    char **authors;        // Dynamic array of author name strings
-    int author_count;
-    int year;
-    int pages;
-    int is_available;      // 1 if available, 0 if borrowed
-    char *borrowed_by;     // Student name who borrowed it (NULL if available)
-} Book;
-
-typedef struct {
-    int student_id;
-    char *name;
-    char **borrowed_books; // Dynamic array of borrowed book titles
-    int borrowed_count;
-    int max_books;         // Maximum books this student can borrow (default 3)
-} Student;
-
-typedef struct {
-    Book *books;           // Dynamic array of books
-    int book_count;
-    int capacity;          // Current array capacity
-} Library;
-
-typedef struct {
-    Student *students;     // Dynamic array of students
-    int student_count;
-    int student_capacity;
-} StudentSystem;
+#include <time.h>
+#include <unistd.h>
+
+#include "library.h"
+
+// Interactive front end: prompts, banners and the menu loop. Every change
+// goes through the engine API in library.h.
 
 /* ================ FUNCTION DECLARATIONS ================== */
 
 // Library Management Functions
-Library* create_library(int initial_capacity);
 int add_book(Library *lib);
-void display_all_books(Library *lib);
+void display_all_books(Library *lib, StudentSystem *sys);
 int search_books(Library *lib);
-int remove_book(Library *lib);
+int ranked_search(Library *lib);
+int display_books_in_range(Library *lib, StudentSystem *sys);
+int remove_book(Library *lib, StudentSystem *sys);
 void display_statistics(Library *lib);
 void cleanup_library(Library *lib);
-
-// Helper Functions
 Book* resize_library_if_needed(Library *lib);
-void cleanup_book(Book *book);
-int case_insensitive_search(const char *haystack, const char *needle);
+void print_missed_indexes(int missed);
 
-// Student Management Functions (TODO: Implement these)
-StudentSystem* create_student_system(int initial_capacity);
+// Student Management Functions
 int add_student(StudentSystem *sys);
-void display_all_students(StudentSystem *sys);
+void display_all_students(Library *lib, StudentSystem *sys);
 int borrow_book(Library *lib, StudentSystem *sys);
 int return_book(Library *lib, StudentSystem *sys);
-void display_student_books(StudentSystem *sys);
+void display_student_books(Library *lib, StudentSystem *sys);
 void display_enhanced_statistics(Library *lib, StudentSystem *sys);
+void display_memory_usage(Library *lib, StudentSystem *sys);
 void cleanup_student_system(StudentSystem *sys);
-void cleanup_student(Student *student);
-Student* find_student_by_name(StudentSystem *sys, const char *name);
-Book* find_book_by_title(Library *lib, const char *title);
+#ifndef LIBRARY_NO_METRICS
+void display_performance_metrics(void);
+#endif
 
-/* =============== FUNCTION IMPLEMENTATIONS ================== */
+// Rendering Functions
+#define LIST_PAGE_SIZE 20  // Books per page in the interactive listing
 
-Library* create_library(int initial_capacity) {
-    Library *lib = malloc(sizeof(Library));
-    if (lib == NULL) {
-        printf("Failed to allocate memory for library!\n");
-        return NULL;
-    }
-    
-    lib->books = malloc(sizeof(Book) * initial_capacity);
-    if (lib->books == NULL) {
-        printf("Failed to allocate memory for books array!\n");
-        free(lib);
-        return NULL;
-    }
-    
-    lib->book_count = 0;
-    lib->capacity = initial_capacity;
-    
-    return lib;
-}
+enum {
+    LIST_FANCY,            // Boxes and emoji, as in the menu
+    LIST_PLAIN,            // Labelled lines, no decoration
+    LIST_COMPACT           // One line per book
+};
+
+int parse_list_format(const char *name);
+void render_books(OutputBuffer *out, Library *lib, StudentSystem *sys, int offset, int limit, int format);
+void render_book_list(OutputBuffer *out, const Library *lib, Book **books, int count, StudentSystem *sys, int format);
+int list_books(Library *lib, StudentSystem *sys, int offset, int limit, int format);
+
+/* =============== FUNCTION IMPLEMENTATIONS ================== */
 
 int add_book(Library *lib) {
-    if(lib->book_count >= lib->capacity) {
-        int new_capacity = 0;
-        printf("The array is full you need to add more space: ");
-        scanf("%d", &new_capacity);
-        new_capacity += lib->capacity;
-
-        Book *new_books = realloc(lib->books, sizeof(Book) * new_capacity);
-        if(new_books == NULL) {
-            printf("Memory allocation failed\n");
-            return 0;
-        }
-        lib->books = new_books;
-        lib->capacity = new_capacity;
+    if(resize_library_if_needed(lib) == NULL) {
+        return 0;
     }
 
     printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
@@ -107,8 +64,6 @@ int add_book(Library *lib) {
     char temp_title[256];
     printf("📖 Enter the book title: ");
     scanf(" %255[^\n]", temp_title);
-    lib->books[lib->book_count].title = malloc(strlen(temp_title) + 1);
-    strcpy(lib->books[lib->book_count].title, temp_title);
 
     int num_authors;
     printf("✍️  How many authors? ");
@@ -120,41 +75,76 @@ int add_book(Library *lib) {
         scanf("%d", &num_authors);
         printf("\n");
     }
+    if(num_authors < 0) {
+        num_authors = 0;
+    }
 
-    // Allocate array of char* pointers
-    lib->books[lib->book_count].authors = malloc(sizeof(char*) * num_authors);
-    lib->books[lib->book_count].author_count = num_authors;
+    // Read the names into scratch buffers, the book gets its own copies
+    char (*temp_authors)[256] = malloc(sizeof(*temp_authors) * (num_authors + 1));
+    char **author_names = malloc(sizeof(char*) * (num_authors + 1));
+    if(temp_authors == NULL || author_names == NULL) {
+        printf("Memory allocation failed\n");
+        free(temp_authors);
+        free(author_names);
+        return 0;
+    }
 
-    // Now allocate each individual author name - FIXED to handle spaces
+    // FIXED to handle spaces in author names
     for (int i = 0; i < num_authors; i++) {
-        char temp_author[256];
         printf("👤 Enter author %d: ", i + 1);
-        scanf(" %255[^\n]", temp_author);
-            
-        lib->books[lib->book_count].authors[i] = malloc(strlen(temp_author) + 1);
-        strcpy(lib->books[lib->book_count].authors[i], temp_author);
+        scanf(" %255[^\n]", temp_authors[i]);
+        author_names[i] = temp_authors[i];
     }
 
     int temp_year = 0;
     printf("📅 Enter the book's year: ");
     scanf("%d", &temp_year);
-    lib->books[lib->book_count].year = temp_year;
 
     int temp_pages = 0;
     printf("📜 Enter the total number of pages: ");
     scanf("%d", &temp_pages);
-    lib->books[lib->book_count].pages = temp_pages;
 
-    // Initialize availability fields
-    lib->books[lib->book_count].is_available = 1;  // Book is available by default
-    lib->books[lib->book_count].borrowed_by = NULL; // No one has borrowed it yet
+    const char *invalid = library_check_book(temp_year, temp_pages, num_authors);
+    if(invalid != NULL) {
+        printf("❌ Cannot add the book: %s\n", invalid);
+        free(author_names);
+        free(temp_authors);
+        return 0;
+    }
 
-    lib->book_count++;
+    int added = library_insert_book(lib, temp_title, (const char **)author_names, num_authors, temp_year, temp_pages);
+    free(author_names);
+    free(temp_authors);
     
-    return 1;
+    if (added) {
+        print_missed_indexes(lib->missed_indexes);
+    }
+    return added;
 }
 
-void display_all_books(Library *lib) {
+// Warns about each index a new book or student could not be entered into
+void print_missed_indexes(int missed) {
+    if (missed & MISSED_TITLE_INDEX) {
+        printf("⚠️  Title index is full, the book will only be found by fuzzy search\n");
+    }
+    if (missed & MISSED_SEARCH_INDEX) {
+        printf("⚠️  Search index is full, searches may miss this book\n");
+    }
+    if (missed & MISSED_WORD_INDEX) {
+        printf("⚠️  Word index is full, ranked search may miss this book\n");
+    }
+    if (missed & MISSED_YEAR_INDEX) {
+        printf("⚠️  Year index is full, newest/oldest may skip this book\n");
+    }
+    if (missed & MISSED_PAGE_INDEX) {
+        printf("⚠️  Page index is full, page ranges may skip this book\n");
+    }
+    if (missed & MISSED_NAME_INDEX) {
+        printf("⚠️  Name index is full, the student will only be found by fuzzy search\n");
+    }
+}
+
+void display_all_books(Library *lib, StudentSystem *sys) {
     printf("\n\n╔═════════════════════════════════════════════════════════╗\n");
     printf("║                   📋 ALL BOOKS DISPLAY 📋                ║\n");
     printf("╚══════════════════════════════════════════════════════════╝\n\n");
@@ -164,27 +154,60 @@ void display_all_books(Library *lib) {
         return;
     }
     
-    for(int i = 0; i < lib->book_count; i++) {
-        printf("┌────────────────────────────────────────────────────┐\n");
-        printf("│               📚 BOOK #%d 📚                │\n", i + 1);
-        printf("└────────────────────────────────────────────────────┘\n");
-
-        printf("📖 Title: %s\n", lib->books[i].title);
-        int num_authors = lib->books[i].author_count;
-        printf("✍️  Authors (%d):\n", num_authors);
-        for(int j = 0; j < num_authors; j++) {
-            printf("   👤 %d. %s\n", j + 1, lib->books[i].authors[j]);
+    OutputBuffer out = { 1, malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    if(out.data == NULL) {
+        printf("❌ Memory allocation failed\n");
+        return;
+    }
+    
+    // One page at a time, each formatted in the buffer and written at once
+    int pages = (lib->book_count + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE;
+    int page = 0;
+    while(1) {
+        fflush(stdout);
+        render_books(&out, lib, sys, page * LIST_PAGE_SIZE, LIST_PAGE_SIZE, LIST_FANCY);
+        output_flush(&out);
+        if(pages == 1 || !out.ok) {
+            break;
         }
-        printf("📅 Year: %d\n", lib->books[i].year);
-        printf("📜 Pages: %d\n", lib->books[i].pages);
         
-        // Display availability status
-        if(lib->books[i].is_available) {
-            printf("✅ Status: Available\n\n");
+        char command[16];
+        printf("📄 Page %d of %d  (n: next, p: previous, q: back to menu): ", page + 1, pages);
+        if(scanf(" %15s", command) != 1 || command[0] == 'q' || command[0] == 'Q') {
+            break;
+        }
+        if(command[0] == 'p' || command[0] == 'P') {
+            page = page > 0 ? page - 1 : 0;
+        } else if(page + 1 < pages) {
+            page++;
         } else {
-            printf("📚 Status: Borrowed by %s\n\n", lib->books[i].borrowed_by);
+            break;
         }
+        printf("\n");
     }
+    
+    free(out.data);
+}
+
+// Prints the match line for a book and returns 1 if the title or one of
+// the authors contains the search term
+static int report_book_match(const Library *lib, const Book *book, const char *search_term) {
+    // Check title
+    if(case_insensitive_search(book_title(lib, book), search_term)) {
+        printf("✅ 📖 Found book: '%s'\n", book_title(lib, book));
+        return 1;
+    }
+
+    // Check all authors
+    for(int j = 0; j < book->author_count; j++) {
+        if(case_insensitive_search(book_author(lib, book, j), search_term)) {
+            printf("✅ 👤 Found author: '%s' wrote '%s'\n", 
+                   book_author(lib, book, j), book_title(lib, book));
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 int search_books(Library *lib) {
@@ -200,28 +223,129 @@ int search_books(Library *lib) {
 
     printf("\n🔍 Searching for: '%s'\n\n", search_term);
     
-    for(int i = 0; i < lib->book_count; i++) {
-        // Check title
-        if(case_insensitive_search(lib->books[i].title, search_term)) {
-            printf("✅ 📖 Found book: '%s'\n", lib->books[i].title);
-            matches++;
-        } else {
-            // Check all authors
-            for(int j = 0; j < lib->books[i].author_count; j++) {
-                if(case_insensitive_search(lib->books[i].authors[j], search_term)) {
-                    printf("✅ 👤 Found author: '%s' wrote '%s'\n", 
-                           lib->books[i].authors[j], lib->books[i].title);
-                    matches++;
-                    break;
-                }
-            }
-        }
+    Book **found = NULL;
+    int found_count = library_find_books(lib, search_term, &found);
+    if(found_count < 0) {
+        printf("❌ Memory allocation failed\n");
+        return 0;
+    }
+    for(int i = 0; i < found_count; i++) {
+        matches += report_book_match(lib, found[i], search_term);
     }
+    free(found);
 
     return matches;
 }
 
-int remove_book(Library *lib) {
+int ranked_search(Library *lib) {
+    char query[256];
+    SearchHit hits[RANKED_RESULTS];
+
+    printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
+    printf("║                   🏅 RANKED SEARCH 🏅                    ║\n");
+    printf("╚══════════════════════════════════════════════════════════╝\n\n");
+
+    printf("🔎 Enter search words (typos and word starts are fine): ");
+    scanf(" %255[^\n]", query);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int hit_count = library_rank_books(lib, query, RANKED_RESULTS, hits);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(hit_count < 0) {
+        printf("❌ Memory allocation failed\n");
+        return 0;
+    }
+
+    printf("\n🔍 Best matches for: '%s'\n\n", query);
+    for(int i = 0; i < hit_count; i++) {
+        Book *book = hits[i].book;
+        printf("%2d. [%3d] 📖 %s", i + 1, hits[i].score, book_title(lib, book));
+        for(int j = 0; j < book->author_count; j++) {
+            printf("%s%s", j == 0 ? " - " : ", ", book_author(lib, book, j));
+        }
+        printf(" (%d)\n", book->year);
+    }
+
+    // Offer completions for the word being typed last
+    const char *last_word = query;
+    for(const char *p = query; *p != '\0'; p++) {
+        if(*p == ' ') last_word = p + 1;
+    }
+    const char *words[5];
+    int word_count = library_complete_word(lib, last_word, 5, words);
+    if(word_count > 0) {
+        printf("\n💡 Words starting with '%s':", last_word);
+        for(int i = 0; i < word_count; i++) {
+            printf(" %s", words[i]);
+        }
+        printf("\n");
+    }
+
+    double elapsed_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("\n⏱️  Ranked %d book(s) in %.2f ms\n", lib->book_count, elapsed_ms);
+    return hit_count;
+}
+
+// Reads "FROM..TO" (either side may be left out) or "*" for no limit
+static int read_bounds(const char *prompt, int *low, int *high) {
+    char text[64];
+    printf("%s", prompt);
+    scanf(" %63[^\n]", text);
+    if(strcmp(text, "*") == 0) {
+        return 1;
+    }
+    if(!parse_bounds(text, low, high)) {
+        printf("⚠️  '%s' is not a range like 1990..2000, ..200 or 300..\n", text);
+        return 0;
+    }
+    return 1;
+}
+
+int display_books_in_range(Library *lib, StudentSystem *sys) {
+    printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
+    printf("║                📅 BOOKS BY YEAR AND PAGES 📅             ║\n");
+    printf("╚══════════════════════════════════════════════════════════╝\n\n");
+
+    BookRange range;
+    book_range_init(&range);
+    if(!read_bounds("📅 Years (e.g. 1990..2000, * for any): ", &range.year_min, &range.year_max) ||
+       !read_bounds("📜 Pages (e.g. ..200, * for any): ", &range.pages_min, &range.pages_max)) {
+        return 0;
+    }
+
+    char status[16];
+    printf("📚 Only (a)vailable, only (b)orrowed, or (*) all? ");
+    scanf(" %15s", status);
+    if(status[0] == 'a' || status[0] == 'A') {
+        range.availability = RANGE_AVAILABLE;
+    } else if(status[0] == 'b' || status[0] == 'B') {
+        range.availability = RANGE_BORROWED;
+    }
+
+    Book **found = NULL;
+    int found_count = library_range_books(lib, &range, &found);
+    if(found_count < 0) {
+        printf("❌ Memory allocation failed\n");
+        return 0;
+    }
+
+    OutputBuffer out = { 1, malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    if(out.data == NULL) {
+        printf("❌ Memory allocation failed\n");
+        free(found);
+        return 0;
+    }
+    fflush(stdout);
+    output_char(&out, '\n');
+    render_book_list(&out, lib, found, found_count, sys, LIST_COMPACT);
+    output_flush(&out);
+    free(out.data);
+    free(found);
+    return found_count;
+}
+
+int remove_book(Library *lib, StudentSystem *sys) {
 
     printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
     printf("║                   🗑️ REMOVE BOOK 🗑️                      ║\n");
@@ -231,26 +355,15 @@ int remove_book(Library *lib) {
     printf("📖 Enter title to remove: ");
     scanf(" %255[^\n]", title_to_remove);
         
-    // Find the book
-    int found_index = -1;
-    for (int i = 0; i < lib->book_count; i++) {
-        if (case_insensitive_search(lib->books[i].title, title_to_remove)) {
-            found_index = i;
-            break;
-        }
+    // Find the book: exact title first, substring match as a fallback
+    Book *found = find_book_by_title(lib, title_to_remove);
+    if (found == NULL) {
+        found = find_book_by_title_fuzzy(lib, title_to_remove);
     }
     
-    if (found_index == -1) return 0; // Not found
-    
-    cleanup_book(&lib->books[found_index]);
-    
-    // Shift all books after this one to the left
-    for (int i = found_index; i < lib->book_count - 1; i++) {
-        lib->books[i] = lib->books[i + 1]; // Copy struct
-    }
+    if (found == NULL) return 0; // Not found
     
-    lib->book_count--;
-    return 1;
+    return library_delete_book(lib, sys, (int)(found - lib->books));
 }
 
 void display_statistics(Library *lib) {
@@ -263,36 +376,18 @@ void display_statistics(Library *lib) {
         return;
     }
 
-    printf("📚 Total number of books: %d\n", lib->book_count);
+    // Totals are kept up to date by every add and remove
+    LibraryStats stats;
+    library_stats(lib, NULL, &stats);
 
-    int tot_authors = 0;
-    for(int i = 0; i < lib->book_count; i++) {
-        tot_authors += lib->books[i].author_count;
-    }
-    printf("✍️  Total number of authors: %d\n", tot_authors);
+    printf("📚 Total number of books: %d\n", stats.book_count);
+    printf("✍️  Total number of authors: %lld\n", stats.author_total);
+    printf("📜 Average number of pages: %lld\n", stats.average_pages);
 
-    int tot_pages_all = 0;
-    for(int i = 0; i < lib->book_count; i++) {
-        tot_pages_all += lib->books[i].pages;
+    if(stats.newest != NULL && stats.oldest != NULL) {
+        printf("✨ Newest book: '%s' from %d\n", book_title(lib, stats.newest), stats.newest->year);
+        printf("🕰️ Oldest book: '%s' from %d\n", book_title(lib, stats.oldest), stats.oldest->year);
     }
-    int avr_pages = tot_pages_all / lib->book_count;
-    printf("📜 Average number of pages: %d\n", avr_pages);
-
-    // Find newest and oldest books
-    int newest = 0;
-    int oldest = 0;
-
-    for(int i = 1; i < lib->book_count; i++) {
-        if(lib->books[i].year > lib->books[newest].year) {
-            newest = i;
-        }
-        if(lib->books[i].year < lib->books[oldest].year) {
-            oldest = i;
-        }
-    }
-
-    printf("✨ Newest book: '%s' from %d\n", lib->books[newest].title, lib->books[newest].year);
-    printf("🕰️ Oldest book: '%s' from %d\n", lib->books[oldest].title, lib->books[oldest].year);
 }
 
 void cleanup_library(Library *lib) {
@@ -302,46 +397,37 @@ void cleanup_library(Library *lib) {
     printf("║                  🧹 FREEING MEMORY 🧹                    ║\n");
     printf("╚══════════════════════════════════════════════════════════╝\n\n");
     
-    for(int i = 0; i < lib->book_count; i++) {
-        cleanup_book(&lib->books[i]);
-        printf("✅ Memory freed for book #%d\n", i + 1);
-    }
+    // Book strings live in the pool, so every book goes in one bulk release
+    string_pool_free(&lib->strings);
+    printf("✅ Memory freed for %d books\n", lib->book_count);
     
     free(lib->books);
     lib->books = NULL;
+    book_columns_free(&lib->columns);
+    free(lib->slots);
+    lib->slots = NULL;
     printf("✅ Memory freed for books array\n");
+
+    name_index_free(&lib->title_index);
+    printf("✅ Memory freed for title index\n");
+
+    trigram_index_free(&lib->text_index);
+    word_index_free(&lib->word_index);
+    int_index_free(&lib->year_index);
+    int_index_free(&lib->page_index);
+    printf("✅ Memory freed for search indexes\n");
     
     free(lib);
     printf("✅ Memory freed for the library\n");
 }
 
 Book* resize_library_if_needed(Library *lib) {
-    // Check if resize is needed
+    // Grow geometrically (see library_reserve) instead of asking how much
+    // space to add, so appends are amortised O(1) and never block on input
     if (lib->book_count >= lib->capacity) {
-        int new_capacity = 0;
-
-        printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
-        printf("║                   📏 RESIZING LIBRARY 📏                 ║\n");
-        printf("╚══════════════════════════════════════════════════════════╝\n\n");
-
-        printf("⚠️  Library capacity is full! Current capacity: %d books\n", lib->capacity);
-        printf("📚 Current books in library: %d\n\n", lib->book_count);
-        printf("📈 How much additional space do you want to add? ");
-        scanf("%d", &new_capacity);
+        int old_capacity = lib->capacity;
         
-        if (new_capacity <= 0) {
-            printf("❌ Invalid capacity! Please enter a positive number.\n");
-            return NULL;
-        }
-        
-        new_capacity += lib->capacity;
-        
-        printf("\n🔄 Attempting to resize library from %d to %d books...\n", lib->capacity, new_capacity);
-        
-        // Reallocate with new capacity
-        Book *new_books = realloc(lib->books, sizeof(Book) * new_capacity);
-        
-        if (new_books == NULL) {
+        if (!library_reserve(lib, lib->book_count + 1)) {
             printf("\n❌ ═══════════════════════════════════════════════════════\n");
             printf("   💥 MEMORY ALLOCATION FAILED! 💥\n");
             printf("   Unable to resize library. Please try again later.\n");
@@ -349,104 +435,16 @@ Book* resize_library_if_needed(Library *lib) {
             return NULL;
         }
         
-        // Update library structure
-        lib->books = new_books;
-        lib->capacity = new_capacity;
-        
-        printf("\n✅ ═══════════════════════════════════════════════════════\n");
-        printf("   🎉 LIBRARY SUCCESSFULLY RESIZED! 🎉\n");
-        printf("   📊 New capacity: %d books\n", new_capacity);
-        printf("   📈 Additional space: %d books\n", new_capacity - lib->book_count);
-        printf("   ═══════════════════════════════════════════════════════\n");
+        printf("📏 Library capacity grown from %d to %d books\n", old_capacity, lib->capacity);
     }
     
     return lib->books;
 }
 
-void cleanup_book(Book *book) {
-    if (book->title != NULL) {
-        free(book->title);
-        book->title = NULL;
-    }
-    
-    // Free each author name string
-    if (book->authors != NULL) {
-        for (int i = 0; i < book->author_count; i++) {
-            if (book->authors[i] != NULL) {
-                free(book->authors[i]);
-                book->authors[i] = NULL;
-            }
-        }
-        
-        free(book->authors);
-        book->authors = NULL;
-    }
-
-    // Free borrowed_by field if it exists
-    if (book->borrowed_by != NULL) {
-        free(book->borrowed_by);
-        book->borrowed_by = NULL;
-    }
-
-    book->author_count = 0;
-    book->is_available = 1;
-}
-
-int case_insensitive_search(const char *haystack, const char *needle) {
-    int haystack_len = strlen(haystack);
-    int needle_len = strlen(needle);
-    
-    // Check each possible starting position
-    for (int i = 0; i <= haystack_len - needle_len; i++) {
-        int match = 1;
-        
-        // Compare characters at this position
-        for (int j = 0; j < needle_len; j++) {
-            if (tolower(haystack[i + j]) != tolower(needle[j])) {
-                match = 0;
-                break;
-            }
-        }
-        
-        if (match) return 1;
-    }
-    
-    return 0;
-}
-
-StudentSystem* create_student_system(int initial_capacity) {
-    StudentSystem *student_sys = malloc(sizeof(StudentSystem));
-    if(student_sys == NULL) {
-        printf("Failed to allocate memory for Student_sys\n");
-        return NULL;
-    }
-
-    student_sys->students = malloc(sizeof(Student) * initial_capacity);
-    if(student_sys->students == NULL) {
-        printf("Failed to allocate memory for array of students\n");
-        free(student_sys);
-        return NULL;
-    }
-
-    student_sys->student_count = 0;
-    student_sys->student_capacity = initial_capacity;
-    return student_sys;
-}
-
 int add_student(StudentSystem *sys) {
-    if(sys->student_count >= sys->student_capacity) {
-        int new_capacity = 0;
-        printf("⚠️  The student array is full! Add more space: ");
-        scanf("%d", &new_capacity);
-        new_capacity += sys->student_capacity;
-
-        Student *new_student = realloc(sys->students, sizeof(Student) * new_capacity);
-        if(new_student == NULL) {
-            printf("❌ Memory allocation failed\n");
-            return 0;
-        }
-        sys->students = new_student;
-        sys->student_capacity = new_capacity;
+    if(!student_system_reserve(sys, sys->student_count + 1)) {
+        printf("❌ Memory allocation failed\n");
+        return 0;
     }
 
     printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
@@ -456,23 +454,19 @@ int add_student(StudentSystem *sys) {
     int ID_temp = 0;
     printf("🏷️  Enter the student ID: ");
     scanf("%d", &ID_temp);
-    sys->students[sys->student_count].student_id = ID_temp;
 
     char name_temp[256];
     printf("👤 Enter the student's name: ");
     scanf(" %255[^\n]", name_temp);
-    sys->students[sys->student_count].name = malloc(strlen(name_temp) + 1);
-    strcpy(sys->students[sys->student_count].name, name_temp);
-
-    sys->students[sys->student_count].max_books = 3;
-    sys->students[sys->student_count].borrowed_books = malloc(sizeof(char*) * 3); // dont know why i cant use MAX_BOOk
-    sys->students[sys->student_count].borrowed_count = 0;
 
-    sys->student_count ++;
-    return 1;
+    int added = student_system_insert(sys, ID_temp, name_temp);
+    if (added) {
+        print_missed_indexes(sys->missed_indexes);
+    }
+    return added;
 }
 
-void display_all_students(StudentSystem *sys) {
+void display_all_students(Library *lib, StudentSystem *sys) {
     printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
     printf("║                 👥 ALL STUDENTS DISPLAY 👥               ║\n");
     printf("╚══════════════════════════════════════════════════════════╝\n\n");
@@ -488,13 +482,13 @@ void display_all_students(StudentSystem *sys) {
         printf("└────────────────────────────────────────────────────┘\n");
 
         printf("🏷️  Student ID: %d\n", sys->students[i].student_id);
-        printf("👤 Name: %s\n", sys->students[i].name);
+        printf("👤 Name: %s\n", student_name(sys, &sys->students[i]));
         printf("📚 Books borrowed: %d/%d\n", sys->students[i].borrowed_count, sys->students[i].max_books);
 
         if(sys->students[i].borrowed_count > 0) {
             printf("📋 Borrowed books:\n");
             for(int j = 0; j < sys->students[i].borrowed_count; j++) {
-                printf("   📖 %d. %s\n", j + 1, sys->students[i].borrowed_books[j]);
+                printf("   📖 %d. %s\n", j + 1, book_title(lib, library_book_in_slot(lib, sys->students[i].borrowed_books[j])));
             }
         } else {
             printf("✅ No books currently borrowed\n");
@@ -517,6 +511,9 @@ int borrow_book(Library *lib, StudentSystem *sys) {
 
     // Find student
     Student *student = find_student_by_name(sys, student_name);
+    if (student == NULL) {
+        student = find_student_by_name_fuzzy(sys, student_name);
+    }
     if (student == NULL) {
         printf("❌ Student not found.\n");
         return 0; // Failure
@@ -529,34 +526,27 @@ int borrow_book(Library *lib, StudentSystem *sys) {
     // Find book
     Book *book = find_book_by_title(lib, book_title);
     if (book == NULL) {
-        printf("❌ Book not found.\n");
-        return 0; // Failure
+        book = find_book_by_title_fuzzy(lib, book_title);
     }
-
-    // Check if book is available
-    if (book->is_available == 0) {
-        printf("❌ Book is currently borrowed by someone else.\n");
+    if (book == NULL) {
+        printf("❌ Book not found.\n");
         return 0; // Failure
     }
 
-    // Check if student can borrow more books
-    if (student->borrowed_count >= student->max_books) {
-        printf("❌ Student has reached the borrowing limit (%d books).\n", student->max_books);
-        return 0; // Failure
+    switch (lend_book(lib, sys, book, student)) {
+        case LOAN_OK:
+            printf("✅ Book borrowed successfully!\n");
+            return 1; // Success
+        case LOAN_NOT_AVAILABLE:
+            printf("❌ Book is currently borrowed by someone else.\n");
+            return 0;
+        case LOAN_LIMIT_REACHED:
+            printf("❌ Student has reached the borrowing limit (%d books).\n", student->max_books);
+            return 0;
+        default:
+            printf("❌ Memory allocation failed\n");
+            return 0; // Failure
     }
-
-    // Borrow the book
-    book->is_available = 0;
-    book->borrowed_by = malloc(strlen(student->name) + 1);
-    strcpy(book->borrowed_by, student->name);
-
-    // Add book to student's borrowed books
-    student->borrowed_books[student->borrowed_count] = malloc(strlen(book->title) + 1);
-    strcpy(student->borrowed_books[student->borrowed_count], book->title);
-    student->borrowed_count++;
-
-    printf("✅ Book borrowed successfully!\n");
-    return 1; // Success
 }
 
 int return_book(Library *lib, StudentSystem *sys) {
@@ -571,6 +561,9 @@ int return_book(Library *lib, StudentSystem *sys) {
     scanf(" %255[^\n]", student_name);
 
     Student *student = find_student_by_name(sys, student_name);
+    if(student == NULL) {
+        student = find_student_by_name_fuzzy(sys, student_name);
+    }
     if(student == NULL) {
         printf("❌ Student not found\n");
         return 0;
@@ -581,80 +574,54 @@ int return_book(Library *lib, StudentSystem *sys) {
 
     Book *book = find_book_by_title(lib, book_title);
     if(book == NULL) {
-        printf("❌ Book not found\n");
-        return 0;
-    }
-
-    // Check if book is currently borrowed
-    if(book->is_available == 1) {
-        printf("❌ Book is not currently borrowed\n");
-        return 0;
+        book = find_book_by_title_fuzzy(lib, book_title);
     }
-
-    // Check if book is borrowed by this student
-    if(book->borrowed_by == NULL || !case_insensitive_search(book->borrowed_by, student->name)) {
-        printf("❌ Book is not borrowed by this student\n");
-        return 0;
-    }
-
-    // Find the book in student's borrowed_books array
-    int book_index = -1;
-    for(int i = 0; i < student->borrowed_count; i++) {
-        if(case_insensitive_search(student->borrowed_books[i], book_title)) {
-            book_index = i;
-            break;
-        }
-    }
-
-    if(book_index == -1) {
-        printf("❌ Book not found in student's borrowed list\n");
+    if(book == NULL) {
+        printf("❌ Book not found\n");
         return 0;
     }
 
-    // Update book: make it available and clear borrowed_by
-    book->is_available = 1;
-    if(book->borrowed_by != NULL) {
-        free(book->borrowed_by);
-        book->borrowed_by = NULL;
-    }
-
-    // Remove book from student's borrowed_books array
-    free(student->borrowed_books[book_index]);
-    
-    // Shift remaining books to fill the gap
-    for(int i = book_index; i < student->borrowed_count - 1; i++) {
-        student->borrowed_books[i] = student->borrowed_books[i + 1];
+    switch(receive_book(lib, sys, book, student)) {
+        case LOAN_OK:
+            printf("✅ Book returned successfully!\n");
+            return 1;
+        case LOAN_NOT_BORROWED:
+            printf("❌ Book is not currently borrowed\n");
+            return 0;
+        case LOAN_WRONG_STUDENT:
+            printf("❌ Book is not borrowed by this student\n");
+            return 0;
+        default:
+            printf("❌ Book not found in student's borrowed list\n");
+            return 0;
     }
-    
-    // Decrement borrowed count
-    student->borrowed_count--;
-
-    printf("✅ Book returned successfully!\n");
-    return 1;
 }
 
-void display_student_books(StudentSystem *sys) {
-    char student_name[256];
+void display_student_books(Library *lib, StudentSystem *sys) {
+    char entered_name[256];
     
     printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
     printf("║                📚 STUDENT'S BOOKS 📚                     ║\n");
     printf("╚══════════════════════════════════════════════════════════╝\n\n");
     
     printf("👤 Enter student's name: ");
-    scanf(" %255[^\n]", student_name);
+    scanf(" %255[^\n]", entered_name);
     
-    Student *student = find_student_by_name(sys, student_name);
+    Student *student = find_student_by_name(sys, entered_name);
+    if(student == NULL) {
+        student = find_student_by_name_fuzzy(sys, entered_name);
+    }
     if(student == NULL) {
         printf("❌ Student not found\n");
         return;
     }
     
     printf("┌────────────────────────────────────────────────────┐\n");
-    printf("│          📚 %s's BORROWED BOOKS 📚         │\n", student->name);
+    printf("│          📚 %s's BORROWED BOOKS 📚         │\n", student_name(sys, student));
     printf("└────────────────────────────────────────────────────┘\n\n");
     
     printf("🏷️  Student ID: %d\n", student->student_id);
-    printf("👤 Student Name: %s\n", student->name);
+    printf("👤 Student Name: %s\n", student_name(sys, student));
     printf("📊 Currently borrowed: %d/%d books\n\n", student->borrowed_count, student->max_books);
     
     if(student->borrowed_count == 0) {
@@ -663,7 +630,7 @@ void display_student_books(StudentSystem *sys) {
         printf("📋 Borrowed Books List:\n");
         printf("┌────────────────────────────────────────────────────┐\n");
         for(int i = 0; i < student->borrowed_count; i++) {
-            printf("│ 📖 %d. %-45s │\n", i + 1, student->borrowed_books[i]);
+            printf("│ 📖 %d. %-45s │\n", i + 1, book_title(lib, library_book_in_slot(lib, student->borrowed_books[i])));
         }
         printf("└────────────────────────────────────────────────────┘\n");
     }
@@ -689,77 +656,109 @@ void display_enhanced_statistics(Library *lib, StudentSystem *sys) {
         return;
     }
     
+    // Running totals and index ends, no pass over the books
+    LibraryStats stats;
+    library_stats(lib, sys, &stats);
+    
     printf("📚 LIBRARY STATISTICS:\n");
-    printf("📗 Total number of books: %d\n", lib->book_count);
+    printf("📗 Total number of books: %d\n", stats.book_count);
+    printf("✍️  Total number of authors: %lld\n", stats.author_total);
+    printf("📜 Average number of pages: %lld\n", stats.average_pages);
     
-    // Count total authors
-    int tot_authors = 0;
-    for(int i = 0; i < lib->book_count; i++) {
-        tot_authors += lib->books[i].author_count;
+    if(stats.newest != NULL && stats.oldest != NULL) {
+        printf("✨ Newest book: '%s' from %d\n", book_title(lib, stats.newest), stats.newest->year);
+        printf("🕰 Oldest book: '%s' from %d\n", book_title(lib, stats.oldest), stats.oldest->year);
     }
-    printf("✍️  Total number of authors: %d\n", tot_authors);
-    
-    // Calculate average pages
-    int tot_pages_all = 0;
-    for(int i = 0; i < lib->book_count; i++) {
-        tot_pages_all += lib->books[i].pages;
+    if(stats.shortest != NULL && stats.longest != NULL) {
+        printf("📄 Shortest book: '%s' with %d pages\n", book_title(lib, stats.shortest), stats.shortest->pages);
+        printf("📚 Longest book: '%s' with %d pages\n", book_title(lib, stats.longest), stats.longest->pages);
     }
-    int avr_pages = tot_pages_all / lib->book_count;
-    printf("📜 Average number of pages: %d\n", avr_pages);
-    
-    // Find newest and oldest books
-    int newest = 0, oldest = 0;
-    for(int i = 1; i < lib->book_count; i++) {
-        if(lib->books[i].year > lib->books[newest].year) {
-            newest = i;
-        }
-        if(lib->books[i].year < lib->books[oldest].year) {
-            oldest = i;
-        }
-    }
-    printf("✨ Newest book: '%s' from %d\n", lib->books[newest].title, lib->books[newest].year);
-    printf("🕰 Oldest book: '%s' from %d\n", lib->books[oldest].title, lib->books[oldest].year);
     
     // Student-related statistics
     printf("\n👥 STUDENT STATISTICS:\n");
-    printf("👨‍🎓 Total registered students: %d\n", sys->student_count);
-    
-    // Count total books currently borrowed
-    int total_borrowed = 0;
-    for(int i = 0; i < sys->student_count; i++) {
-        total_borrowed += sys->students[i].borrowed_count;
-    }
-    printf("📚 Total books currently borrowed: %d\n", total_borrowed);
+    printf("👨‍🎓 Total registered students: %d\n", stats.student_count);
+    printf("📚 Total books currently borrowed: %d\n", stats.borrowed_total);
     
     // Calculate average books per student
-    if(sys->student_count > 0) {
-        float avg_books_per_student = (float)total_borrowed / sys->student_count;
+    if(stats.student_count > 0) {
+        float avg_books_per_student = (float)stats.borrowed_total / stats.student_count;
         printf("📚 Average books per student: %.2f\n", avg_books_per_student);
     } else {
         printf("📚 Average books per student: 0.00\n");
     }
     
-    // Find most active student
-    if(sys->student_count > 0) {
-        int most_active = 0;
-        for(int i = 1; i < sys->student_count; i++) {
-            if(sys->students[i].borrowed_count > sys->students[most_active].borrowed_count) {
-                most_active = i;
-            }
-        }
+    if(stats.most_active != NULL) {
         printf("🏆 Most active student: %s (ID: %d) with %d books\n", 
-               sys->students[most_active].name, 
-               sys->students[most_active].student_id,
-               sys->students[most_active].borrowed_count);
+               student_name(sys, stats.most_active), 
+               stats.most_active->student_id,
+               stats.most_active_loans);
     }
     
     // Books availability ratio
-    int available_books = lib->book_count - total_borrowed;
-    float availability_ratio = (float)available_books / lib->book_count * 100;
+    int available_books = stats.book_count - stats.borrowed_total;
+    float availability_ratio = (float)available_books / stats.book_count * 100;
     printf("📊 Books availability ratio: %.1f%% (%d available out of %d)\n", 
-           availability_ratio, available_books, lib->book_count);
+           availability_ratio, available_books, stats.book_count);
+}
+
+static void print_memory_line(const char *label, size_t bytes, size_t total) {
+    printf("%s: %zu bytes (%.1f%%)\n", label, bytes, total > 0 ? 100.0 * bytes / total : 0.0);
+}
+
+// Walks every index, so it is a report of its own rather than part of the
+// statistics, which only read running totals
+void display_memory_usage(Library *lib, StudentSystem *sys) {
+    printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
+    printf("║                    💾 MEMORY USAGE 💾                    ║\n");
+    printf("╚══════════════════════════════════════════════════════════╝\n\n");
+    
+    // What the catalog costs in memory, counted from the allocations
+    MemoryUsage books, students;
+    library_memory_usage(lib, &books);
+    student_system_memory_usage(sys, &students);
+    size_t total = books.total + students.total;
+    
+    print_memory_line("📦 Book records", books.records, total);
+    print_memory_line("🗂️  Slots and scan columns", books.slots, total);
+    print_memory_line("🔤 Titles and authors", books.strings + books.string_table, total);
+    print_memory_line("🔎 Title index", books.name_index, total);
+    print_memory_line("🧩 Substring index", books.text_index, total);
+    print_memory_line("🏅 Ranked-search index", books.word_index, total);
+    print_memory_line("📅 Year and page indexes", books.ordered_index, total);
+    print_memory_line("👥 Students", students.total, total);
+    printf("🧮 Total: %zu bytes (%.1f MiB), %.1f bytes per book\n",
+           total, total / 1048576.0, lib->book_count > 0 ? (double)books.total / lib->book_count : 0.0);
 }
 
+#ifndef LIBRARY_NO_METRICS
+void display_performance_metrics(void) {
+    int format;
+    
+    printf("\n\n╔══════════════════════════════════════════════════════════╗\n");
+    printf("║               ⏱️  PERFORMANCE METRICS ⏱️                  ║\n");
+    printf("╚══════════════════════════════════════════════════════════╝\n\n");
+    
+    printf("📝 Format (1 = table, 2 = JSON): ");
+    if (scanf("%d", &format) != 1) {
+        scanf("%*[^\n]");
+        format = 1;
+    }
+    printf("\n");
+    
+    // Counted since start-up by every front end in this process
+    OutputBuffer out = { 1, malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    if (out.data == NULL) {
+        printf("❌ Memory allocation failed!\n");
+        return;
+    }
+    fflush(stdout);
+    metrics_report(&out, format == 2 ? METRICS_JSON : METRICS_TEXT);
+    output_flush(&out);
+    free(out.data);
+    printf("💡 kill -USR1 %d (table) or -USR2 (JSON) writes the same report to stderr\n", (int)getpid());
+}
+#endif
+
 void cleanup_student_system(StudentSystem *sys) {
     if(sys == NULL) return;
     
@@ -767,97 +766,306 @@ void cleanup_student_system(StudentSystem *sys) {
     printf("║              🧹 CLEANING STUDENT MEMORY 🧹               ║\n");
     printf("╚══════════════════════════════════════════════════════════╝\n\n");
     
-    // Loop through all students and call cleanup_student() for each
-    for(int i = 0; i < sys->student_count; i++) {
-        cleanup_student(&sys->students[i]);
-        printf("✅ Memory freed for student #%d\n", i + 1);
-    }
+    // Names live in the pool: one bulk release
+    string_pool_free(&sys->strings);
+    printf("✅ Memory freed for %d students\n", sys->student_count);
     
     // Free the students array
     free(sys->students);
     sys->students = NULL;
     printf("✅ Memory freed for students array\n");
+
+    name_index_free(&sys->name_index);
+    activity_heap_free(&sys->activity);
+    pthread_mutex_destroy(&sys->loan_lock);
+    printf("✅ Memory freed for student indexes\n");
     
     // Free the StudentSystem structure
     free(sys);
     printf("✅ Memory freed for the student system\n");
 }
 
-void cleanup_student(Student *student) {
-    if(student == NULL) return;
-    
-    // Free the student's name
-    if(student->name != NULL) {
-        free(student->name);
-        student->name = NULL;
+/* ================== RENDERING ==================== */
+
+int parse_list_format(const char *name) {
+    if (strcmp(name, "fancy") == 0) return LIST_FANCY;
+    if (strcmp(name, "plain") == 0) return LIST_PLAIN;
+    if (strcmp(name, "compact") == 0) return LIST_COMPACT;
+    return -1;
+}
+
+static void render_authors(OutputBuffer *out, const Library *lib, const Book *book, const char *separator) {
+    for (int j = 0; j < book->author_count; j++) {
+        if (j > 0) output_string(out, separator);
+        output_string(out, book_author(lib, book, j));
     }
+}
+
+static void render_book(OutputBuffer *out, const Library *lib, const Book *book, StudentSystem *sys, int number, int format) {
+    const char *title = book_title(lib, book);
+    const char *borrower = book->is_available ? NULL : student_name(sys, &sys->students[book->borrower]);
     
-    // Free each borrowed book title in borrowed_books array
-    if(student->borrowed_books != NULL) {
-        for(int i = 0; i < student->borrowed_count; i++) {
-            if(student->borrowed_books[i] != NULL) {
-                free(student->borrowed_books[i]);
-                student->borrowed_books[i] = NULL;
-            }
+    if (format == LIST_COMPACT) {
+        // 12. Dune - Frank Herbert (1965, 412 pages) [borrowed by Sam]
+        output_int(out, number);
+        output_string(out, ". ");
+        output_string(out, title);
+        output_string(out, " - ");
+        render_authors(out, lib, book, ", ");
+        output_string(out, " (");
+        output_int(out, book->year);
+        output_string(out, ", ");
+        output_int(out, book->pages);
+        output_string(out, " pages) [");
+        if (borrower != NULL) {
+            output_string(out, "borrowed by ");
+            output_string(out, borrower);
+        } else {
+            output_string(out, "available");
         }
-        
-        // Free the borrowed_books array itself
-        free(student->borrowed_books);
-        student->borrowed_books = NULL;
+        output_string(out, "]\n");
+        return;
     }
     
-    student->student_id = 0;
-    student->borrowed_count = 0;
-    student->max_books = 0;
-}
-
-Student* find_student_by_name(StudentSystem *sys, const char *name) {
-    if (sys == NULL || name == NULL) {
-        return NULL;
+    if (format == LIST_PLAIN) {
+        output_string(out, "Book ");
+        output_int(out, number);
+        output_string(out, "\nTitle: ");
+        output_string(out, title);
+        output_string(out, "\nAuthors: ");
+        render_authors(out, lib, book, "; ");
+        output_string(out, "\nYear: ");
+        output_int(out, book->year);
+        output_string(out, "\nPages: ");
+        output_int(out, book->pages);
+        output_string(out, borrower != NULL ? "\nStatus: Borrowed by " : "\nStatus: Available");
+        if (borrower != NULL) output_string(out, borrower);
+        output_string(out, "\n\n");
+        return;
     }
     
-    for (int i = 0; i < sys->student_count; i++) {
-        if (case_insensitive_search(sys->students[i].name, name)) {
-            return &sys->students[i];
-        }
+    output_string(out, "┌────────────────────────────────────────────────────┐\n");
+    output_string(out, "│               📚 BOOK #");
+    output_int(out, number);
+    output_string(out, " 📚                │\n");
+    output_string(out, "└────────────────────────────────────────────────────┘\n");
+    output_string(out, "📖 Title: ");
+    output_string(out, title);
+    output_string(out, "\n✍️  Authors (");
+    output_int(out, book->author_count);
+    output_string(out, "):\n");
+    for (int j = 0; j < book->author_count; j++) {
+        output_string(out, "   👤 ");
+        output_int(out, j + 1);
+        output_string(out, ". ");
+        output_string(out, book_author(lib, book, j));
+        output_char(out, '\n');
+    }
+    output_string(out, "📅 Year: ");
+    output_int(out, book->year);
+    output_string(out, "\n📜 Pages: ");
+    output_int(out, book->pages);
+    output_char(out, '\n');
+    if (borrower != NULL) {
+        output_string(out, "📚 Status: Borrowed by ");
+        output_string(out, borrower);
+        output_string(out, "\n\n");
+    } else {
+        output_string(out, "✅ Status: Available\n\n");
     }
+}
+
+// Formats books [offset, offset + limit) in catalog order; a negative limit
+// means up to the end. Books are numbered from 1 across pages.
+void render_books(OutputBuffer *out, Library *lib, StudentSystem *sys, int offset, int limit, int format) {
+    int end = lib->book_count;
+    if (offset < 0) offset = 0;
+    if (limit >= 0 && limit < end - offset) end = offset + limit;
     
-    return NULL; 
+    for (int i = offset; i < end && out->ok; i++) {
+        render_book(out, lib, &lib->books[i], sys, i + 1, format);
+    }
 }
 
-Book* find_book_by_title(Library *lib, const char *title) {
-    if (lib == NULL || title == NULL) {
-        return NULL;
+// Same for a list of books picked by a query, numbered from 1
+void render_book_list(OutputBuffer *out, const Library *lib, Book **books, int count, StudentSystem *sys, int format) {
+    for (int i = 0; i < count && out->ok; i++) {
+        render_book(out, lib, books[i], sys, i + 1, format);
     }
-    
-    for (int i = 0; i < lib->book_count; i++) {
-        if (case_insensitive_search(lib->books[i].title, title)) {
-            return &lib->books[i];
-        }
+}
+
+// Non-interactive listing for --list: no banner and no prompts, so it can
+// be piped
+int list_books(Library *lib, StudentSystem *sys, int offset, int limit, int format) {
+    OutputBuffer out = { 1, malloc(OUTPUT_BUFFER_SIZE), 0, 1, OUTPUT_BUFFER_SIZE };
+    if (out.data == NULL) {
+        fprintf(stderr, "list: out of memory\n");
+        return 0;
     }
     
-    return NULL; 
+    fflush(stdout);
+    render_books(&out, lib, sys, offset, limit, format);
+    output_flush(&out);
+    free(out.data);
+    if (!out.ok) {
+        fprintf(stderr, "list: write failed\n");
+    }
+    return out.ok;
 }
 
 /* ================== MAIN FUNCTION ==================== */
 
-int main() {
+int main(int argc, char *argv[]) {
     Library *library = NULL;
+    StudentSystem *student_sys = NULL;
+    Snapshot *snapshot = NULL;
+    const char *snapshot_path = DEFAULT_SNAPSHOT_PATH;
+    const char *journal_path = DEFAULT_JOURNAL_PATH;
+    Journal *journal = NULL;
+    const char *batch_path = NULL;
+    const char *import_path = NULL;
+    const char *export_path = NULL;
+    const char *serve_path = NULL;
+    int shard_count = 0;
+    int worker_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int reserve_books = 0;
+    int list = 0;
+    int list_format = LIST_FANCY;
+    int list_offset = 0;
+    int list_limit = -1;
     int choice;
     int init_capacity = 2; 
     int stud_capacity = 2;
     
-    printf("\n══════════════════════════════════════════════════════════\n");
-    printf("📚 DYNAMIC LIBRARY MANAGEMENT SYSTEM 📚\n");
-    printf("══════════════════════════════════════════════════════════\n");
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journal_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc) {
+            import_path = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc && parse_int(argv[i + 1], &shard_count) && shard_count > 0) {
+            i++;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && parse_int(argv[i + 1], &worker_count) && worker_count > 0) {
+            i++;
+        } else if (strcmp(argv[i], "--reserve") == 0 && i + 1 < argc && parse_int(argv[i + 1], &reserve_books) && reserve_books >= 0) {
+            i++;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            list = 1;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc && (list_format = parse_list_format(argv[i + 1])) >= 0) {
+            i++;
+        } else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc && parse_int(argv[i + 1], &list_offset) && list_offset >= 0) {
+            i++;
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc && parse_int(argv[i + 1], &list_limit) && list_limit >= 0) {
+            i++;
+        } else {
+            printf("Usage: %s [--snapshot FILE] [--journal FILE] [--batch FILE|-]\n"
+                   "          [--import FILE.csv|.tsv] [--export FILE.csv|.tsv] [--reserve BOOKS]\n"
+                   "          [--serve SOCKET] [--workers N] [--shards N]\n"
+                   "          [--list] [--format fancy|plain|compact] [--offset N] [--limit N]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    
+#ifndef LIBRARY_NO_METRICS
+    // Before any worker or scan thread exists, so the watcher alone gets the signals
+    if (!metrics_watch_signals()) {
+        fprintf(stderr, "⚠️  Could not start the metrics signal watcher\n");
+    }
+#endif
+    
+    // A sharded catalog is served by shard processes, each loading its own
+    // part; the router itself holds no books
+    if (shard_count > 0) {
+        if (serve_path == NULL || batch_path != NULL || import_path != NULL || export_path != NULL || list) {
+            fprintf(stderr, "❌ --shards only works with --serve. Exiting.\n");
+            return 1;
+        }
+        return run_router(serve_path, shard_count, worker_count, argv[0], snapshot_path, journal_path) ? 0 : 1;
+    }
+    
+    int non_interactive = batch_path != NULL || import_path != NULL || export_path != NULL || serve_path != NULL || list;
+    if (!non_interactive) {
+        printf("\n══════════════════════════════════════════════════════════\n");
+        printf("📚 DYNAMIC LIBRARY MANAGEMENT SYSTEM 📚\n");
+        printf("══════════════════════════════════════════════════════════\n");
+    }
     
-    library = create_library(init_capacity);
-    if (library == NULL) {
-        printf("❌ Failed to create library. Exiting.\n");
+    // Cold start from the last snapshot; refuse to run over a damaged one
+    // rather than overwrite it with an empty library on exit
+    int loaded = load_snapshot(snapshot_path, &library, &student_sys, &snapshot);
+    if (loaded < 0) {
+        fprintf(stderr, "❌ Could not load '%s'. Move it aside to start fresh. Exiting.\n", snapshot_path);
         return 1;
     }
+    if (loaded) {
+        if (!non_interactive) {
+            printf("💾 Loaded %d books and %d students from '%s'\n",
+                   library->book_count, student_sys->student_count, snapshot_path);
+        }
+    } else {
+        library = create_library(init_capacity);
+        student_sys = create_student_system(stud_capacity);
+    }
     
-    StudentSystem *student_sys = create_student_system(stud_capacity);
+    if (library == NULL || student_sys == NULL) {
+        fprintf(stderr, "❌ Failed to create library. Exiting.\n");
+        return 1;
+    }
+    
+    // Size hint for large loads: allocate the book array and title index once
+    if (reserve_books > 0 &&
+        (!library_reserve(library, reserve_books) || !name_index_reserve(&library->title_index, reserve_books))) {
+        fprintf(stderr, "⚠️  Could not reserve space for %d books, growing on demand instead\n", reserve_books);
+    }
+    
+    // Changes made since the snapshot live in the journal
+    int replayed = 0;
+    journal = open_journal(journal_path, library, student_sys, snapshot != NULL ? snapshot->journal_seq : 0, &replayed);
+    if (journal == NULL) {
+        fprintf(stderr, "❌ Failed to open the journal. Exiting.\n");
+        return 1;
+    }
+    if (replayed > 0 && !non_interactive) {
+        printf("📝 Replayed %d journal record(s) from '%s'\n", replayed, journal_path);
+    }
+    
+    // Import, batch, serving, listing and export run in that order, persist
+    // and leave without a menu
+    if (non_interactive) {
+        int ok = 1;
+        if (import_path != NULL) {
+            ok = import_catalog(import_path, library, student_sys, snapshot_path) && ok;
+        }
+        if (batch_path != NULL) {
+            ok = run_batch(batch_path, library, student_sys, snapshot_path) && ok;
+        }
+        if (serve_path != NULL) {
+            ok = run_server(serve_path, worker_count, library, student_sys, snapshot_path) && ok;
+        }
+        if (list) {
+            ok = list_books(library, student_sys, list_offset, list_limit, list_format) && ok;
+        }
+        if (export_path != NULL) {
+            ok = export_catalog(export_path, library, student_sys) && ok;
+        }
+        ok = compact_journal(journal, snapshot_path, library, student_sys) && ok;
+        close_journal(journal);
+        destroy_library(library);
+        destroy_student_system(student_sys);
+        release_snapshot(snapshot);
+        return ok ? 0 : 1;
+    }
     
     while (1) {
         printf("\n╔══════════════════════════════════════════════════════════╗\n");
@@ -867,6 +1075,8 @@ int main() {
         printf("║  1. 📚 Add Book                                          ║\n");
         printf("║  2. 📋 Display All Books                                 ║\n");
         printf("║  3. 🔍 Search Books                                      ║\n");
+        printf("║  13. 🏅 Ranked Search                                    ║\n");
+        printf("║  14. 📅 Books by Year and Pages                          ║\n");
         printf("║  4. 🗑️  Remove Book                                      ║\n");
         printf("║  5. 📊 Display Statistics                                ║\n");
         printf("║                                                          ║\n");
@@ -881,11 +1091,23 @@ int main() {
         printf("║                                                          ║\n");
         printf("║  📈 REPORTS & CLEANUP                                    ║\n");
         printf("║  12. 📊 Enhanced Statistics                              ║\n");
+        printf("║  16. 💾 Memory Usage                                     ║\n");
+#ifndef LIBRARY_NO_METRICS
+        printf("║  15. ⏱️  Performance Metrics                              ║\n");
+#endif
         printf("║  6. 🚪 Exit                                              ║\n");
         printf("╚══════════════════════════════════════════════════════════╝\n");
         printf("\n🎯 Enter your choice: ");
         
-        scanf("%d", &choice);
+        // End of input exits cleanly (so the journal and snapshot are
+        // flushed); anything that is not a number is an invalid choice
+        int scanned = scanf("%d", &choice);
+        if (scanned == EOF) {
+            choice = 6;
+        } else if (scanned != 1) {
+            scanf("%*[^\n]");
+            choice = -1;
+        }
         
         switch (choice) {
             case 1:
@@ -900,7 +1122,7 @@ int main() {
                 }
                 break;
             case 2:
-                display_all_books(library);
+                display_all_books(library, student_sys);
                 break;
             case 3:
                 {
@@ -911,7 +1133,7 @@ int main() {
                 }
                 break;
             case 4:
-                if (remove_book(library)) {
+                if (remove_book(library, student_sys)) {
                     printf("\n\n✅ ═══════════════════════════════════════════════════════\n");
                     printf("   🗑️ BOOK REMOVED SUCCESSFULLY! 🗑️\n");
                     printf("   ═══════════════════════════════════════════════════════\n");
@@ -928,8 +1150,14 @@ int main() {
                 printf("\n\n🚪 ═══════════════════════════════════════════════════════\n");
                 printf("   🧹 CLEANING UP AND EXITING... 🧹\n");
                 printf("   ═══════════════════════════════════════════════════════\n");
+                if (compact_journal(journal, snapshot_path, library, student_sys)) {
+                    printf("💾 Saved %d books and %d students to '%s'\n",
+                           library->book_count, student_sys->student_count, snapshot_path);
+                }
+                close_journal(journal);
                 cleanup_library(library);
                 cleanup_student_system(student_sys);
+                release_snapshot(snapshot);
                 printf("\n\n👋 ═══════════════════════════════════════════════════════\n");
                 printf("   ✨ GOODBYE! THANKS FOR USING MY LIBRARY SYSTEM! ✨\n");
                 printf("   ═══════════════════════════════════════════════════════\n\n");
@@ -946,7 +1174,7 @@ int main() {
                 }
                 break;
             case 8:
-                display_all_students(student_sys);
+                display_all_students(library, student_sys);
                 break;
             case 9:
                 if (borrow_book(library, student_sys)) {
@@ -971,16 +1199,44 @@ int main() {
                 }
                 break;
             case 11:
-                display_student_books(student_sys);
+                display_student_books(library, student_sys);
                 break;
             case 12:
                 display_enhanced_statistics(library, student_sys);
                 break;
+            case 16:
+                display_memory_usage(library, student_sys);
+                break;
+            case 14:
+                {
+                    int matches = display_books_in_range(library, student_sys);
+                    printf("\n\n📅 ═══════════════════════════════════════════════════════\n");
+                    printf("   📊 RANGE QUERY COMPLETED: %d BOOK(S) FOUND\n", matches);
+                    printf("   ═══════════════════════════════════════════════════════\n");
+                }
+                break;
+            case 13:
+                {
+                    int matches = ranked_search(library);
+                    printf("\n\n🏅 ═══════════════════════════════════════════════════════\n");
+                    printf("   📊 RANKED SEARCH COMPLETED: %d BEST MATCH(ES) SHOWN\n", matches);
+                    printf("   ═══════════════════════════════════════════════════════\n");
+                }
+                break;
+#ifndef LIBRARY_NO_METRICS
+            case 15:
+                display_performance_metrics();
+                break;
+#endif
             default:
                 printf("\n\n⚠️  ═══════════════════════════════════════════════════════\n");
                 printf("   ❌ INVALID CHOICE! PLEASE TRY AGAIN ❌\n");
                 printf("   ═══════════════════════════════════════════════════════\n");
         }
+        
+        // Fold a long journal into a fresh snapshot between operations
+        if (journal_needs_compaction(journal)) {
+            compact_journal(journal, snapshot_path, library, student_sys);
+        }
     }
 }
-
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Machine-readable output after a journal replay: --list and --export -
+# must hold nothing but their rows, whatever the engine had to say while
+# it replayed the journal.
+#
+#   sh tests/replay_output.sh
+set -eu
+
+cd "$(dirname "$0")/.."
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+${CC:-gcc} -O2 -o "$work/library_system" library_system.c library.c -pthread
+
+# A menu session killed after a loan leaves its changes in the journal only
+(printf '1\nDune\n1\nFrank Herbert\n1965\n412\n'
+ printf '1\nEmma\n1\nJane Austen\n1815\n474\n'
+ printf '7\n1\nAlice Smith\n9\nAlice Smith\nDune\n'
+ sleep 2) | "$work/library_system" --snapshot "$work/library.snap" --journal "$work/library.wal" >/dev/null 2>&1 &
+session=$!
+sleep 1
+kill -9 "$session" 2>/dev/null || true
+wait "$session" 2>/dev/null || true
+if [ ! -s "$work/library.wal" ]; then
+    echo "FAIL: the session left no journal to replay"
+    exit 1
+fi
+cp "$work/library.wal" "$work/library.wal.saved"
+
+run() {
+    cp "$work/library.wal.saved" "$work/library.wal"
+    rm -f "$work/library.snap"
+    "$work/library_system" --snapshot "$work/library.snap" --journal "$work/library.wal" "$@" 2>/dev/null
+}
+
+# Compact listing: one "N. title - authors (year, pages pages)" line per book
+run --list --format compact > "$work/list.txt"
+awk '
+    !/^[0-9]+\. .* - .* \([0-9]+, [0-9]+ pages\) \[(available|borrowed by .*)\]$/ { print "FAIL: --list line " NR ": " $0; bad = 1 }
+    END { if (NR != 2) { print "FAIL: --list gave " NR " lines, expected 2"; bad = 1 } exit bad }
+' "$work/list.txt"
+
+# CSV export: the header, then six fields per book
+run --export - > "$work/export.csv"
+awk -F, '
+    NR == 1 && $0 != "title,authors,year,pages,available,borrowed_by" { print "FAIL: --export header: " $0; bad = 1 }
+    NR > 1 && (NF != 6 || $3 !~ /^[0-9]+$/ || $4 !~ /^[0-9]+$/ || $5 !~ /^[01]$/) { print "FAIL: --export line " NR ": " $0; bad = 1 }
+    END { if (NR != 3) { print "FAIL: --export gave " NR " lines, expected 3"; bad = 1 } exit bad }
+' "$work/export.csv"
+grep -q '^Dune,Frank Herbert,1965,412,0,Alice Smith$' "$work/export.csv" || { echo "FAIL: the replayed loan is missing"; exit 1; }
+
+echo "PASS: --list and --export - are clean after a journal replay"